@@ -8,6 +8,7 @@
 #include "scene/gl_scene/spot_light.h"
 #include "scene/gl_scene/sphere.h"
 #include "scene/gl_scene/mesh.h"
+#include "scene/gl_scene/mesh_instance.h"
 
 using Collada::CameraInfo;
 using Collada::LightInfo;
@@ -34,7 +35,15 @@ namespace CGL {
                 config.pathtracer_direct_hemisphere_sample,
                 config.pathtracer_filename,
                 config.pathtracer_lensRadius,
-                config.pathtracer_focalDistance
+                config.pathtracer_focalDistance,
+                config.pathtracer_bvh_build_method,
+                config.pathtracer_bvh_layout,
+                config.pathtracer_bvh_split_budget,
+                config.pathtracer_bvh_cache_dir,
+                config.pathtracer_bvh_precision,
+                config.pathtracer_bvh_node_order,
+                config.pathtracer_bvh_per_object,
+                config.pathtracer_wavefront
         );
         filename = config.pathtracer_filename;
     }
@@ -231,6 +240,7 @@ namespace CGL {
         vector<Collada::Node> &nodes = sceneInfo->nodes;
         vector<GLScene::SceneLight *> lights;
         vector<GLScene::SceneObject *> objects;
+        map<PolymeshInfo *, pair<GLScene::Mesh *, Matrix4x4>> meshes;
 
         // save camera position to update camera control later
         CameraInfo *c;
@@ -259,10 +269,23 @@ namespace CGL {
                     objects.push_back(
                             init_sphere(static_cast<SphereInfo &>(*instance), transform));
                     break;
-                case Collada::Instance::POLYMESH:
-                    objects.push_back(
-                            init_polymesh(static_cast<PolymeshInfo &>(*instance), transform));
+                case Collada::Instance::POLYMESH: {
+                    // the first node placing a mesh loads it, the others
+                    // become instances relative to that node
+                    PolymeshInfo *polymesh = static_cast<PolymeshInfo *>(instance);
+                    auto loaded = meshes.find(polymesh);
+                    if (loaded == meshes.end()) {
+                        GLScene::Mesh *mesh = init_polymesh(*polymesh, transform);
+                        meshes[polymesh] = make_pair(mesh, transform);
+                        objects.push_back(mesh);
+                    }
+                    else {
+                        GLScene::Mesh *mesh = loaded->second.first;
+                        const Matrix4x4 &mesh_transform = loaded->second.second;
+                        objects.push_back(new GLScene::MeshInstance(mesh, transform * mesh_transform.inv()));
+                    }
                     break;
+                }
                 case Collada::Instance::MATERIAL:
                     init_material(static_cast<MaterialInfo &>(*instance));
                     break;
@@ -350,7 +373,7 @@ namespace CGL {
         return new GLScene::Sphere(sphere, position, scale);
     }
 
-    GLScene::SceneObject *Application::init_polymesh(
+    GLScene::Mesh *Application::init_polymesh(
             PolymeshInfo &polymesh, const Matrix4x4 &transform) {
         return new GLScene::Mesh(polymesh, transform);
     }
@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <string>
 #include <vector>
+#include <map>
 
 // libCGL
 #include "CGL/CGL.h"
@@ -23,6 +24,7 @@
 
 // MeshEdit
 #include "scene/gl_scene/scene.h"
+#include "scene/gl_scene/mesh.h"
 #include "util/halfEdgeMesh.h"
 #include "application/meshEdit.h"
 
@@ -62,6 +64,15 @@ namespace CGL {
             pathtracer_filename = "";
             pathtracer_lensRadius = 0.0;
             pathtracer_focalDistance = 4.7;
+
+            pathtracer_bvh_build_method = SceneObjects::BVH_BUILD_SAH;
+            pathtracer_bvh_layout = SceneObjects::BVH_LAYOUT_WIDE;
+            pathtracer_bvh_split_budget = 0.3;
+            pathtracer_bvh_cache_dir = "";
+            pathtracer_bvh_precision = SceneObjects::BVH_PRECISION_DOUBLE;
+            pathtracer_bvh_node_order = SceneObjects::BVH_ORDER_DEPTH_FIRST;
+            pathtracer_bvh_per_object = false;
+            pathtracer_wavefront = false;
         }
 
         size_t pathtracer_ns_aa;
@@ -84,6 +95,15 @@ namespace CGL {
 
         double pathtracer_lensRadius;
         double pathtracer_focalDistance;
+
+        SceneObjects::BVHBuildMethod pathtracer_bvh_build_method;
+        SceneObjects::BVHLayout pathtracer_bvh_layout;
+        double pathtracer_bvh_split_budget;
+        string pathtracer_bvh_cache_dir;
+        SceneObjects::BVHPrecision pathtracer_bvh_precision;
+        SceneObjects::BVHNodeOrder pathtracer_bvh_node_order;
+        bool pathtracer_bvh_per_object;
+        bool pathtracer_wavefront;
     };
 
     class Application : public Renderer {
@@ -184,7 +204,7 @@ namespace CGL {
 
         GLScene::SceneObject *init_sphere(Collada::SphereInfo &polymesh, const Matrix4x4 &transform);
 
-        GLScene::SceneObject *init_polymesh(Collada::PolymeshInfo &polymesh, const Matrix4x4 &transform);
+        GLScene::Mesh *init_polymesh(Collada::PolymeshInfo &polymesh, const Matrix4x4 &transform);
 
         void init_material(Collada::MaterialInfo &material);
 
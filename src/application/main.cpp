@@ -40,6 +40,14 @@ void usage(const char *binaryName) {
     printf("  -d  <FLOAT>      The focal distance\n");
     printf("  -f  <FILENAME>   Image (.png) file to save output to in windowless mode\n");
     printf("  -r  <INT> <INT>  Width and height of output image (if windowless)\n");
+    printf("  -B  <NAME>       BVH build method: sah (default), median, lbvh, hlbvh or sbvh\n");
+    printf("  -S  <FLOAT>      SBVH split budget: extra references per primitive (default 0.3)\n");
+    printf("  -C  <DIR>        Directory to cache built BVHs in, reused while the geometry is unchanged\n");
+    printf("  -L  <NAME>       BVH node layout: wide (default, SIMD), compressed (wide, 8 bit bounds) or binary\n");
+    printf("  -P  <NAME>       Triangle test precision: double (default) or float (watertight)\n");
+    printf("  -O  <NAME>       BVH node order: depth (default), treelet or profiled (from a warm-up render)\n");
+    printf("  -A  <NAME>       BVH granularity: scene (default, updated after edits) or object (cached per mesh)\n");
+    printf("  -I  <NAME>       Integrator: pixel (default, one path at a time) or wavefront (paths traced in stages)\n");
     printf("  -h               Print this help message\n");
     printf("\n");
 }
@@ -91,7 +99,7 @@ int main(int argc, char **argv) {
     bool write_to_file = false;
     size_t w = 0, h = 0, x = -1, y = 0, dx = 0, dy = 0;
     string filename, cam_settings = "";
-    while ((opt = getopt(argc, argv, "s:l:t:m:e:h:H:f:r:c:b:d:a:p:")) != -1) {  // for each option...
+    while ((opt = getopt(argc, argv, "s:l:t:m:e:h:H:f:r:c:b:d:a:p:B:L:S:C:P:O:A:I:")) != -1) {  // for each option...
         switch (opt) {
             case 'f':
                 write_to_file = true;
@@ -131,6 +139,12 @@ int main(int argc, char **argv) {
             case 'b':
                 config.pathtracer_lensRadius = atof(optarg);
                 break;
+            case 'S':
+                config.pathtracer_bvh_split_budget = atof(optarg);
+                break;
+            case 'C':
+                config.pathtracer_bvh_cache_dir = optarg;
+                break;
             case 'd':
                 config.pathtracer_focalDistance = atof(optarg);
                 break;
@@ -139,6 +153,93 @@ int main(int argc, char **argv) {
                 config.pathtracer_max_tolerance = atof(argv[optind]);
                 optind++;
                 break;
+            case 'B':
+                if (string(optarg) == "median") {
+                    config.pathtracer_bvh_build_method = SceneObjects::BVH_BUILD_MEDIAN;
+                }
+                else if (string(optarg) == "sah") {
+                    config.pathtracer_bvh_build_method = SceneObjects::BVH_BUILD_SAH;
+                }
+                else if (string(optarg) == "lbvh") {
+                    config.pathtracer_bvh_build_method = SceneObjects::BVH_BUILD_LBVH;
+                }
+                else if (string(optarg) == "hlbvh") {
+                    config.pathtracer_bvh_build_method = SceneObjects::BVH_BUILD_HLBVH;
+                }
+                else if (string(optarg) == "sbvh") {
+                    config.pathtracer_bvh_build_method = SceneObjects::BVH_BUILD_SBVH;
+                }
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'L':
+                if (string(optarg) == "wide") {
+                    config.pathtracer_bvh_layout = SceneObjects::BVH_LAYOUT_WIDE;
+                }
+                else if (string(optarg) == "compressed") {
+                    config.pathtracer_bvh_layout = SceneObjects::BVH_LAYOUT_COMPRESSED;
+                }
+                else if (string(optarg) == "binary") {
+                    config.pathtracer_bvh_layout = SceneObjects::BVH_LAYOUT_BINARY;
+                }
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'P':
+                if (string(optarg) == "double") {
+                    config.pathtracer_bvh_precision = SceneObjects::BVH_PRECISION_DOUBLE;
+                }
+                else if (string(optarg) == "float") {
+                    config.pathtracer_bvh_precision = SceneObjects::BVH_PRECISION_FLOAT;
+                }
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'O':
+                if (string(optarg) == "depth") {
+                    config.pathtracer_bvh_node_order = SceneObjects::BVH_ORDER_DEPTH_FIRST;
+                }
+                else if (string(optarg) == "treelet") {
+                    config.pathtracer_bvh_node_order = SceneObjects::BVH_ORDER_TREELET;
+                }
+                else if (string(optarg) == "profiled") {
+                    config.pathtracer_bvh_node_order = SceneObjects::BVH_ORDER_PROFILED;
+                }
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'A':
+                if (string(optarg) == "scene") {
+                    config.pathtracer_bvh_per_object = false;
+                }
+                else if (string(optarg) == "object") {
+                    config.pathtracer_bvh_per_object = true;
+                }
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'I':
+                if (string(optarg) == "pixel") {
+                    config.pathtracer_wavefront = false;
+                }
+                else if (string(optarg) == "wavefront") {
+                    config.pathtracer_wavefront = true;
+                }
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
             case 'H':
                 config.pathtracer_direct_hemisphere_sample = true;
                 optind--;
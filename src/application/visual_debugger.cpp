@@ -172,6 +172,7 @@ namespace CGL {
               if (ImGui::Button("Test Intersect"))
               {
                 success = t.intersect(r, &isect);
+                if (success) t.finish_intersection(r, &isect);
               }
 
               if (success)
@@ -206,6 +207,7 @@ namespace CGL {
               if (ImGui::Button("Test Intersect"))
               {
                 success = s.intersect(r, &isect);
+                if (success) s.finish_intersection(r, &isect);
               }
 
               if (success)
@@ -1,4 +1,5 @@
 #include "bsdf.h"
+#include "spectrum.h"
 
 #include <algorithm>
 #include <iostream>
@@ -12,13 +13,8 @@ using std::swap;
 
 namespace CGL {
     // helper function
-    Vector3D BSDF::wavelength_dependent_BSDF(double wavelength, Vector3D reflectance) {
-        double red_cof = 1.0 / (wavelength - 600);
-        double green_cof = 1.0 / (wavelength - 550);
-        double blue_cof = 1.0 / (wavelength - 450);
-        double N = red_cof + green_cof + blue_cof;
-        double albedo = (red_cof * reflectance[0] + green_cof * reflectance[1] + blue_cof * reflectance[2]) / N;
-        return albedo;
+    double BSDF::wavelength_dependent_BSDF(double wavelength, const Vector3D &reflectance) {
+        return spectrumTable.at(wavelength, reflectance);
     }
 
 // Mirror BSDF //
@@ -84,15 +80,29 @@ namespace CGL {
         return F;
     }
 
+    Vector3D MicrofacetBSDF::f_geometric(const Vector3D wo, const Vector3D wi) {
+        Vector3D h = ((wo + wi) / 2).unit();
+        Vector3D up = F(wi) * G(wo, wi) * D(h);
+        double down = 4 * dot(Vector3D(0, 0, 1.0), wo) * dot(Vector3D(0, 0, 1.0), wi);
+        return up / down;
+    }
+
     Vector3D MicrofacetBSDF::f(const Vector3D wo, const Vector3D wi, double wavelength) {
         Vector3D ans(0.0, 0.0, 0.0);
         if (wo.z >= 0) {
-            Vector3D h = ((wo + wi) / 2).unit();
-            Vector3D up = F(wi) * G(wo, wi) * D(h);
-            double down = 4 * dot(Vector3D(0, 0, 1.0), wo) * dot(Vector3D(0, 0, 1.0), wi);
-            ans = up / down;
-            auto f = wavelength_dependent_BSDF(wavelength, ans);
-            ans = f * wavelength / 300;
+            ans = f_geometric(wo, wi);
+            ans = Vector3D(wavelength_dependent_BSDF(wavelength, ans) * wavelength / 300);
+        }
+        return ans;
+    }
+
+    Vector3D MicrofacetBSDF::f_spectral(const Vector3D wo, const Vector3D wi, const Vector3D &wavelengths) {
+        Vector3D ans(0.0, 0.0, 0.0);
+        if (wo.z >= 0) {
+            // the Fresnel, shadowing and distribution terms are shared by all the wavelengths
+            Vector3D geometric = f_geometric(wo, wi);
+            for (int c = 0; c < 3; c++)
+                ans[c] = wavelength_dependent_BSDF(wavelengths[c], geometric) * wavelengths[c] / 300;
         }
         return ans;
     }
@@ -134,6 +144,21 @@ namespace CGL {
         return ans;
     }
 
+/**
+ * The density of the Beckmann half vector sampled by sample_f, mapped to the
+ * incident direction.
+ */
+    double MicrofacetBSDF::pdf(const Vector3D wo, const Vector3D wi) {
+        if (wi.z < 0) return 0;
+        Vector3D h = (wo + wi).unit();
+        double cos_h = h.z;
+        if (cos_h <= 0) return 0;
+        double tan_h_2 = (1 - cos_h * cos_h) / (cos_h * cos_h);
+
+        double pwh = exp(-tan_h_2 / (alpha * alpha)) / (PI * alpha * alpha * cos_h * cos_h * cos_h);
+        return pwh / (4 * dot(wi, h));
+    }
+
     void MicrofacetBSDF::render_debugger_node() {
         if (ImGui::TreeNode(this, "Micofacet BSDF")) {
             DragDouble3("eta", &eta[0], 0.005);
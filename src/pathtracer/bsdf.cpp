@@ -5,6 +5,7 @@
 #include "application/visual_debugger.h"
 
 #include <algorithm>
+#include <cassert>
 #include <iostream>
 #include <utility>
 
@@ -39,6 +40,29 @@ namespace CGL {
         o2w[2] = z;
     }
 
+    Vector3D BSDF::f_spectral(const Vector3D wo, const Vector3D wi, const Vector3D &wavelengths) {
+        Vector3D value;
+        for (int c = 0; c < 3; c++)
+            value[c] = f(wo, wi, wavelengths[c])[c];
+        return value;
+    }
+
+    Vector3D BSDF::sample_f_spectral(const Vector3D wo, Vector3D *wi, double *pdf,
+                                     const Vector3D &wavelengths, int hero) {
+        Vector3D value = sample_f(wo, wi, pdf, wavelengths[hero]);
+        if (is_dispersive()) {
+            // the path was split into one path per wavelength before this vertex
+            assert(wavelengths[(hero + 1) % 3] == 0 && wavelengths[(hero + 2) % 3] == 0);
+            Vector3D single;
+            single[hero] = value[hero];
+            return single;
+        }
+
+        // the other delta BSDFs scatter all the wavelengths alike
+        if (*pdf == 0 || is_delta()) return value;
+        return f_spectral(wo, *wi, wavelengths);
+    }
+
 /**
  * Evaluate diffuse lambertian BSDF.
  * Given incident light direction wi and outgoing light direction wo. Note
@@ -71,6 +95,14 @@ namespace CGL {
         return R * alpha;
     }
 
+/**
+ * The reflectance does not depend on the wavelength, a single evaluation
+ * serves all the channels.
+ */
+    Vector3D DiffuseBSDF::f_spectral(const Vector3D wo, const Vector3D wi, const Vector3D &wavelengths) {
+        return f(wo, wi, wavelengths[0]);
+    }
+
 /**
  * Evalutate diffuse lambertian BSDF.
  */
@@ -87,6 +119,13 @@ namespace CGL {
         return f(wo, *wi, wavelength);
     }
 
+/**
+ * Cosine weighted, as the samples of sample_f.
+ */
+    double DiffuseBSDF::pdf(const Vector3D wo, const Vector3D wi) {
+        return std::max(wi.z, 0.0) / PI;
+    }
+
     void DiffuseBSDF::render_debugger_node() {
         if (ImGui::TreeNode(this, "Diffuse BSDF")) {
             DragDouble3("Reflectance", &reflectance[0], 0.005);
@@ -83,6 +83,38 @@ namespace CGL {
          */
         virtual Vector3D sample_f(const Vector3D wo, Vector3D *wi, double *pdf, double wavelength) = 0;
 
+        /**
+         * Density with which sample_f picks the incident direction wi given the
+         * outgoing direction wo, both in local space. Delta BSDFs return zero,
+         * light samples never fall on their directions.
+         */
+        virtual double pdf(const Vector3D wo, const Vector3D wi) = 0;
+
+        /**
+         * Evaluate BSDF for the wavelengths a path carries, one per color channel.
+         * Channel c of the result is channel c of f at wavelengths[c]. By default
+         * f is evaluated once per wavelength.
+         * \param wavelengths wavelength of each color channel
+         */
+        virtual Vector3D f_spectral(const Vector3D wo, const Vector3D wi, const Vector3D &wavelengths);
+
+        /**
+         * Sample the BSDF at the hero wavelength and evaluate the sampled
+         * direction for all the wavelengths, as f_spectral. A dispersive BSDF
+         * bends each wavelength its own way, so the integrators split a path
+         * into one path per wavelength before it reaches one, and only rays
+         * carrying their hero wavelength alone are sampled there.
+         * \param wavelengths wavelength of each color channel
+         * \param hero color channel of the hero wavelength
+         */
+        Vector3D sample_f_spectral(const Vector3D wo, Vector3D *wi, double *pdf,
+                                   const Vector3D &wavelengths, int hero);
+
+        /**
+         * If the sampled direction of the BSDF depends on the wavelength.
+         */
+        virtual bool is_dispersive() const { return false; }
+
         /**
          * Get the emission value of the surface material. For non-emitting surfaces
          * this would be a zero energy Vector3D.
@@ -114,7 +146,11 @@ namespace CGL {
         const HDRImageBuffer *reflectanceMap;
         const HDRImageBuffer *normalMap;
 
-        Vector3D wavelength_dependent_BSDF(double wavelength, Vector3D reflectance);
+        /**
+         * Value at the given wavelength of a reflectance given in RGB, weighted
+         * by the precomputed response of each color channel to the wavelength.
+         */
+        double wavelength_dependent_BSDF(double wavelength, const Vector3D &reflectance);
     }; // class BSDF
 
 /**
@@ -131,8 +167,12 @@ namespace CGL {
 
         Vector3D f(const Vector3D wo, const Vector3D wi, double wavelength);
 
+        Vector3D f_spectral(const Vector3D wo, const Vector3D wi, const Vector3D &wavelengths);
+
         Vector3D sample_f(const Vector3D wo, Vector3D *wi, double *pdf, double wavelength);
 
+        double pdf(const Vector3D wo, const Vector3D wi);
+
         Vector3D get_emission() const { return Vector3D(); }
 
         bool is_delta() const { return false; }
@@ -184,8 +224,12 @@ namespace CGL {
 
         Vector3D f(const Vector3D wo, const Vector3D wi, double wavelength);
 
+        Vector3D f_spectral(const Vector3D wo, const Vector3D wi, const Vector3D &wavelengths);
+
         Vector3D sample_f(const Vector3D wo, Vector3D *wi, double *pdf, double wavelength);
 
+        double pdf(const Vector3D wo, const Vector3D wi);
+
         Vector3D get_emission() const { return Vector3D(); }
 
         bool is_delta() const { return false; }
@@ -193,6 +237,12 @@ namespace CGL {
         void render_debugger_node();
 
     private:
+
+        /**
+         * The part of f shared by all the wavelengths.
+         */
+        Vector3D f_geometric(const Vector3D wo, const Vector3D wi);
+
         Vector3D eta, k;
         double alpha;
         UniformGridSampler2D sampler;
@@ -211,6 +261,8 @@ namespace CGL {
 
         Vector3D sample_f(const Vector3D wo, Vector3D *wi, double *pdf, double wavelength);
 
+        double pdf(const Vector3D wo, const Vector3D wi) { return 0; }
+
         Vector3D get_emission() const { return Vector3D(); }
 
         bool is_delta() const { return true; }
@@ -237,10 +289,14 @@ namespace CGL {
 
         Vector3D sample_f(const Vector3D wo, Vector3D *wi, double *pdf, double wavelength);
 
+        double pdf(const Vector3D wo, const Vector3D wi) { return 0; }
+
         Vector3D get_emission() const { return Vector3D(); }
 
         bool is_delta() const { return true; }
 
+        bool is_dispersive() const { return true; }
+
         void render_debugger_node();
 
     private:
@@ -266,10 +322,14 @@ namespace CGL {
 
         Vector3D sample_f(const Vector3D wo, Vector3D *wi, double *pdf, double wavelength);
 
+        double pdf(const Vector3D wo, const Vector3D wi) { return 0; }
+
         Vector3D get_emission() const { return Vector3D(); }
 
         bool is_delta() const { return true; }
 
+        bool is_dispersive() const { return true; }
+
         void render_debugger_node();
 
     private:
@@ -293,6 +353,8 @@ namespace CGL {
 
         Vector3D sample_f(const Vector3D wo, Vector3D *wi, double *pdf, double wavelength);
 
+        double pdf(const Vector3D wo, const Vector3D wi) { return std::max(wi.z, 0.0) / PI; }
+
         Vector3D get_emission() const { return radiance; }
 
         bool is_delta() const { return false; }
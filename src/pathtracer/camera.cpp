@@ -3,13 +3,13 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
-#include <chrono>
-#include <random>
 
 #include "CGL/misc.h"
 #include "CGL/vector2D.h"
 #include "CGL/vector3D.h"
 
+#include "pathtracer/sampler.h"
+
 using std::cout;
 using std::endl;
 using std::max;
@@ -21,6 +21,10 @@ namespace CGL {
 
     using Collada::CameraInfo;
 
+    // wavelength distribution of the R, G and B channels
+    static const WavelengthSampler1D channelWavelengths[3] = {
+            WavelengthSampler1D(620, 30), WavelengthSampler1D(530, 30), WavelengthSampler1D(465, 15)};
+
 /**
  * Sets the field of view to match screen screenW/H.
  * NOTE: data and screenW/H will almost certainly disagree about the aspect
@@ -220,23 +224,18 @@ namespace CGL {
         auto dir = Vector3D(u, v, -1);
         auto origin = Vector3D(0, 0, 0);
 
-        // wavelength generators
-        unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-        std::default_random_engine generator(seed);
-        std::normal_distribution<double> R(620, 30);
-        std::normal_distribution<double> G(530, 30);
-        std::normal_distribution<double> B(465, 15);
-        std::vector wavelengthList = {R, G, B};
-
         auto ray = Ray(origin, dir);
         ray.min_t = nClip;
         ray.max_t = fClip;
         ray.o = pos;
         ray.d = c2w * ray.d;
         ray.d.normalize();
+        ray.inv_d = 1.0 / ray.d;
 
         ray.color = color;
-        ray.wavelength = wavelengthList[color](generator);
+        for (int c = 0; c < 3; c++)
+            ray.wavelengths[c] = channelWavelengths[c].get_sample();
+        ray.wavelength = ray.wavelengths[color];
 
         return ray;
     }
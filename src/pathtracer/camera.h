@@ -100,6 +100,12 @@ namespace CGL {
          * \param y y-coordinate of the ray sample in the view plane
          */
         Ray generate_ray(double x, double y) const;
+
+        /**
+         * Same as above, the ray also carries a wavelength sampled for each
+         * color channel, the one of the given channel being its hero.
+         * \param color color channel of the hero wavelength
+         */
         Ray generate_ray(double x, double y, int color) const;
 
         Ray generate_ray_for_thin_lens(double x, double y, double rndR, double rndTheta) const;
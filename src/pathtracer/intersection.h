@@ -16,15 +16,19 @@ namespace CGL {
 
 /**
  * A record of an intersection point which includes the time of intersection
- * and other information needed for shading
+ * and other information needed for shading. Traversal only records t, the
+ * primitive and the barycentric coordinates of the hit, the normal and the
+ * BSDF are filled in by Primitive::finish_intersection for the closest hit.
  */
         struct Intersection {
 
-            Intersection() : t(INF_D), primitive(NULL), bsdf(NULL) {}
+            Intersection() : t(INF_D), primitive(NULL), u(0), v(0), bsdf(NULL) {}
 
             double t;    ///< time of intersection
 
-            const Primitive *primitive;  ///< the primitive intersected
+            const Primitive *primitive;  ///< the primitive intersected, the instance for instanced geometry
+
+            double u, v; ///< barycentric coordinates of the hit on the primitive
 
             Vector3D n;  ///< normal at point of intersection
 
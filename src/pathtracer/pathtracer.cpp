@@ -1,4 +1,5 @@
 #include "pathtracer.h"
+#include "spectrum.h"
 
 #include "scene/light.h"
 #include "scene/sphere.h"
@@ -6,7 +7,6 @@
 #include <random>
 #include <chrono>
 
-#define SAMPLE_PER_COLOR 16
 #define COLOR_TEMPERATURE 40000
 
 using namespace CGL::SceneObjects;
@@ -21,6 +21,8 @@ namespace CGL {
         tm_level = 1.0f;
         tm_key = 0.18;
         tm_wht = 5.0f;
+
+        white_balance = CGL::white_balance(COLOR_TEMPERATURE);
     }
 
     PathTracer::~PathTracer() {
@@ -78,7 +80,7 @@ namespace CGL {
 
         for (int i = 0; i < num_samples; i++) {
             auto w_in = hemisphereSampler->get_sample();
-            auto f = isect.bsdf->f(w_out, w_in, r.wavelength) * (2 * PI);
+            auto f = isect.bsdf->f_spectral(w_out, w_in, r.wavelengths) * (2 * PI);
             auto wi = o2w * w_in;
             auto nextRay = Ray(hit_p, wi);
             nextRay.min_t = EPS_F;
@@ -113,26 +115,50 @@ namespace CGL {
         const Vector3D w_out = w2o * (-r.d);
         Vector3D L_out;
 
-        for (auto light: scene->lights) {
-            if (!light->is_delta_light()) {
-                for (int i = 0; i < ns_area_light; i++) {
-                    Vector3D wi;
-                    double distToLight, pdf;
-
-                    Vector3D lightIntensity = light->sample_L(hit_p, &wi, &distToLight, &pdf);
+        // per thread, the reference that last blocked a shadow ray toward each
+        // light, which likely blocks the next one as well
+        static thread_local std::vector<uint32_t> last_occluder;
+        if (last_occluder.size() != scene->lights.size())
+            last_occluder.assign(scene->lights.size(), BVH_NO_OCCLUDER);
 
-                    if (pdf == 0) continue;
+        // the path goes on from here with a BSDF sampled bounce, which also finds the lights
+        bool mis = r.depth > 0;
 
-                    auto f = isect.bsdf->f(w_out, w2o * wi, r.wavelength);
-                    auto nextRay = Ray(hit_p, wi);
-                    nextRay.min_t = EPS_F;
-                    nextRay.max_t = distToLight - EPS_F;
-                    nextRay.color = r.color;
-                    nextRay.wavelength = r.wavelength;
+        for (size_t l = 0; l < scene->lights.size(); l++) {
+            auto light = scene->lights[l];
+            if (!light->is_delta_light()) {
+                // shadow rays from the hit point toward the same light are
+                // coherent, so they are tested as packets
+                for (int start = 0; start < ns_area_light; start += BVH_PACKET_SIZE) {
+                    Ray shadowRays[BVH_PACKET_SIZE];
+                    Vector3D contributions[BVH_PACKET_SIZE];
+                    bool occluded[BVH_PACKET_SIZE];
+                    int count = 0;
+
+                    for (int i = start; i < std::min<int>(ns_area_light, start + BVH_PACKET_SIZE); i++) {
+                        Vector3D wi;
+                        double distToLight, pdf;
+
+                        Vector3D lightIntensity = light->sample_L(hit_p, &wi, &distToLight, &pdf);
+
+                        if (pdf == 0) continue;
+
+                        auto w_in = w2o * wi;
+                        auto f = isect.bsdf->f_spectral(w_out, w_in, r.wavelengths);
+                        auto nextRay = Ray(hit_p, wi);
+                        nextRay.min_t = EPS_F;
+                        nextRay.max_t = distToLight - EPS_F;
+                        nextRay.color = r.color;
+                        nextRay.wavelength = r.wavelength;
+
+                        double weight = mis ? light_sample_weight(light, hit_p, wi, isect.bsdf->pdf(w_out, w_in)) : 1;
+                        shadowRays[count] = nextRay;
+                        contributions[count++] = f * lightIntensity / pdf / (double) ns_area_light * weight;
+                    }
 
-                    if (bvh->has_intersection(nextRay)) continue;
-                    L_out +=
-                            f * lightIntensity / pdf / (double) ns_area_light;
+                    bvh->has_intersection_packet(shadowRays, occluded, count, &last_occluder[l]);
+                    for (int i = 0; i < count; i++)
+                        if (!occluded[i]) L_out += contributions[i];
                 }
             }
             else {
@@ -143,12 +169,12 @@ namespace CGL {
 
                 if (pdf == 0) continue;
 
-                auto f = isect.bsdf->f(w_out, w2o * wi, r.wavelength);
+                auto f = isect.bsdf->f_spectral(w_out, w2o * wi, r.wavelengths);
                 auto nextRay = Ray(hit_p, wi);
                 nextRay.min_t = EPS_F;
                 nextRay.max_t = distToLight - EPS_F;
 
-                if (bvh->has_intersection(nextRay)) continue;
+                if (bvh->has_intersection(nextRay, &last_occluder[l])) continue;
                 L_out += f * lightIntensity / pdf;
             }
         }
@@ -156,6 +182,36 @@ namespace CGL {
         return L_out;
     }
 
+    double PathTracer::light_sample_weight(const SceneLight *light, const Vector3D &hit_p, const Vector3D &wi,
+                                           double bsdf_pdf) {
+        double distToLight;
+        double light_pdf = light->pdf(hit_p, wi, &distToLight);
+        if (light_pdf == 0) return 1;
+        return power_heuristic(ns_area_light * light_pdf, bsdf_pdf);
+    }
+
+    Vector3D PathTracer::bsdf_sampled_radiance(const Ray &r, const Intersection &isect, bool hit, double pdf) {
+        Vector3D L;
+        if (hit)
+            L = zero_bounce_radiance(r, isect);
+        else if (envLight)
+            L = envLight->sample_dir(r);
+        if (pdf == 0 || L == Vector3D()) return L;
+
+        // the density with which the light samples of the vertex find the same
+        // light: the one whose surface the ray hit, or one at infinity if it missed
+        double light_pdf = 0;
+        for (SceneLight *light: scene->lights) {
+            if (light->is_delta_light()) continue;
+            double distToLight;
+            double p = light->pdf(r.o, r.d, &distToLight);
+            if (p == 0) continue;
+            if (hit ? fabs(distToLight - isect.t) <= 1e-3 * isect.t : distToLight == INF_D)
+                light_pdf += ns_area_light * p;
+        }
+        return L * power_heuristic(pdf, light_pdf);
+    }
+
     Vector3D PathTracer::zero_bounce_radiance(const Ray &r,
                                               const Intersection &isect) {
         // TODO: Part 3, Task 2
@@ -178,46 +234,97 @@ namespace CGL {
             return estimate_direct_lighting_importance(r, isect);
     }
 
+    /**
+     * Everything a path carries from one vertex to the next.
+     */
+    struct PathState {
+        Ray ray;              ///< ray that reached the current vertex
+        Intersection isect;   ///< current vertex
+        Vector3D throughput;  ///< f cos / pdf of the bounces so far, over their survival probabilities
+    };
+
     Vector3D PathTracer::at_least_one_bounce_radiance(const Ray &r,
                                                       const Intersection &isect) {
-        Matrix3x3 o2w;
-        make_coord_space(o2w, isect.n);
-        Matrix3x3 w2o = o2w.T();
-
-        Vector3D hit_p = r.o + r.d * isect.t;
-        Vector3D w_out = w2o * (-r.d);
+        PathState path;
+        path.ray = r;
+        path.isect = isect;
+        path.throughput = Vector3D(1, 1, 1);
 
         Vector3D L_out(0, 0, 0);
 
-        // TODO: Part 4, Task 2
-        // Returns the one bounce radiance + radiance from extra bounces at this point.
-        // Should be called recursively to simulate extra bounces.
-        if (!isect.bsdf->is_delta())
-            L_out += one_bounce_radiance(r, isect);
-        // enable it if indirect only
-        // if (r.depth == max_ray_depth) L_out = Vector3D(0, 0, 0);
-        if (r.depth == 0) return L_out;
-
-
-        Vector3D w_in;
-        double pdf;
-
-        auto f = isect.bsdf->sample_f(w_out, &w_in, &pdf, r.wavelength);
-        auto wi = o2w * w_in;
-        auto ray = Ray(hit_p, wi);
-        ray.depth = r.depth - 1;
-        ray.min_t = EPS_F;
-        ray.max_t = INF_D - EPS_F;
-        ray.color = r.color;
-        ray.wavelength = r.wavelength;
-
-        Intersection shadowIsect;
-        if (bvh->intersect(ray, &shadowIsect) && coin_flip(0.7)) {
-            auto L = at_least_one_bounce_radiance(ray, shadowIsect);
-            if (isect.bsdf->is_delta())
-                L += zero_bounce_radiance(ray, shadowIsect);
-            auto f_l = f * L;
-            L_out += f_l * abs_cos_theta(w_in) / pdf / 0.7;
+        // paths split off at a dispersive interface, waiting to be traced
+        PathState split[3];
+        int pending = 0;
+
+        while (true) {
+            // one bounce per iteration, the direct light of every vertex is
+            // weighted by the throughput of the path that reached it
+            while (true) {
+                const Ray &ray = path.ray;
+                const Intersection &hit = path.isect;
+
+                // the first dispersive interface bends each wavelength its own
+                // way, so the path splits into one path per channel from here
+                if (hit.bsdf->is_dispersive() && !ray.hero_only()) {
+                    for (int c = 0; c < 3; c++) {
+                        if (path.throughput[c] == 0) continue;
+                        PathState &child = split[pending++];
+                        child.ray = ray.single_wavelength(c);
+                        child.isect = hit;
+                        child.throughput = Vector3D();
+                        child.throughput[c] = path.throughput[c];
+                    }
+                    break;
+                }
+
+                Matrix3x3 o2w;
+                make_coord_space(o2w, hit.n);
+                Matrix3x3 w2o = o2w.T();
+
+                Vector3D hit_p = ray.o + ray.d * hit.t;
+                Vector3D w_out = w2o * (-ray.d);
+
+                if (!hit.bsdf->is_delta())
+                    L_out += path.throughput * one_bounce_radiance(ray, hit);
+                if (ray.depth == 0) break;
+
+                Vector3D w_in;
+                double pdf;
+                Vector3D f = hit.bsdf->sample_f_spectral(w_out, &w_in, &pdf, ray.wavelengths, ray.color);
+                if (pdf == 0) break;
+
+                Ray next(hit_p, o2w * w_in);
+                next.depth = ray.depth - 1;
+                next.min_t = EPS_F;
+                next.max_t = INF_D - EPS_F;
+                next.color = ray.color;
+                next.wavelength = ray.wavelength;
+                next.wavelengths = ray.wavelengths;
+
+                Vector3D throughput = path.throughput * f * abs_cos_theta(w_in) / pdf;
+
+                // the light the bounce finds: through a delta BSDF the direct
+                // light missed it, otherwise it is weighted against the light samples
+                Intersection next_isect;
+                bool next_hit = bvh->intersect(next, &next_isect);
+                if (hit.bsdf->is_delta())
+                    L_out += throughput * bsdf_sampled_radiance(next, next_isect, next_hit, 0);
+                else if (!direct_hemisphere_sample)
+                    L_out += throughput * bsdf_sampled_radiance(next, next_isect, next_hit, pdf);
+                if (!next_hit) break;
+
+                // roulette on the throughput: dim paths end early, bright ones are
+                // kept, and survivors are weighted up so the estimate stays unbiased
+                double survival = std::min(RR_MAX_SURVIVAL, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+                if (!coin_flip(survival)) break;
+                path.throughput = throughput / survival;
+
+                path.ray = next;
+                path.isect = next_isect;
+            }
+
+            if (pending == 0) break;
+            path = split[--pending];
         }
 
         return L_out;
@@ -225,6 +332,11 @@ namespace CGL {
 
     Vector3D PathTracer::est_radiance_global_illumination(const Ray &r) {
         Intersection isect;
+        bool hit = bvh->intersect(r, &isect);
+        return est_radiance_global_illumination(r, isect, hit);
+    }
+
+    Vector3D PathTracer::est_radiance_global_illumination(const Ray &r, const Intersection &isect, bool hit) {
         Vector3D L_out;
 
         // You will extend this in assignment 3-2.
@@ -237,7 +349,7 @@ namespace CGL {
         //
         // REMOVE THIS LINE when you are ready to begin Part 3.
 
-        if (!bvh->intersect(r, &isect))
+        if (!hit)
             return envLight ? envLight->sample_dir(r) : L_out;
 
         // L_out = (isect.t == INF_D) ? debug_shading(r.d) : normal_shading(isect.n);
@@ -275,24 +387,28 @@ namespace CGL {
         double s1 = 0, s2 = 0, miu, sigma;
 
         do {
-            auto rayList = std::list<Ray>();
+            Ray rayList[SAMPLE_PER_COLOR];
+            Intersection isects[SAMPLE_PER_COLOR];
+            bool hits[SAMPLE_PER_COLOR];
 
             auto sample = origin + gridSampler->get_sample();
 
-            // take a few samples for each color channel
-            for (int i = 0; i < SAMPLE_PER_COLOR * 3; i++) {
-                auto r = camera->generate_ray(sample.x / sampleBuffer.w, sample.y / sampleBuffer.h, i % 3);
+            // every ray carries a wavelength for each color channel, the hero
+            // channels take turns from a random start so each is picked uniformly
+            int hero = (int) (random_uniform() * 3) % 3;
+            for (int i = 0; i < SAMPLE_PER_COLOR; i++) {
+                auto r = camera->generate_ray(sample.x / sampleBuffer.w, sample.y / sampleBuffer.h, (hero + i) % 3);
                 r.depth = max_ray_depth;
-                rayList.push_back(r);
+                rayList[i] = r;
             }
 
-            // combine three channels and divide by the number of channels
+            // the camera rays of a sample are coherent, trace them as packets
+            bvh->intersect_packet(rayList, isects, hits, SAMPLE_PER_COLOR);
+
             auto newRadiance = Vector3D();
-            for (const auto &r: rayList) {
-                auto tmp = est_radiance_global_illumination(r);
-                newRadiance[r.color] += tmp[r.color];
-            }
-            newRadiance /= (rayList.size() / 3);
+            for (int i = 0; i < SAMPLE_PER_COLOR; i++)
+                newRadiance += est_radiance_global_illumination(rayList[i], isects[i], hits[i]);
+            newRadiance /= SAMPLE_PER_COLOR;
 
             radiance = (radiance * num_samples + newRadiance) / (num_samples + 1);
 
@@ -311,15 +427,7 @@ namespace CGL {
 
         } while (num_samples < ns_aa);
 
-        auto temperature = COLOR_TEMPERATURE;
-        for (int color = 0; color < 3; color++) {
-            auto radiance_cof = color_temperature(temperature, color);
-            radiance_cof /= 255;
-            radiance[color] *= radiance_cof;
-        }
-
-        sampleBuffer.update_pixel(radiance, x, y);
-        sampleCountBuffer[x + y * sampleBuffer.w] = num_samples;
+        write_pixel(radiance, num_samples, x, y);
 
         // My code End
 
@@ -329,6 +437,11 @@ namespace CGL {
 
     }
 
+    void PathTracer::write_pixel(Vector3D radiance, size_t num_samples, size_t x, size_t y) {
+        sampleBuffer.update_pixel(radiance * white_balance, x, y);
+        sampleCountBuffer[x + y * sampleBuffer.w] = num_samples;
+    }
+
     void PathTracer::autofocus(Vector2D loc) {
         Ray r = camera->generate_ray(loc.x / sampleBuffer.w, loc.y / sampleBuffer.h, 0);
         Intersection isect;
@@ -338,52 +451,4 @@ namespace CGL {
         camera->focalDistance = isect.t;
     }
 
-    // color temperature range from 1000K to 40000K
-    double PathTracer::color_temperature(int temperature, int color) {
-        double radiance;
-        temperature /= 100;
-        switch (color)
-        {
-            case 0: // R
-                if (temperature <= 66) {
-                    radiance = 255;
-                } else {
-                    radiance = temperature - 60;
-                    radiance = 329.698727446 * (pow(radiance, -0.1332047592));
-                    if (radiance < 0) radiance = 0;
-                    if (radiance > 255) radiance = 255;
-                }
-                break;
-
-            case 1: // G
-                if (temperature <= 66) {
-                    radiance = temperature;
-                    radiance = 99.4708025861 * log(radiance) - 161.1195681661;
-                    if (radiance < 0) radiance = 0;
-                    if (radiance > 255) radiance = 255;
-                } else {
-                    radiance = temperature - 60;
-                    radiance = 288.1221695283 * pow(radiance, -0.0755148492);
-                    if (radiance < 0) radiance = 0;
-                    if (radiance > 255) radiance = 255;
-                }
-                break;
-
-            case 2: // B
-                if (temperature >= 66) {
-                    radiance = 255;
-                } else {
-                    if (temperature <= 19) {
-                        radiance = 0;
-                    } else {
-                        radiance = temperature - 10;
-                        radiance = 138.5177312231 * log(radiance) - 305.0447927307;
-                        if (radiance < 0) radiance = 0;
-                        if (radiance > 255) radiance = 255;
-                    }
-                }
-        }
-        return radiance;
-    }
-
 } // namespace CGL
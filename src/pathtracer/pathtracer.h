@@ -20,8 +20,20 @@ using CGL::SceneObjects::EnvironmentLight;
 using CGL::SceneObjects::BVHNode;
 using CGL::SceneObjects::BVHAccel;
 
+#define SAMPLE_PER_COLOR 16   ///< camera rays in one pixel sample, each samples every color channel
+#define RR_MAX_SURVIVAL 0.95  ///< highest probability for a path to survive a bounce
+
 namespace CGL {
 
+    /**
+     * Power heuristic weight of a sample drawn with density f_pdf, against a
+     * second strategy that would have drawn it with density g_pdf.
+     */
+    inline double power_heuristic(double f_pdf, double g_pdf) {
+        double f2 = f_pdf * f_pdf;
+        return f2 == 0 ? 0 : f2 / (f2 + g_pdf * g_pdf);
+    }
+
     class PathTracer {
     public:
         PathTracer();
@@ -52,14 +64,48 @@ namespace CGL {
          */
         Vector3D estimate_direct_lighting_hemisphere(const Ray &r, const SceneObjects::Intersection &isect);
 
+        /**
+         * Light samples of the direct light at isect. When the path goes on
+         * from isect, r.depth > 0, its BSDF sampled bounce also finds the
+         * lights, see bsdf_sampled_radiance, and the samples of the lights it
+         * finds are weighted against it by the power heuristic.
+         */
         Vector3D estimate_direct_lighting_importance(const Ray &r, const SceneObjects::Intersection &isect);
 
+        /**
+         * Power heuristic weight of a light sample toward wi from hit_p, against
+         * the BSDF sampled bounce, drawn with density bsdf_pdf, for the lights
+         * that bounce can find.
+         */
+        double light_sample_weight(const SceneObjects::SceneLight *light, const Vector3D &hit_p, const Vector3D &wi,
+                                   double bsdf_pdf);
+
+        /**
+         * Light found by a BSDF sampled ray, the emission at its hit or the
+         * environment if it missed, weighted against the light samples of the
+         * vertex it left by the power heuristic. Light found from a delta BSDF
+         * has full weight.
+         * \param pdf density of the BSDF sample, zero for a delta BSDF
+         */
+        Vector3D bsdf_sampled_radiance(const Ray &r, const SceneObjects::Intersection &isect, bool hit, double pdf);
+
         Vector3D est_radiance_global_illumination(const Ray &r);
 
+        /**
+         * Radiance along a ray whose intersection was already found, for rays
+         * traced as packets.
+         */
+        Vector3D est_radiance_global_illumination(const Ray &r, const SceneObjects::Intersection &isect, bool hit);
+
         Vector3D zero_bounce_radiance(const Ray &r, const SceneObjects::Intersection &isect);
 
         Vector3D one_bounce_radiance(const Ray &r, const SceneObjects::Intersection &isect);
 
+        /**
+         * Direct light at isect plus the light of the bounces that follow, traced
+         * as a loop over the path vertices until r.depth bounces are used up or
+         * Russian roulette on the path throughput ends the path.
+         */
         Vector3D at_least_one_bounce_radiance(const Ray &r, const SceneObjects::Intersection &isect);
 
         Vector3D debug_shading(const Vector3D d) {
@@ -75,6 +121,12 @@ namespace CGL {
          */
         void raytrace_pixel(size_t x, size_t y);
 
+        /**
+         * Store the mean radiance of a pixel, white balanced, and the number
+         * of samples it took.
+         */
+        void write_pixel(Vector3D radiance, size_t num_samples, size_t x, size_t y);
+
         // Integrator sampling settings //
 
         size_t max_ray_depth; ///< maximum allowed ray depth (applies to all rays)
@@ -108,7 +160,8 @@ namespace CGL {
         double tm_level;                           ///< exposure level
         double tm_key;                             ///< key value
         double tm_wht;                             ///< white point
-        double color_temperature(int temperature, int color);
+
+        Vector3D white_balance;  ///< scale of each color channel for the color temperature, set once
     };
 
 }  // namespace CGL
@@ -27,8 +27,9 @@ namespace CGL {
 
         Vector3D inv_d;  ///< component wise inverse
 
-        double wavelength;
-        int color;
+        double wavelength;     ///< hero wavelength, the one dispersive interfaces bend the ray for
+        int color;             ///< color channel of the hero wavelength
+        Vector3D wavelengths;  ///< wavelength carried for each color channel, wavelengths[color] is the hero
 
         Ray() {}
 
@@ -58,6 +59,27 @@ namespace CGL {
         }
 
 
+        /**
+         * If the ray only carries its hero wavelength, the others were split
+         * off at a dispersive interface.
+         */
+        bool hero_only() const {
+            return wavelengths[(color + 1) % 3] == 0 && wavelengths[(color + 2) % 3] == 0;
+        }
+
+        /**
+         * Returns the same ray carrying only the wavelength of the given color
+         * channel, as its hero.
+         */
+        Ray single_wavelength(int c) const {
+            Ray r = *this;
+            r.color = c;
+            r.wavelength = wavelengths[c];
+            r.wavelengths = Vector3D();
+            r.wavelengths[c] = wavelengths[c];
+            return r;
+        }
+
         /**
          * Returns the point t * |d| along the ray.
          */
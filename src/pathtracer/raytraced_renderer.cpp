@@ -6,6 +6,7 @@
 #include <random>
 #include <algorithm>
 #include <sstream>
+#include <memory>
 
 #include "CGL/CGL.h"
 #include "CGL/vector3D.h"
@@ -17,6 +18,10 @@
 #include "scene/sphere.h"
 #include "scene/triangle.h"
 #include "scene/light.h"
+#include "scene/object.h"
+#include "scene/instance.h"
+
+#define BVH_PROFILE_STRIDE 8 ///< the warm-up of the profiled BVH order traces one pixel in STRIDE x STRIDE
 
 using namespace CGL::SceneObjects;
 
@@ -47,7 +52,15 @@ namespace CGL {
                                          bool direct_hemisphere_sample,
                                          string filename,
                                          double lensRadius,
-                                         double focalDistance) {
+                                         double focalDistance,
+                                         SceneObjects::BVHBuildMethod bvh_build_method,
+                                         SceneObjects::BVHLayout bvh_layout,
+                                         double bvh_split_budget,
+                                         string bvh_cache_dir,
+                                         SceneObjects::BVHPrecision bvh_precision,
+                                         SceneObjects::BVHNodeOrder bvh_node_order,
+                                         bool bvh_per_object,
+                                         bool wavefront) {
         state = INIT;
 
         pt = new PathTracer();
@@ -65,6 +78,18 @@ namespace CGL {
         this->lensRadius = lensRadius;
         this->focalDistance = focalDistance;
 
+        this->bvhBuildMethod = bvh_build_method;
+        this->bvhLayout = bvh_layout;
+        this->bvhSplitBudget = bvh_split_budget;
+        this->bvhCacheDir = bvh_cache_dir;
+        this->bvhPrecision = bvh_precision;
+        this->bvhNodeOrder = bvh_node_order;
+        this->bvhProfiled = false;
+        this->bvhPerObject = bvh_per_object;
+        this->wavefront = wavefront;
+        this->bvhBuildTime = 0;
+        this->renderTime = 0;
+
         this->filename = filename;
 
         if (envmap) {
@@ -91,7 +116,7 @@ namespace CGL {
  */
     RaytracedRenderer::~RaytracedRenderer() {
 
-        delete bvh;
+        delete_bvh();
         delete pt;
 
     }
@@ -110,8 +135,8 @@ namespace CGL {
         }
 
         if (this->scene != nullptr) {
-            delete scene;
-            delete bvh;
+            delete this->scene;
+            delete_bvh();
             selectionHistory.pop();
         }
 
@@ -122,6 +147,11 @@ namespace CGL {
         this->scene = scene;
         build_accel();
 
+        // the BVH now only references the objects of the new scene
+        for (SceneObject *obj: scene->retired_objects)
+            delete obj;
+        scene->retired_objects.clear();
+
         if (has_valid_configuration()) {
             state = READY;
         }
@@ -240,8 +270,8 @@ namespace CGL {
  */
     void RaytracedRenderer::clear() {
         if (state != READY) return;
-        delete bvh;
-        bvh = NULL;
+        // the BVH is kept so that the next scene only updates it, it holds the
+        // bounds it matches the new primitives against and never reads the old ones
         scene = NULL;
         camera = NULL;
         selectionHistory.pop();
@@ -321,8 +351,15 @@ namespace CGL {
             }
         }
 
-        bvh->total_isects = 0;
-        bvh->total_rays = 0;
+        if (bvhNodeOrder == SceneObjects::BVH_ORDER_PROFILED && !bvhProfiled) {
+            if (render_cell)
+                profile_bvh(cell_tl.x, cell_tl.y, cell_br.x, cell_br.y);
+            else
+                profile_bvh(0, 0, width, height);
+            bvhProfiled = true;
+        }
+
+        reset_traversal_stats();
         // launch threads
         fprintf(stdout, "[PathTracer] Rendering... ");
         fflush(stdout);
@@ -331,6 +368,20 @@ namespace CGL {
         }
     }
 
+    void RaytracedRenderer::profile_bvh(size_t x0, size_t y0, size_t x1, size_t y1) {
+        fprintf(stdout, "[PathTracer] Profiling BVH node visits... ");
+        fflush(stdout);
+        Timer timer;
+        timer.start();
+        bvh->begin_profile();
+        for (size_t y = y0 + BVH_PROFILE_STRIDE / 2; y < y1; y += BVH_PROFILE_STRIDE)
+            for (size_t x = x0 + BVH_PROFILE_STRIDE / 2; x < x1; x += BVH_PROFILE_STRIDE)
+                pt->raytrace_pixel(x, y);
+        bvh->end_profile();
+        timer.stop();
+        fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+    }
+
     void RaytracedRenderer::render_to_file(string filename, size_t x, size_t y, size_t dx, size_t dy) {
         if (x == -1) {
             unique_lock<std::mutex> lk(m_done);
@@ -352,6 +403,42 @@ namespace CGL {
     }
 
 
+    SceneObjects::BVHBuildOptions RaytracedRenderer::bvh_build_options() const {
+        SceneObjects::BVHBuildOptions options;
+        options.method = bvhBuildMethod;
+        options.layout = bvhLayout;
+        options.num_threads = numWorkerThreads;
+        options.split_budget = bvhSplitBudget;
+        options.precision = bvhPrecision;
+        options.node_order = bvhNodeOrder;
+        return options;
+    }
+
+    void RaytracedRenderer::delete_bvh() {
+        delete bvh;
+        bvh = NULL;
+        for (SceneObjects::Instance *instance: bvhInstances)
+            delete instance;
+        bvhInstances.clear();
+        objectBVHs.clear();
+    }
+
+    SceneObjects::BVHTraversalStats RaytracedRenderer::traversal_stats() const {
+        SceneObjects::BVHTraversalStats stats = bvh->traversal_stats();
+        for (BVHAccel *object_bvh: objectBVHs) {
+            SceneObjects::BVHTraversalStats object = object_bvh->traversal_stats();
+            stats.nodes_visited += object.nodes_visited;
+            stats.isects += object.isects;
+        }
+        return stats;
+    }
+
+    void RaytracedRenderer::reset_traversal_stats() {
+        bvh->reset_traversal_stats();
+        for (BVHAccel *object_bvh: objectBVHs)
+            object_bvh->reset_traversal_stats();
+    }
+
     void RaytracedRenderer::build_accel() {
 
         // collect primitives //
@@ -359,21 +446,111 @@ namespace CGL {
         fflush(stdout);
         timer.start();
         vector<Primitive *> primitives;
+        vector<SceneObjects::Instance *> instances;
+        size_t objects_built = 0, objects_reused = 0;
+        SceneObjects::BVHBuildOptions options = bvh_build_options();
+        objectBVHs.clear();
         for (SceneObject *obj: scene->objects) {
+            SceneObjects::Mesh *mesh = bvhPerObject ? dynamic_cast<SceneObjects::Mesh *>(obj) : NULL;
+            if (mesh) {
+                // the static mesh, and so its BVH, is only recreated after edits
+                (mesh->has_bvh(options) ? objects_reused : objects_built)++;
+                objectBVHs.push_back(mesh->get_bvh(options));
+                instances.push_back(new SceneObjects::Instance(objectBVHs.back(), Matrix4x4::identity()));
+                primitives.push_back(instances.back());
+                continue;
+            }
+            // the Instance primitives of instanced meshes place the mesh BVH, built here
+            // with the settings of the renderer rather than the defaults
+            BVHAccel *object_bvh = NULL;
+            if (SceneObjects::MeshInstance *placement = dynamic_cast<SceneObjects::MeshInstance *>(obj))
+                object_bvh = placement->mesh->get_bvh(options);
+            else if (SceneObjects::Mesh *instanced = dynamic_cast<SceneObjects::Mesh *>(obj))
+                if (instanced->instanced) object_bvh = instanced->get_bvh(options);
+            if (object_bvh && std::find(objectBVHs.begin(), objectBVHs.end(), object_bvh) == objectBVHs.end())
+                objectBVHs.push_back(object_bvh);
             const vector<Primitive *> &obj_prims = obj->get_primitives();
             primitives.reserve(primitives.size() + obj_prims.size());
             primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
         }
         timer.stop();
-        fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+        double collect_time = timer.duration();
+        if (bvhPerObject)
+            fprintf(stdout, "Done! (%lu mesh BVHs built, %lu reused, %.4f sec)\n", objects_built, objects_reused,
+                    timer.duration());
+        else
+            fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+
+        if (bvhPerObject) {
+            // the top level BVH only holds a primitive per mesh, rebuild it //
+            delete_bvh();
+            bvhInstances.swap(instances);
+            fprintf(stdout, "[PathTracer] Building top level BVH over %lu primitives... ", primitives.size());
+            fflush(stdout);
+            timer.start();
+            bvh = new BVHAccel(primitives, options.max_leaf_size, bvhBuildMethod, bvhLayout, numWorkerThreads,
+                               bvhSplitBudget);
+            timer.stop();
+            bvhBuildTime = collect_time + timer.duration();
+            fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+        }
+        // update the BVH of the previous scene after edits, or build it //
+        else if (bvh) {
+            fprintf(stdout, "[PathTracer] Updating BVH with %lu primitives... ", primitives.size());
+            fflush(stdout);
+            timer.start();
+            SceneObjects::BVHUpdate update = bvh->update(primitives);
+            timer.stop();
+            bvhBuildTime = timer.duration();
+            const char *update_names[] = {"refit", "subtree rebuild", "full rebuild"};
+            fprintf(stdout, "Done! (%s, %.4f sec)\n", update_names[update], timer.duration());
+        }
+        else {
+            // reuse the BVH cached by an earlier run over the same geometry //
+            uint64_t key = 0;
+            string cache_path;
+            if (!bvhCacheDir.empty()) {
+                key = BVHAccel::cache_key(primitives, 4, bvhBuildMethod, bvhLayout, bvhSplitBudget);
+                char name[32];
+                snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long) key);
+                cache_path = bvhCacheDir + "/" + name;
+
+                fprintf(stdout, "[PathTracer] Loading BVH from %s... ", cache_path.c_str());
+                fflush(stdout);
+                timer.start();
+                bvh = BVHAccel::load(cache_path, key, primitives, numWorkerThreads);
+                timer.stop();
+                bvhBuildTime = timer.duration();
+                if (bvh)
+                    fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+                else
+                    fprintf(stdout, "Not cached.\n");
+            }
 
-        // build BVH //
-        fprintf(stdout, "[PathTracer] Building BVH from %lu primitives... ", primitives.size());
-        fflush(stdout);
-        timer.start();
-        bvh = new BVHAccel(primitives);
-        timer.stop();
-        fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+            if (!bvh) {
+                fprintf(stdout, "[PathTracer] Building BVH from %lu primitives on %lu threads... ",
+                        primitives.size(), numWorkerThreads);
+                fflush(stdout);
+                timer.start();
+                bvh = new BVHAccel(primitives, 4, bvhBuildMethod, bvhLayout, numWorkerThreads, bvhSplitBudget);
+                timer.stop();
+                bvhBuildTime = timer.duration();
+                fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+
+                if (!cache_path.empty() && !bvh->save(cache_path, key))
+                    fprintf(stdout, "[PathTracer] Could not write BVH cache %s\n", cache_path.c_str());
+            }
+        }
+        bvh->set_precision(bvhPrecision);
+        bvh->set_node_order(bvhNodeOrder);
+        bvhProfiled = false;
+
+        const char *build_names[] = {"median", "SAH", "LBVH", "HLBVH", "SBVH"};
+        fprintf(stdout, "[PathTracer] BVH SAH cost: %.4f (%s build)\n", bvh->sah_cost(),
+                build_names[bvhBuildMethod]);
+        double n = std::max<size_t>(primitives.size(), 1);
+        fprintf(stdout, "[PathTracer] BVH nodes: %.2f bytes per primitive (%.2f with float bounds)\n",
+                bvh->node_bytes() / n, bvh->uncompressed_node_bytes() / n);
 
         // initial visualization //
         selectionHistory.push(bvh->get_root());
@@ -616,7 +793,7 @@ namespace CGL {
  * in a worker thread.
  */
     void RaytracedRenderer::raytrace_tile(int tile_x, int tile_y,
-                                          int tile_w, int tile_h) {
+                                          int tile_w, int tile_h, WavefrontPathTracer *engine) {
         size_t w = frame_w;
         size_t h = frame_h;
 
@@ -630,10 +807,16 @@ namespace CGL {
         size_t tile_idx_y = tile_y / imageTileSize;
         size_t num_samples_tile = tile_samples[tile_idx_x + tile_idx_y * num_tiles_w];
 
-        for (size_t y = tile_start_y; y < tile_end_y; y++) {
+        if (engine) {
             if (!continueRaytracing) return;
-            for (size_t x = tile_start_x; x < tile_end_x; x++) {
-                pt->raytrace_pixel(x, y);
+            engine->raytrace_tile(tile_start_x, tile_start_y, tile_end_x, tile_end_y);
+        }
+        else {
+            for (size_t y = tile_start_y; y < tile_end_y; y++) {
+                if (!continueRaytracing) return;
+                for (size_t x = tile_start_x; x < tile_end_x; x++) {
+                    pt->raytrace_pixel(x, y);
+                }
             }
         }
 
@@ -679,9 +862,11 @@ namespace CGL {
         Timer timer;
         timer.start();
 
+        std::unique_ptr<WavefrontPathTracer> engine(wavefront ? new WavefrontPathTracer(pt) : NULL);
+
         WorkItem work;
         while (continueRaytracing && workQueue.try_get_work(&work)) {
-            raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h);
+            raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h, engine.get());
             {
                 lock_guard<std::mutex> lk(m_done);
                 ++tilesDone;
@@ -700,11 +885,22 @@ namespace CGL {
         if (continueRaytracing && workerDoneCount == numWorkerThreads) {
             timer.stop();
             fprintf(stdout, "\r[PathTracer] Rendering... 100%%! (%.4fs)\n", timer.duration());
-            fprintf(stdout, "[PathTracer] BVH traced %llu rays.\n", bvh->total_rays);
+            renderTime = timer.duration();
+            SceneObjects::BVHTraversalStats stats = traversal_stats();
+            fprintf(stdout, "[PathTracer] BVH traced %llu rays.\n", stats.rays);
             fprintf(stdout, "[PathTracer] Average speed %.4f million rays per second.\n",
-                    (double) bvh->total_rays / timer.duration() * 1e-6);
+                    (double) stats.rays / timer.duration() * 1e-6);
             fprintf(stdout, "[PathTracer] Averaged %f intersection tests per ray.\n",
-                    (((double) bvh->total_isects) / bvh->total_rays));
+                    (((double) stats.isects) / stats.rays));
+            fprintf(stdout, "[PathTracer] Averaged %f nodes visited per ray.\n",
+                    (((double) stats.nodes_visited) / stats.rays));
+            fprintf(stdout, "[PathTracer] Closest hit rays: %llu, shadow rays: %llu.\n",
+                    stats.rays - stats.shadow_rays, stats.shadow_rays);
+            if (stats.shadow_rays > 0) {
+                fprintf(stdout, "[PathTracer] Shadow rays occluded: %.2f%%, %.2f%% of them by the cached occluder.\n",
+                        100.0 * stats.occluded / stats.shadow_rays,
+                        stats.occluded ? 100.0 * stats.occluder_hits / stats.occluded : 0.0);
+            }
 
             lock_guard<std::mutex> lk(m_done);
             state = DONE;
@@ -750,6 +946,65 @@ namespace CGL {
         delete[] frame_out;
 
         save_sampling_rate_image(filename);
+        save_bvh_report(filename);
+    }
+
+    void RaytracedRenderer::save_bvh_report(string filename) {
+        string path = filename.substr(0, filename.size() - 4) + "_bvh.json";
+        FILE *file = fopen(path.c_str(), "w");
+        if (!file) {
+            fprintf(stderr, "[PathTracer] Could not write BVH report %s\n", path.c_str());
+            return;
+        }
+
+        SceneObjects::BVHTreeStats tree = bvh->tree_stats();
+        SceneObjects::BVHTraversalStats stats = traversal_stats();
+        const char *build_names[] = {"median", "sah", "lbvh", "hlbvh", "sbvh"};
+        const char *layout_names[] = {"binary", "wide", "compressed"};
+        const char *precision_names[] = {"double", "float"};
+        double rays = std::max(stats.rays, 1ull);
+
+        fprintf(file, "{\n");
+        fprintf(file, "  \"tree\": {\n");
+        fprintf(file, "    \"build_method\": \"%s\",\n", build_names[bvhBuildMethod]);
+        fprintf(file, "    \"layout\": \"%s\",\n", layout_names[bvhLayout]);
+        fprintf(file, "    \"precision\": \"%s\",\n", precision_names[bvhPrecision]);
+        fprintf(file, "    \"width\": %d,\n", bvhLayout == SceneObjects::BVH_LAYOUT_BINARY ? 2 : BVH_WIDTH);
+        fprintf(file, "    \"build_seconds\": %.6f,\n", bvhBuildTime);
+        fprintf(file, "    \"sah_cost\": %.6f,\n", tree.sah_cost);
+        fprintf(file, "    \"primitives\": %zu,\n", tree.primitives);
+        fprintf(file, "    \"references\": %zu,\n", tree.references);
+        fprintf(file, "    \"max_leaf_size\": %zu,\n", tree.max_leaf_size);
+        fprintf(file, "    \"interior_nodes\": %zu,\n", tree.interior_nodes);
+        fprintf(file, "    \"leaf_nodes\": %zu,\n", tree.leaf_nodes);
+        fprintf(file, "    \"traversal_nodes\": %zu,\n", tree.traversal_nodes);
+        fprintf(file, "    \"node_bytes\": %zu,\n", tree.node_bytes);
+        fprintf(file, "    \"max_depth\": %zu,\n", tree.max_depth);
+        fprintf(file, "    \"depth_histogram\": [");
+        for (size_t i = 0; i < tree.depth_histogram.size(); i++)
+            fprintf(file, "%s%zu", i ? ", " : "", tree.depth_histogram[i]);
+        fprintf(file, "],\n");
+        fprintf(file, "    \"leaf_size_histogram\": [");
+        for (size_t i = 0; i < tree.leaf_size_histogram.size(); i++)
+            fprintf(file, "%s%zu", i ? ", " : "", tree.leaf_size_histogram[i]);
+        fprintf(file, "]\n");
+        fprintf(file, "  },\n");
+        fprintf(file, "  \"traversal\": {\n");
+        fprintf(file, "    \"render_seconds\": %.6f,\n", renderTime);
+        fprintf(file, "    \"rays\": %llu,\n", stats.rays);
+        fprintf(file, "    \"shadow_rays\": %llu,\n", stats.shadow_rays);
+        fprintf(file, "    \"nodes_visited\": %llu,\n", stats.nodes_visited);
+        fprintf(file, "    \"primitives_tested\": %llu,\n", stats.isects);
+        fprintf(file, "    \"occluded\": %llu,\n", stats.occluded);
+        fprintf(file, "    \"occluder_cache_hits\": %llu,\n", stats.occluder_hits);
+        fprintf(file, "    \"nodes_per_ray\": %.6f,\n", stats.nodes_visited / rays);
+        fprintf(file, "    \"primitives_per_ray\": %.6f,\n", stats.isects / rays);
+        fprintf(file, "    \"million_rays_per_second\": %.6f\n",
+                renderTime > 0 ? stats.rays / renderTime * 1e-6 : 0.0);
+        fprintf(file, "  }\n");
+        fprintf(file, "}\n");
+        fclose(file);
+        fprintf(stderr, "[PathTracer] Saved BVH report to %s\n", path.c_str());
     }
 
     void RaytracedRenderer::save_sampling_rate_image(string filename) {
@@ -12,6 +12,7 @@
 #include "CGL/timer.h"
 
 #include "scene/bvh.h"
+#include "scene/instance.h"
 #include "pathtracer/camera.h"
 #include "pathtracer/sampler.h"
 #include "util/image.h"
@@ -32,6 +33,7 @@ using CGL::SceneObjects::BVHNode;
 using CGL::SceneObjects::BVHAccel;
 
 #include "pathtracer.h"
+#include "wavefront.h"
 
 namespace CGL {
 
@@ -76,7 +78,15 @@ namespace CGL {
                           bool direct_hemisphere_sample = false,
                           string filename = "",
                           double lensRadius = 0.25,
-                          double focalDistance = 4.7);
+                          double focalDistance = 4.7,
+                          SceneObjects::BVHBuildMethod bvh_build_method = SceneObjects::BVH_BUILD_SAH,
+                          SceneObjects::BVHLayout bvh_layout = SceneObjects::BVH_LAYOUT_WIDE,
+                          double bvh_split_budget = 0.3,
+                          string bvh_cache_dir = "",
+                          SceneObjects::BVHPrecision bvh_precision = SceneObjects::BVH_PRECISION_DOUBLE,
+                          SceneObjects::BVHNodeOrder bvh_node_order = SceneObjects::BVH_ORDER_DEPTH_FIRST,
+                          bool bvh_per_object = false,
+                          bool wavefront = false);
 
         /**
          * Destructor.
@@ -163,6 +173,12 @@ namespace CGL {
          */
         void save_sampling_rate_image(std::string filename);
 
+        /**
+         * Save the tree metrics and traversal counters of the BVH as JSON,
+         * next to the image.
+         */
+        void save_bvh_report(std::string filename);
+
     private:
 
         /**
@@ -175,6 +191,29 @@ namespace CGL {
          */
         void build_accel();
 
+        /**
+         * Options the BVHs of the meshes are built with, from the BVH settings
+         * of the renderer.
+         */
+        SceneObjects::BVHBuildOptions bvh_build_options() const;
+
+        /**
+         * Delete the BVH, and the instances a top level BVH was built over.
+         */
+        void delete_bvh();
+
+        /**
+         * Traversal counters of the last render. Rays are counted once, by the
+         * top level BVH, and the nodes and primitives the rays visit in the
+         * mesh BVHs are added to those of the top level BVH.
+         */
+        SceneObjects::BVHTraversalStats traversal_stats() const;
+
+        /**
+         * Zero the traversal counters of the BVH and the mesh BVHs.
+         */
+        void reset_traversal_stats();
+
         /**
          * Visualize acceleration structures.
          */
@@ -182,11 +221,19 @@ namespace CGL {
 
         void visualize_cell() const;
 
+        /**
+         * Trace a sparse set of the pixels in [x0, x1) x [y0, y1) on the calling
+         * thread while the BVH counts node visits, then lay out its nodes by
+         * the counts. The render overwrites the traced pixels.
+         */
+        void profile_bvh(size_t x0, size_t y0, size_t x1, size_t y1);
+
         /**
          * Raytrace a tile of the scene and update the frame buffer. Is run
          * in a worker thread.
+         * \param engine wavefront engine of the worker, NULL to trace pixel by pixel
          */
-        void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h);
+        void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h, WavefrontPathTracer *engine = NULL);
 
         /**
          * Implementation of a ray tracer worker thread
@@ -223,6 +270,19 @@ namespace CGL {
         // Components //
 
         BVHAccel *bvh;                 ///< BVH accelerator aggregate
+        std::vector<SceneObjects::Instance *> bvhInstances; ///< mesh instances under the top level BVH, owned
+        std::vector<BVHAccel *> objectBVHs;  ///< mesh BVHs under instances, owned by the meshes
+        SceneObjects::BVHBuildMethod bvhBuildMethod; ///< split strategy of the BVH builder
+        SceneObjects::BVHLayout bvhLayout;           ///< node layout of the BVH
+        double bvhSplitBudget;                       ///< references the SBVH may add per primitive
+        std::string bvhCacheDir;                     ///< directory of the BVH cache, empty if disabled
+        SceneObjects::BVHPrecision bvhPrecision;     ///< precision the BVH leaves test triangles in
+        SceneObjects::BVHNodeOrder bvhNodeOrder;     ///< layout of the BVH nodes in memory
+        bool bvhProfiled;                            ///< the profiled node order was measured for this BVH
+        bool bvhPerObject;                           ///< one BVH per mesh under a top level BVH, kept across edits
+        bool wavefront;                              ///< render tiles with the wavefront engine
+        double bvhBuildTime;                         ///< seconds spent building, loading or updating the BVH
+        double renderTime;                           ///< seconds spent by the last render
         ImageBuffer frameBuffer;       ///< frame buffer
         Timer timer;                   ///< performance test timer
 
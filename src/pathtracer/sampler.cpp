@@ -1,6 +1,7 @@
 #include "sampler.h"
-#include <random>
-#include <chrono>
+
+#include <algorithm>
+#include <cmath>
 
 namespace CGL {
 
@@ -69,11 +70,28 @@ namespace CGL {
         return Vector3D(r * cos(theta), r * sin(theta), sqrt(1 - Xi1));
     }
 
-    double GaussianDistributionSampler1D(double mean = 0, double variance = 1) {
-        unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-        std::default_random_engine generator(seed);
-        std::normal_distribution<double> distribution(mean, variance);
-        return distribution(generator);
+/**
+ * Tabulate the inverse CDF of the normal distribution, each entry is found by
+ * bisection on the CDF.
+ */
+    WavelengthSampler1D::WavelengthSampler1D(double mean, double deviation) {
+        for (int i = 0; i < WAVELENGTH_TABLE_SIZE; i++) {
+            double u = (i + 0.5) / WAVELENGTH_TABLE_SIZE;
+            double lo = -10, hi = 10;
+            for (int iter = 0; iter < 64; iter++) {
+                double z = (lo + hi) / 2;
+                if (0.5 * erfc(-z / sqrt(2.0)) < u) lo = z;
+                else hi = z;
+            }
+            inverse_cdf[i] = mean + deviation * (lo + hi) / 2;
+        }
+    }
+
+    double WavelengthSampler1D::get_sample() const {
+        double x = clamp(random_uniform() * WAVELENGTH_TABLE_SIZE - 0.5, 0.0, WAVELENGTH_TABLE_SIZE - 1.0);
+        int i = std::min((int) x, WAVELENGTH_TABLE_SIZE - 2);
+        double t = x - i;
+        return inverse_cdf[i] * (1 - t) + inverse_cdf[i + 1] * t;
     }
 
 
@@ -6,6 +6,8 @@
 #include "CGL/misc.h"
 #include "util/random_util.h"
 
+#define WAVELENGTH_TABLE_SIZE 1024 ///< entries of the inverse CDF table of a wavelength distribution
+
 namespace CGL {
 
 /**
@@ -91,6 +93,30 @@ namespace CGL {
 
     }; // class UniformHemisphereSampler3D
 
+/**
+ * A sampler of the normal distribution of wavelengths of a color channel.
+ * The inverse CDF is tabulated once, so drawing a wavelength is a lookup and
+ * an interpolation. The few samples past the table, beyond about 3.3
+ * deviations, are clamped to its ends.
+ */
+    class WavelengthSampler1D {
+    public:
+
+        /**
+         * Constructor.
+         * \param mean mean wavelength in nm
+         * \param deviation standard deviation in nm
+         */
+        WavelengthSampler1D(double mean, double deviation);
+
+        double get_sample() const;
+
+    private:
+
+        double inverse_cdf[WAVELENGTH_TABLE_SIZE];  ///< wavelength at the quantiles (i + 0.5) / size
+
+    }; // class WavelengthSampler1D
+
 /**
  * TODO (extra credit) :
  * Jittered sampler implementations
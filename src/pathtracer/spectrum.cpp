@@ -0,0 +1,84 @@
+#include "spectrum.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace CGL {
+
+    const SpectrumTable spectrumTable;
+
+    // a gaussian with a different deviation on each side of its mean
+    static double piecewise_gaussian(double x, double mean, double left, double right) {
+        double t = (x - mean) / (x < mean ? left : right);
+        return exp(-0.5 * t * t);
+    }
+
+    Vector3D cie_xyz(double wavelength) {
+        double x = 1.056 * piecewise_gaussian(wavelength, 599.8, 37.9, 31.0)
+                   + 0.362 * piecewise_gaussian(wavelength, 442.0, 16.0, 26.7)
+                   - 0.065 * piecewise_gaussian(wavelength, 501.1, 20.4, 26.2);
+        double y = 0.821 * piecewise_gaussian(wavelength, 568.8, 46.9, 40.5)
+                   + 0.286 * piecewise_gaussian(wavelength, 530.9, 16.3, 31.1);
+        double z = 1.217 * piecewise_gaussian(wavelength, 437.0, 11.8, 36.0)
+                   + 0.681 * piecewise_gaussian(wavelength, 459.0, 26.0, 13.8);
+        return Vector3D(x, y, z);
+    }
+
+    Vector3D xyz_to_linear_rgb(const Vector3D &xyz) {
+        return Vector3D(3.2404542 * xyz.x - 1.5371385 * xyz.y - 0.4985314 * xyz.z,
+                        -0.9692660 * xyz.x + 1.8760108 * xyz.y + 0.0415560 * xyz.z,
+                        0.0556434 * xyz.x - 0.2040259 * xyz.y + 1.0572252 * xyz.z);
+    }
+
+    // color temperature range from 1000K to 40000K
+    Vector3D white_balance(int temperature) {
+        Vector3D radiance;
+        temperature /= 100;
+
+        // R
+        if (temperature <= 66)
+            radiance.x = 255;
+        else
+            radiance.x = 329.698727446 * pow(temperature - 60, -0.1332047592);
+
+        // G
+        if (temperature <= 66)
+            radiance.y = 99.4708025861 * log(temperature) - 161.1195681661;
+        else
+            radiance.y = 288.1221695283 * pow(temperature - 60, -0.0755148492);
+
+        // B
+        if (temperature >= 66)
+            radiance.z = 255;
+        else if (temperature <= 19)
+            radiance.z = 0;
+        else
+            radiance.z = 138.5177312231 * log(temperature - 10) - 305.0447927307;
+
+        for (int c = 0; c < 3; c++)
+            radiance[c] = std::min(std::max(radiance[c], 0.0), 255.0) / 255;
+        return radiance;
+    }
+
+/**
+ * Out of gamut responses are negative in some channel, they are clamped to
+ * zero before normalizing.
+ */
+    SpectrumTable::SpectrumTable() {
+        for (int i = 0; i < SPECTRUM_TABLE_SIZE; i++) {
+            Vector3D rgb = xyz_to_linear_rgb(cie_xyz(SPECTRUM_MIN_WAVELENGTH + i));
+            for (int c = 0; c < 3; c++)
+                rgb[c] = std::max(rgb[c], 0.0);
+            double sum = rgb.x + rgb.y + rgb.z;
+            rgb_weights[i] = sum > 0 ? rgb / sum : Vector3D(1.0 / 3);
+        }
+    }
+
+    Vector3D SpectrumTable::weights(double wavelength) const {
+        double x = std::min(std::max(wavelength - SPECTRUM_MIN_WAVELENGTH, 0.0), SPECTRUM_TABLE_SIZE - 1.0);
+        int i = std::min((int) x, SPECTRUM_TABLE_SIZE - 2);
+        double t = x - i;
+        return rgb_weights[i] * (1 - t) + rgb_weights[i + 1] * t;
+    }
+
+}  // namespace CGL
@@ -0,0 +1,67 @@
+#ifndef CGL_SPECTRUM_H
+#define CGL_SPECTRUM_H
+
+#include "CGL/vector3D.h"
+
+#define SPECTRUM_MIN_WAVELENGTH 360 ///< shortest wavelength of the tables, in nm
+#define SPECTRUM_MAX_WAVELENGTH 830 ///< longest wavelength of the tables, in nm
+#define SPECTRUM_TABLE_SIZE (SPECTRUM_MAX_WAVELENGTH - SPECTRUM_MIN_WAVELENGTH + 1) ///< one entry per nm
+
+namespace CGL {
+
+/**
+ * CIE 1931 color matching functions at a wavelength, from the multi-lobe
+ * fit of Wyman et al. Only used to build the tables.
+ * \param wavelength wavelength in nm
+ * \return the x, y and z responses
+ */
+    Vector3D cie_xyz(double wavelength);
+
+/**
+ * Convert CIE XYZ to linear sRGB.
+ */
+    Vector3D xyz_to_linear_rgb(const Vector3D &xyz);
+
+/**
+ * Scale of each color channel that white balances a render for a light of
+ * the given color temperature, from 1000K to 40000K.
+ */
+    Vector3D white_balance(int temperature);
+
+/**
+ * Spectral to RGB conversion.
+ * The linear RGB response of the color matching functions is tabulated once,
+ * per nm, and normalized so the channel weights at a wavelength sum to one.
+ * Looking up a wavelength is an interpolation between two entries; the
+ * wavelengths past the table are clamped to its ends.
+ */
+    class SpectrumTable {
+    public:
+
+        SpectrumTable();
+
+        /**
+         * Weight of each color channel at the given wavelength.
+         * \param wavelength wavelength in nm
+         */
+        Vector3D weights(double wavelength) const;
+
+        /**
+         * Value at the given wavelength of a quantity given in RGB, such as a
+         * reflectance.
+         */
+        double at(double wavelength, const Vector3D &rgb) const {
+            return dot(weights(wavelength), rgb);
+        }
+
+    private:
+
+        Vector3D rgb_weights[SPECTRUM_TABLE_SIZE];  ///< channel weights at SPECTRUM_MIN_WAVELENGTH + i nm
+
+    }; // class SpectrumTable
+
+    extern const SpectrumTable spectrumTable;  ///< shared by all the BSDFs and threads
+
+}  // namespace CGL
+
+#endif  // CGL_SPECTRUM_H
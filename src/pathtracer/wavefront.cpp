@@ -0,0 +1,313 @@
+#include "wavefront.h"
+
+#include "pathtracer/bsdf.h"
+#include "pathtracer/camera.h"
+#include "scene/light.h"
+#include "util/random_util.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace CGL::SceneObjects;
+using std::pair;
+using std::vector;
+
+namespace CGL {
+
+    void WavefrontPathTracer::PathQueue::clear() {
+        rays.clear();
+        isects.clear();
+        hit.clear();
+        throughput.clear();
+        specular.clear();
+        pdf.clear();
+        sample.clear();
+    }
+
+    void WavefrontPathTracer::PathQueue::reserve(size_t n) {
+        rays.reserve(n);
+        isects.reserve(n);
+        hit.reserve(n);
+        throughput.reserve(n);
+        specular.reserve(n);
+        pdf.reserve(n);
+        sample.reserve(n);
+    }
+
+    void WavefrontPathTracer::PathQueue::push(const Ray &ray, const Vector3D &throughput, bool specular,
+                                              double pdf, uint32_t sample) {
+        rays.push_back(ray);
+        isects.push_back(Intersection());
+        hit.push_back(false);
+        this->throughput.push_back(throughput);
+        this->specular.push_back(specular);
+        this->pdf.push_back(pdf);
+        this->sample.push_back(sample);
+    }
+
+    void WavefrontPathTracer::ShadowQueue::clear() {
+        rays.clear();
+        radiance.clear();
+        light.clear();
+        sample.clear();
+    }
+
+    WavefrontPathTracer::WavefrontPathTracer(PathTracer *pt) : pt(pt) {
+        paths.reserve(WAVEFRONT_MAX_PATHS);
+        next_paths.reserve(WAVEFRONT_MAX_PATHS);
+    }
+
+    void WavefrontPathTracer::raytrace_tile(size_t x0, size_t y0, size_t x1, size_t y1) {
+        // per pixel, the sum and the moments of its samples as in raytrace_pixel
+        size_t n_pixels = (x1 - x0) * (y1 - y0);
+        vector<Vector3D> radiance(n_pixels);
+        vector<double> s1(n_pixels, 0), s2(n_pixels, 0);
+        vector<size_t> num_samples(n_pixels, 0);
+        vector<size_t> active;
+        for (size_t p = 0; p < n_pixels; p++)
+            active.push_back(p);
+
+        // each camera ray may split at a dispersive interface, which the queues also hold
+        size_t samples_per_wave = std::max<size_t>(WAVEFRONT_MAX_PATHS / (SAMPLE_PER_COLOR * WAVEFRONT_MAX_SPLIT), 1);
+        vector<pair<size_t, size_t> > pixels;
+
+        // every active pixel takes a batch of samples, then the converged ones stop
+        while (!active.empty()) {
+            vector<size_t> batch;
+            for (size_t p: active) {
+                size_t n = std::min(pt->samplesPerBatch, pt->ns_aa - num_samples[p]);
+                batch.insert(batch.end(), n, p);
+            }
+
+            for (size_t start = 0; start < batch.size(); start += samples_per_wave) {
+                size_t end = std::min(batch.size(), start + samples_per_wave);
+                pixels.clear();
+                for (size_t s = start; s < end; s++)
+                    pixels.push_back(std::make_pair(x0 + batch[s] % (x1 - x0), y0 + batch[s] / (x1 - x0)));
+                trace_samples(pixels);
+
+                for (size_t s = start; s < end; s++) {
+                    size_t p = batch[s];
+                    Vector3D sample = sample_radiance[s - start] / SAMPLE_PER_COLOR;
+                    radiance[p] += sample;
+                    num_samples[p]++;
+                    s1[p] += sample.illum();
+                    s2[p] += sample.illum() * sample.illum();
+                }
+            }
+
+            vector<size_t> still_active;
+            for (size_t p: active) {
+                size_t n = num_samples[p];
+                if (n >= pt->ns_aa) continue;
+                if (n % pt->samplesPerBatch == 0) {
+                    double miu = s1[p] / n;
+                    double sigma = sqrt((s2[p] - s1[p] / n * s1[p]) / (n - 1));
+                    if (1.96 * sigma < pt->maxTolerance * miu * sqrt(n)) continue;
+                }
+                still_active.push_back(p);
+            }
+            active.swap(still_active);
+        }
+
+        for (size_t p = 0; p < n_pixels; p++)
+            pt->write_pixel(radiance[p] / num_samples[p], num_samples[p], x0 + p % (x1 - x0), y0 + p / (x1 - x0));
+    }
+
+    void WavefrontPathTracer::trace_samples(const vector<pair<size_t, size_t> > &pixels) {
+        sample_radiance.assign(pixels.size(), Vector3D());
+        if (last_occluder.size() != pt->scene->lights.size())
+            last_occluder.assign(pt->scene->lights.size(), BVH_NO_OCCLUDER);
+
+        // the camera rays of a sample are generated together, so that the
+        // extend stage finds them coherent
+        paths.clear();
+        const HDRImageBuffer &buffer = pt->sampleBuffer;
+        for (uint32_t s = 0; s < pixels.size(); s++) {
+            Vector2D sample = Vector2D(pixels[s].first, pixels[s].second) + pt->gridSampler->get_sample();
+            int hero = (int) (random_uniform() * 3) % 3;
+            for (int i = 0; i < SAMPLE_PER_COLOR; i++) {
+                Ray r = pt->camera->generate_ray(sample.x / buffer.w, sample.y / buffer.h, (hero + i) % 3);
+                r.depth = pt->max_ray_depth;
+                paths.push(r, Vector3D(1, 1, 1), false, 0, s);
+            }
+        }
+
+        for (bool camera = true; paths.size() > 0; camera = false) {
+            extend();
+            next_paths.clear();
+            shadows.clear();
+            shade(camera);
+            shadow_test();
+            std::swap(paths, next_paths);
+        }
+    }
+
+    void WavefrontPathTracer::extend() {
+        for (size_t start = 0; start < paths.size(); start += BVH_PACKET_SIZE) {
+            size_t count = std::min<size_t>(paths.size() - start, BVH_PACKET_SIZE);
+            bool hit[BVH_PACKET_SIZE];
+            pt->bvh->intersect_packet(&paths.rays[start], &paths.isects[start], hit, count);
+            for (size_t k = 0; k < count; k++)
+                paths.hit[start + k] = hit[k];
+        }
+    }
+
+    void WavefrontPathTracer::shade(bool camera) {
+        // light reaching the camera or found by a BSDF sampled bounce, as in
+        // raytrace_pixel, and the roulette of the bounce that led here
+        shading_order.clear();
+        split_paths.clear();
+        for (uint32_t k = 0, n = paths.size(); k < n; k++) {
+            const Ray &ray = paths.rays[k];
+            const Intersection &isect = paths.isects[k];
+            if (camera) {
+                if (!paths.hit[k]) {
+                    if (pt->envLight)
+                        accumulate(paths.sample[k], pt->envLight->sample_dir(ray));
+                    continue;
+                }
+                accumulate(paths.sample[k], pt->zero_bounce_radiance(ray, isect));
+            }
+            else {
+                Vector3D &throughput = paths.throughput[k];
+                if (paths.specular[k] || !pt->direct_hemisphere_sample)
+                    accumulate(paths.sample[k],
+                               throughput * pt->bsdf_sampled_radiance(ray, isect, paths.hit[k], paths.pdf[k]));
+                if (!paths.hit[k]) continue;
+
+                double survival = std::min(RR_MAX_SURVIVAL,
+                                           std::max(throughput.x, std::max(throughput.y, throughput.z)));
+                if (!coin_flip(survival)) continue;
+                throughput /= survival;
+            }
+
+            if (isect.bsdf->is_dispersive() && !ray.hero_only()) {
+                split_paths.push_back(k);
+                continue;
+            }
+            shading_order.push_back(std::make_pair(isect.bsdf, k));
+        }
+        for (uint32_t k: split_paths)
+            split(k);
+        assert(paths.size() <= WAVEFRONT_MAX_PATHS);
+
+        // vertices with the same BSDF are shaded together
+        std::sort(shading_order.begin(), shading_order.end());
+        for (const pair<const BSDF *, uint32_t> &entry: shading_order) {
+            uint32_t k = entry.second;
+            const Ray &ray = paths.rays[k];
+            const Intersection &isect = paths.isects[k];
+            const Vector3D &throughput = paths.throughput[k];
+
+            Matrix3x3 o2w;
+            make_coord_space(o2w, isect.n);
+            Matrix3x3 w2o = o2w.T();
+            Vector3D hit_p = ray.o + ray.d * isect.t;
+            Vector3D w_out = w2o * (-ray.d);
+
+            if (!isect.bsdf->is_delta()) {
+                if (pt->direct_hemisphere_sample)
+                    accumulate(paths.sample[k], throughput * pt->estimate_direct_lighting_hemisphere(ray, isect));
+                else
+                    sample_lights(k, hit_p, w2o, w_out);
+            }
+            if (ray.depth == 0) continue;
+
+            Vector3D w_in;
+            double pdf;
+            Vector3D f = isect.bsdf->sample_f_spectral(w_out, &w_in, &pdf, ray.wavelengths, ray.color);
+            if (pdf == 0) continue;
+
+            Ray next(hit_p, o2w * w_in);
+            next.depth = ray.depth - 1;
+            next.min_t = EPS_F;
+            next.max_t = INF_D - EPS_F;
+            next.color = ray.color;
+            next.wavelength = ray.wavelength;
+            next.wavelengths = ray.wavelengths;
+            bool specular = isect.bsdf->is_delta();
+            next_paths.push(next, throughput * f * abs_cos_theta(w_in) / pdf, specular, specular ? 0 : pdf,
+                            paths.sample[k]);
+        }
+    }
+
+    void WavefrontPathTracer::split(uint32_t k) {
+        Ray ray = paths.rays[k];
+        Vector3D throughput = paths.throughput[k];
+        bool first = true;
+        for (int c = 0; c < 3; c++) {
+            if (throughput[c] == 0) continue;
+            Vector3D channel;
+            channel[c] = throughput[c];
+
+            uint32_t child = k;
+            if (first) {
+                paths.rays[k] = ray.single_wavelength(c);
+                paths.throughput[k] = channel;
+                first = false;
+            }
+            else {
+                paths.push(ray.single_wavelength(c), channel, paths.specular[k], paths.pdf[k], paths.sample[k]);
+                child = paths.size() - 1;
+                paths.isects[child] = paths.isects[k];
+                paths.hit[child] = true;
+            }
+            shading_order.push_back(std::make_pair(paths.isects[child].bsdf, child));
+        }
+    }
+
+    void WavefrontPathTracer::sample_lights(size_t k, const Vector3D &hit_p, const Matrix3x3 &w2o,
+                                            const Vector3D &w_out) {
+        const Ray &ray = paths.rays[k];
+        const Intersection &isect = paths.isects[k];
+        const Vector3D &throughput = paths.throughput[k];
+
+        for (uint32_t l = 0; l < pt->scene->lights.size(); l++) {
+            SceneLight *light = pt->scene->lights[l];
+            int n = light->is_delta_light() ? 1 : pt->ns_area_light;
+            for (int i = 0; i < n; i++) {
+                Vector3D wi;
+                double distToLight, pdf;
+                Vector3D lightIntensity = light->sample_L(hit_p, &wi, &distToLight, &pdf);
+                if (pdf == 0) continue;
+
+                Vector3D w_in = w2o * wi;
+                Vector3D f = isect.bsdf->f_spectral(w_out, w_in, ray.wavelengths);
+                Ray shadow(hit_p, wi);
+                shadow.min_t = EPS_F;
+                shadow.max_t = distToLight - EPS_F;
+
+                // weighted against the BSDF sampled bounce as in estimate_direct_lighting_importance
+                double weight = 1;
+                if (!light->is_delta_light() && ray.depth > 0)
+                    weight = pt->light_sample_weight(light, hit_p, wi, isect.bsdf->pdf(w_out, w_in));
+
+                shadows.rays.push_back(shadow);
+                shadows.radiance.push_back(throughput * f * lightIntensity / pdf / (double) n * weight);
+                shadows.light.push_back(l);
+                shadows.sample.push_back(paths.sample[k]);
+            }
+        }
+    }
+
+    void WavefrontPathTracer::shadow_test() {
+        // the shadow rays from a vertex toward a light are consecutive, and
+        // coherent, so they are tested as packets sharing the light's occluder
+        for (size_t start = 0; start < shadows.size();) {
+            uint32_t l = shadows.light[start];
+            size_t count = 1;
+            while (count < BVH_PACKET_SIZE && start + count < shadows.size() &&
+                   shadows.light[start + count] == l && shadows.rays[start + count].o == shadows.rays[start].o)
+                count++;
+
+            bool occluded[BVH_PACKET_SIZE];
+            pt->bvh->has_intersection_packet(&shadows.rays[start], occluded, count, &last_occluder[l]);
+            for (size_t k = 0; k < count; k++)
+                if (!occluded[k])
+                    accumulate(shadows.sample[start + k], shadows.radiance[start + k]);
+            start += count;
+        }
+    }
+
+}  // namespace CGL
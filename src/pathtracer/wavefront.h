@@ -0,0 +1,135 @@
+#ifndef CGL_WAVEFRONT_H
+#define CGL_WAVEFRONT_H
+
+#include <vector>
+#include <utility>
+
+#include "pathtracer/pathtracer.h"
+
+#define WAVEFRONT_MAX_PATHS 65536 ///< paths traced together, bounds the memory of the queues
+#define WAVEFRONT_MAX_SPLIT 3     ///< paths a path turns into at its first dispersive interface
+
+namespace CGL {
+
+/**
+ * Wavefront path tracer.
+ * Renders a tile by tracing many paths together, one stage at a time: every
+ * ray of a bounce is extended through the BVH, the hits are shaded grouped by
+ * BSDF, their shadow rays are tested together, and the light they carry is
+ * accumulated into the samples of the pixels. It estimates the same radiance
+ * as PathTracer::raytrace_pixel with the same settings, adaptive sampling
+ * included, and writes into the buffers of the given PathTracer. The queues
+ * are kept from one tile to the next, so an instance is used by one thread.
+ */
+    class WavefrontPathTracer {
+    public:
+
+        /**
+         * Constructor.
+         * \param pt path tracer providing the settings, the scene and the buffers
+         */
+        WavefrontPathTracer(PathTracer *pt);
+
+        /**
+         * Render the pixels [x0, x1) x [y0, y1) into the sample buffer of the
+         * path tracer.
+         */
+        void raytrace_tile(size_t x0, size_t y0, size_t x1, size_t y1);
+
+    private:
+
+        /**
+         * Paths waiting for a stage, one array per field.
+         */
+        struct PathQueue {
+            std::vector<Ray> rays;                           ///< ray leaving the last vertex
+            std::vector<SceneObjects::Intersection> isects;  ///< next vertex, found by extend
+            std::vector<char> hit;                           ///< the ray hit the scene
+            std::vector<Vector3D> throughput;                ///< throughput up to the ray, before its roulette
+            std::vector<char> specular;                      ///< the last vertex has a delta BSDF
+            std::vector<double> pdf;                         ///< density of the BSDF sample of the ray, zero if specular
+            std::vector<uint32_t> sample;                    ///< pixel sample the path belongs to
+
+            size_t size() const { return rays.size(); }
+
+            void clear();
+
+            void reserve(size_t n);
+
+            void push(const Ray &ray, const Vector3D &throughput, bool specular, double pdf, uint32_t sample);
+        };
+
+        /**
+         * Shadow rays toward the lights and the light they bring if unoccluded.
+         */
+        struct ShadowQueue {
+            std::vector<Ray> rays;           ///< from a vertex to a light sample
+            std::vector<Vector3D> radiance;  ///< throughput * f * L / pdf
+            std::vector<uint32_t> light;     ///< index of the light in the scene
+            std::vector<uint32_t> sample;    ///< pixel sample the path belongs to
+
+            size_t size() const { return rays.size(); }
+
+            void clear();
+        };
+
+        /**
+         * Trace all the paths of the given pixel samples, their radiance is
+         * summed into sample_radiance.
+         * \param pixels pixel coordinates of each sample
+         */
+        void trace_samples(const std::vector<std::pair<size_t, size_t> > &pixels);
+
+        /**
+         * Find the next vertex of every path in paths.
+         */
+        void extend();
+
+        /**
+         * Add the light seen at the vertices, or past them for the paths that
+         * missed, play the roulette of the paths that reached them, queue
+         * their shadow rays, and queue the surviving bounces into next_paths.
+         * \param camera whether paths hold camera rays
+         */
+        void shade(bool camera);
+
+        /**
+         * Split path k, at its first dispersive interface, into one path per
+         * color channel. Path k becomes the first of them and the others are
+         * appended to paths, at the same vertex, and all are queued for shading.
+         * Appending may move the queue, so it runs after the loop over paths.
+         */
+        void split(uint32_t k);
+
+        /**
+         * Queue the shadow rays toward every light from the vertex of path k.
+         */
+        void sample_lights(size_t k, const Vector3D &hit_p, const Matrix3x3 &w2o, const Vector3D &w_out);
+
+        /**
+         * Test the shadow rays and add the light of the unoccluded ones.
+         */
+        void shadow_test();
+
+        /**
+         * Add the light a path brings to its pixel sample.
+         */
+        void accumulate(uint32_t sample, const Vector3D &L) {
+            sample_radiance[sample] += L;
+        }
+
+        PathTracer *pt;                ///< settings, scene and output buffers
+
+        PathQueue paths;               ///< paths at the current bounce
+        PathQueue next_paths;          ///< paths continuing to the next bounce
+        ShadowQueue shadows;           ///< shadow rays of the current bounce
+
+        std::vector<Vector3D> sample_radiance;  ///< radiance of each pixel sample, summed over its rays
+        std::vector<std::pair<const BSDF *, uint32_t> > shading_order;  ///< paths to shade, grouped by BSDF
+        std::vector<uint32_t> split_paths;      ///< paths to split once the vertices are all visited
+        std::vector<uint32_t> last_occluder;    ///< per light, the reference that last blocked a shadow ray
+    };
+
+}  // namespace CGL
+
+#endif  // CGL_WAVEFRONT_H
@@ -14,12 +14,12 @@ namespace CGL {
         // If the ray intersected the bouding box within the range given by
         // t0, t1, update t0 and t1 with the new intersection times.
 
-        t0 = (min.x - r.o.x) / r.d.x;
-        t1 = (max.x - r.o.x) / r.d.x;
+        t0 = (min.x - r.o.x) * r.inv_d.x;
+        t1 = (max.x - r.o.x) * r.inv_d.x;
         if (t0 > t1) std::swap(t0, t1);
 
-        auto tymin = (min.y - r.o.y) / r.d.y;
-        auto tymax = (max.y - r.o.y) / r.d.y;
+        auto tymin = (min.y - r.o.y) * r.inv_d.y;
+        auto tymax = (max.y - r.o.y) * r.inv_d.y;
         if (tymin > tymax) std::swap(tymin, tymax);
         if ((t0 > tymax) || (tymin > t1))
             return false;
@@ -29,8 +29,8 @@ namespace CGL {
         if (tymax < t1)
             t1 = tymax;
 
-        auto tzmin = (min.z - r.o.z) / r.d.z;
-        auto tzmax = (max.z - r.o.z) / r.d.z;
+        auto tzmin = (min.z - r.o.z) * r.inv_d.z;
+        auto tzmax = (max.z - r.o.z) * r.inv_d.z;
         if (tzmin > tzmax) std::swap(tzmin, tzmax);
         if ((t0 > tzmax) || (tzmin > t1))
             return false;
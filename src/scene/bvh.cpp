@@ -5,29 +5,132 @@
 
 #include <iostream>
 #include <stack>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+
+// the float triangle test may accept hits a few ulps outside the boxes,
+// far distances are scaled up by as much as in the wide traversal
+#define BINARY_TFAR_SCALE_FLOAT 1.0000004
 
 using namespace std;
 
 namespace CGL {
     namespace SceneObjects {
 
+        BVHAccel::BVHAccel() : root(NULL), precision(BVH_PRECISION_DOUBLE), node_order(BVH_ORDER_DEPTH_FIRST) {}
+
         BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
-                           size_t max_leaf_size) {
+                           size_t max_leaf_size, BVHBuildMethod method, BVHLayout layout,
+                           size_t num_threads, double split_budget) {
+
+            this->max_leaf_size = max_leaf_size;
+            this->method = method;
+            this->layout = layout;
+            this->num_threads = std::max(num_threads, (size_t) 1);
+            this->split_budget = split_budget;
+            this->precision = BVH_PRECISION_DOUBLE;
+            this->node_order = BVH_ORDER_DEPTH_FIRST;
+
+            root = NULL;
+            build_tree(_primitives);
+        }
+
+        void BVHAccel::build_tree(const std::vector<Primitive *> &_primitives) {
+
+            if (root)
+                delete root;
 
             primitives = std::vector<Primitive *>(_primitives);
-            root = construct_bvh(primitives.begin(), primitives.end(), max_leaf_size);
+
+            // cache bounds and centroids so the builders do not query them again
+            std::vector<BVHBuildPrimitive> build(primitives.size());
+            parallel_chunks(0, build.size(), num_threads, [&](size_t, size_t s, size_t e) {
+                for (size_t i = s; i < e; i++) {
+                    build[i].primitive = primitives[i];
+                    build[i].bb = primitives[i]->get_bbox();
+                    build[i].centroid = build[i].bb.centroid();
+                    build[i].index = i;
+                }
+            });
+
+            if (method == BVH_BUILD_LBVH || method == BVH_BUILD_HLBVH)
+                root = construct_lbvh(build, max_leaf_size, method == BVH_BUILD_HLBVH, num_threads);
+            else if (method == BVH_BUILD_SBVH)
+                root = construct_sbvh(build, max_leaf_size, split_budget);
+            else
+                root = construct_bvh(build, 0, build.size(), max_leaf_size, method, num_threads);
+
+            // the builders reorder the build entries, leaves index into this order,
+            // which holds a primitive several times if it was split spatially
+            input_index.resize(build.size());
+            for (size_t i = 0; i < build.size(); i++) {
+                primitives[i] = build[i].primitive;
+                input_index[i] = build[i].index;
+            }
+
+            flatten();
+            build_cost = sah_cost();
+        }
+
+        void BVHAccel::flatten() {
+            nodes.clear();
+            wide_nodes.clear();
+            quantized_nodes.clear();
+            pack_triangles();
+            record_bounds();
+            if (primitives.empty()) return;
+
+            if (layout == BVH_LAYOUT_BINARY) {
+                flatten_bvh(root);
+                return;
+            }
+
+            collapse_wide(root);
+            if (layout == BVH_LAYOUT_COMPRESSED) {
+                // the float nodes are only needed to encode the compressed ones
+                quantize_wide();
+                vector<WideBVHNode>().swap(wide_nodes);
+            }
+            // visit counts do not survive an update
+            node_visits.clear();
+            if (node_order != BVH_ORDER_DEPTH_FIRST)
+                reorder_nodes(NULL);
+        }
+
+        void BVHAccel::record_bounds() {
+            reference_bounds.resize(primitives.size());
+            for (size_t i = 0; i < primitives.size(); i++)
+                reference_bounds[i] = primitives[i]->get_bbox();
         }
 
         BVHAccel::~BVHAccel() {
             if (root)
                 delete root;
             primitives.clear();
+            for (atomic<ThreadStats *> &slot: thread_stats_slots)
+                delete slot.load();
         }
 
         BBox BVHAccel::get_bbox() const {
             return root->bb;
         }
 
+        void BVHAccel::set_precision(BVHPrecision precision) {
+            if (precision == this->precision) return;
+            this->precision = precision;
+            pack_triangles();
+        }
+
+        size_t BVHAccel::node_bytes() const {
+            return nodes.size() * sizeof(LinearBVHNode) + wide_nodes.size() * sizeof(WideBVHNode) +
+                   quantized_nodes.size() * sizeof(QuantizedBVHNode);
+        }
+
+        size_t BVHAccel::uncompressed_node_bytes() const {
+            return node_bytes() + quantized_nodes.size() * (sizeof(WideBVHNode) - sizeof(QuantizedBVHNode));
+        }
+
         void BVHAccel::draw(BVHNode *node, const Color &c, float alpha) const {
             if (node->isLeaf()) {
                 for (auto p = node->start; p != node->end; p++) {
@@ -52,107 +155,347 @@ namespace CGL {
             }
         }
 
-        BVHNode *BVHAccel::construct_bvh(std::vector<Primitive *>::iterator start,
-                                         std::vector<Primitive *>::iterator end,
-                                         size_t max_leaf_size) {
-
-            // TODO (Part 2.1):
-            // Construct a BVH from the given vector of primitives and maximum leaf
-            // size configuration. The starter code build a BVH aggregate with a
-            // single leaf node (which is also the root) that encloses all the
-            // primitives.
+        BVHNode *BVHAccel::construct_bvh(std::vector<BVHBuildPrimitive> &build,
+                                         size_t start, size_t end, size_t max_leaf_size,
+                                         BVHBuildMethod method, size_t num_threads) {
 
-            BBox bbox;
+            // bounds of the primitives and of their centroids, reduced per chunk
+            std::vector<BBox> chunk_bounds(num_threads), chunk_centroids(num_threads);
+            parallel_chunks(start, end, num_threads, [&](size_t chunk, size_t s, size_t e) {
+                for (size_t i = s; i < e; i++) {
+                    chunk_bounds[chunk].expand(build[i].bb);
+                    chunk_centroids[chunk].expand(build[i].centroid);
+                }
+            });
 
-            for (auto p = start; p != end; p++) {
-                BBox bb = (*p)->get_bbox();
-                bbox.expand(bb);
+            BBox bbox, centroid_bounds;
+            for (size_t t = 0; t < num_threads; t++) {
+                bbox.expand(chunk_bounds[t]);
+                centroid_bounds.expand(chunk_centroids[t]);
             }
 
+            // leaves point into primitives, which is filled in build order once done
             BVHNode *node = new BVHNode(bbox);
-            node->start = start;
-            node->end = end;
+            node->start = primitives.begin() + start;
+            node->end = primitives.begin() + end;
 
-            if (end - start <= max_leaf_size) {
-                node->l = nullptr;
-                node->r = nullptr;
+            size_t n = end - start;
+            if (n <= 1 || (method == BVH_BUILD_MEDIAN && n <= max_leaf_size))
                 return node;
+
+            size_t mid;
+
+            if (method == BVH_BUILD_SAH) {
+                if (!split_sah(build, start, end, bbox, centroid_bounds, max_leaf_size, num_threads, mid))
+                    return node;
+            }
+            else {
+                // find longest axis
+                Vector3D diag = bbox.extent;
+                int axis = 0;
+                if (diag.y > diag.x)
+                    axis = 1;
+
+                if (diag.z > diag.y && diag.z > diag.x)
+                    axis = 2;
+
+                // split primitives at the median along longest axis
+                mid = start + n / 2;
+                nth_element(build.begin() + start, build.begin() + mid, build.begin() + end,
+                            [axis](const BVHBuildPrimitive &a, const BVHBuildPrimitive &b) {
+                                return a.centroid[axis] < b.centroid[axis];
+                            });
             }
 
-            // find longest axis
-            Vector3D diag = bbox.extent;
-            int axis = 0;
-            if (diag.y > diag.x)
-                axis = 1;
+            // the children cover disjoint ranges of build and can be built
+            // concurrently, each with its share of the threads
+            if (num_threads > 1 && n >= BVH_PARALLEL_THRESHOLD) {
+                size_t left_threads = num_threads / 2;
+                std::thread worker([&]() {
+                    node->l = construct_bvh(build, start, mid, max_leaf_size, method, left_threads);
+                });
+                node->r = construct_bvh(build, mid, end, max_leaf_size, method, num_threads - left_threads);
+                worker.join();
+            }
+            else {
+                node->l = construct_bvh(build, start, mid, max_leaf_size, method, 1);
+                node->r = construct_bvh(build, mid, end, max_leaf_size, method, 1);
+            }
+
+            return node;
+
+        }
+
+        bool BVHAccel::split_sah(std::vector<BVHBuildPrimitive> &build, size_t start, size_t end,
+                                 const BBox &bbox, const BBox &centroid_bounds,
+                                 size_t max_leaf_size, size_t num_threads, size_t &mid) {
+
+            size_t n = end - start;
 
-            if (diag.z > diag.y && diag.z > diag.x)
-                axis = 2;
+            // bin the centroids along the three axes, one set of bins per chunk
+            struct Bins {
+                BBox bounds[3][SAH_BIN_COUNT];
+                size_t count[3][SAH_BIN_COUNT] = {};
+            };
 
+            double scale[3];
+            for (int axis = 0; axis < 3; axis++) {
+                double cext = centroid_bounds.extent[axis];
+                scale[axis] = cext > 0 ? SAH_BIN_COUNT / cext : 0;
+            }
 
-            // sort primitives along longest axis
-            sort(start, end, [axis](Primitive *a, Primitive *b) {
-                BBox bb1 = a->get_bbox();
-                BBox bb2 = b->get_bbox();
-                return bb1.centroid()[axis] < bb2.centroid()[axis];
+            std::vector<Bins> chunk_bins(num_threads);
+            parallel_chunks(start, end, num_threads, [&](size_t chunk, size_t s, size_t e) {
+                Bins &bins = chunk_bins[chunk];
+                for (size_t i = s; i < e; i++) {
+                    for (int axis = 0; axis < 3; axis++) {
+                        int b = (int) ((build[i].centroid[axis] - centroid_bounds.min[axis]) * scale[axis]);
+                        b = std::min(b, SAH_BIN_COUNT - 1);
+                        bins.count[axis][b]++;
+                        bins.bounds[axis][b].expand(build[i].bb);
+                    }
+                }
             });
 
-            // split primitives into two sets and build children
-            auto mid = start + (end - start) / 2;
+            for (size_t t = 1; t < num_threads; t++) {
+                for (int axis = 0; axis < 3; axis++) {
+                    for (int b = 0; b < SAH_BIN_COUNT; b++) {
+                        chunk_bins[0].count[axis][b] += chunk_bins[t].count[axis][b];
+                        chunk_bins[0].bounds[axis][b].expand(chunk_bins[t].bounds[axis][b]);
+                    }
+                }
+            }
 
-            node->l = construct_bvh(start, mid, max_leaf_size);
-            node->r = construct_bvh(mid, end, max_leaf_size);
+            // cost of each split relative to the cost of intersecting a primitive,
+            // normalized by the surface area of the node
+            double best_cost = INF_D;
+            int best_axis = -1, best_split = 0;
+
+            for (int axis = 0; axis < 3; axis++) {
+                if (scale[axis] == 0) continue;
+
+                const BBox *bin_bounds = chunk_bins[0].bounds[axis];
+                const size_t *bin_count = chunk_bins[0].count[axis];
+
+                // sweep from the right to accumulate the cost of the right sides
+                double right_area[SAH_BIN_COUNT];
+                size_t right_count[SAH_BIN_COUNT];
+                BBox acc;
+                size_t cnt = 0;
+                for (int b = SAH_BIN_COUNT - 1; b > 0; b--) {
+                    acc.expand(bin_bounds[b]);
+                    cnt += bin_count[b];
+                    right_area[b] = cnt ? acc.surface_area() : 0;
+                    right_count[b] = cnt;
+                }
 
-            return node;
+                acc = BBox();
+                cnt = 0;
+                for (int b = 1; b < SAH_BIN_COUNT; b++) {
+                    acc.expand(bin_bounds[b - 1]);
+                    cnt += bin_count[b - 1];
+                    if (cnt == 0 || right_count[b] == 0) continue;
+                    double cost = cnt * acc.surface_area() + right_count[b] * right_area[b];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b;
+                    }
+                }
+            }
 
+            double area = bbox.surface_area();
+            double leaf_cost = SAH_INTERSECTION_COST * n;
+
+            if (best_axis < 0) {
+                // all centroids coincide, binning cannot separate them
+                if (n <= max_leaf_size) return false;
+                mid = start + n / 2;
+                return true;
+            }
+
+            best_cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * best_cost / area;
+            if (n <= max_leaf_size && leaf_cost <= best_cost)
+                return false;
+
+            double cmin = centroid_bounds.min[best_axis];
+            double axis_scale = scale[best_axis];
+            auto it = partition(build.begin() + start, build.begin() + end,
+                                [=](const BVHBuildPrimitive &p) {
+                                    int b = (int) ((p.centroid[best_axis] - cmin) * axis_scale);
+                                    return std::min(b, SAH_BIN_COUNT - 1) < best_split;
+                                });
+            mid = it - build.begin();
+            return true;
         }
 
-        bool BVHAccel::has_intersection(const Ray &ray, BVHNode *node) const {
-            // TODO (Part 2.3):
-            // Fill in the intersect function.
-            // Take note that this function has a short-circuit that the
-            // Intersection version cannot, since it returns as soon as it finds
-            // a hit, it doesn't actually have to find the closest hit.
+        double BVHAccel::sah_cost() const {
+            if (!root) return 0;
+            return sah_cost(root) / root->bb.surface_area();
+        }
+
+        double BVHAccel::sah_cost(BVHNode *node) const {
+            double area = node->bb.surface_area();
+            if (node->isLeaf())
+                return area * SAH_INTERSECTION_COST * (node->end - node->start);
+            return area * SAH_TRAVERSAL_COST + sah_cost(node->l) + sah_cost(node->r);
+        }
 
-            // simply tests whether there is an intersection between the input ray and any primitives in the input BVH
-            double t0, t1;
+        uint32_t BVHAccel::flatten_bvh(BVHNode *node) {
+            uint32_t index = nodes.size();
+            nodes.emplace_back();
+
+            LinearBVHNode &linear = nodes[index];
+            for (int a = 0; a < 3; a++) {
+                linear.min[a] = round_outward(node->bb.min[a], -1);
+                linear.max[a] = round_outward(node->bb.max[a], 1);
+            }
+            linear.pad = 0;
+
+            if (node->isLeaf()) {
+                linear.primitives_offset = node->start - primitives.cbegin();
+                linear.n_primitives = node->end - node->start;
+                linear.axis = 0;
+                return index;
+            }
 
-            if (node->bb.intersect(ray, t0, t1)) {
-                if (node->isLeaf()) {
-                    for (auto p = node->start; p != node->end; p++) {
-                        total_isects++;
-                        if ((*p)->has_intersection(ray))
+            // order the children along the axis that separates them the most
+            Vector3D d = node->r->bb.centroid() - node->l->bb.centroid();
+            int axis = 0;
+            if (fabs(d.y) > fabs(d[axis])) axis = 1;
+            if (fabs(d.z) > fabs(d[axis])) axis = 2;
+            linear.axis = axis;
+            linear.n_primitives = 0;
+
+            flatten_bvh(node->l);
+            uint32_t second = flatten_bvh(node->r);
+            // nodes may have been reallocated by the recursion
+            nodes[index].second_child_offset = second;
+            return index;
+        }
+
+        /**
+         * Slab test of a flattened node against the [min_t, max_t] range of the ray.
+         * Comparisons are written so that NaNs from axis aligned rays are ignored.
+         * Far distances are multiplied by tfar_scale, which leaves room for the
+         * rounding errors of the float triangle test.
+         */
+        static inline bool intersect_node(const LinearBVHNode &node, const Ray &ray,
+                                          const int dir_is_neg[3], double tfar_scale) {
+            double t0 = ray.min_t, t1 = ray.max_t;
+            for (int a = 0; a < 3; a++) {
+                double tnear = ((dir_is_neg[a] ? node.max[a] : node.min[a]) - ray.o[a]) * ray.inv_d[a];
+                double tfar = ((dir_is_neg[a] ? node.min[a] : node.max[a]) - ray.o[a]) * ray.inv_d[a] * tfar_scale;
+                if (tnear > t0) t0 = tnear;
+                if (tfar < t1) t1 = tfar;
+                if (t0 > t1) return false;
+            }
+            return true;
+        }
+
+        bool BVHAccel::has_intersection(const Ray &ray) const {
+            return has_intersection(ray, NULL);
+        }
+
+        bool BVHAccel::has_intersection(const Ray &ray, uint32_t *occluder) const {
+            BVHTraversalStats &stats = thread_stats();
+            ++stats.shadow_rays;
+
+            // the last occluder of a light likely blocks the next ray toward it
+            if (occluder && *occluder < primitives.size() && has_intersection_leaf(ray, *occluder, 1, NULL)) {
+                ++stats.rays;
+                ++stats.occluded;
+                ++stats.occluder_hits;
+                return true;
+            }
+
+            bool hit = layout != BVH_LAYOUT_BINARY ? has_intersection_wide(ray, occluder)
+                                                   : has_intersection_binary(ray, occluder);
+            if (hit) ++stats.occluded;
+            // lit rays empty the cache, so that it is only tested in shadowed regions
+            else if (occluder) *occluder = BVH_NO_OCCLUDER;
+            return hit;
+        }
+
+        bool BVHAccel::has_intersection_binary(const Ray &ray, uint32_t *occluder) const {
+            BVHTraversalStats &stats = thread_stats();
+            ++stats.rays;
+            if (nodes.empty()) return false;
+
+            int dir_is_neg[3] = {ray.inv_d.x < 0, ray.inv_d.y < 0, ray.inv_d.z < 0};
+            double tfar_scale = precision == BVH_PRECISION_FLOAT ? BINARY_TFAR_SCALE_FLOAT : 1.0;
+            BVHTraversalStack<uint32_t, BVH_STACK_SIZE> stack;
+            uint32_t current = 0;
+
+            while (true) {
+                const LinearBVHNode &node = nodes[current];
+                ++stats.nodes_visited;
+                if (intersect_node(node, ray, dir_is_neg, tfar_scale)) {
+                    if (node.n_primitives > 0) {
+                        if (has_intersection_leaf(ray, node.primitives_offset, node.n_primitives, occluder))
                             return true;
                     }
-                    return false;
+                    else {
+                        // visit the near child first, push the far one
+                        if (dir_is_neg[node.axis]) {
+                            stack.push(current + 1);
+                            current = node.second_child_offset;
+                        }
+                        else {
+                            stack.push(node.second_child_offset);
+                            current = current + 1;
+                        }
+                        continue;
+                    }
                 }
-                return has_intersection(ray, node->l) || has_intersection(ray, node->r);
+                if (stack.empty()) break;
+                current = stack.pop();
             }
             return false;
         }
 
-        bool BVHAccel::intersect(const Ray &ray, Intersection *i, BVHNode *node) const {
-            // TODO (Part 2.3):
-            // Fill in the intersect function.
+        bool BVHAccel::intersect(const Ray &ray, Intersection *i) const {
+            bool hit = layout == BVH_LAYOUT_BINARY ? intersect_binary(ray, i) : intersect_wide(ray, i);
+            if (hit) i->primitive->finish_intersection(ray, i);
+            return hit;
+        }
 
-            bool hit = false;
-            double t0, t1;
+        bool BVHAccel::intersect_binary(const Ray &ray, Intersection *i) const {
+            BVHTraversalStats &stats = thread_stats();
+            ++stats.rays;
+            if (nodes.empty()) return false;
 
-            if (node->bb.intersect(ray, t0, t1)) {
-                if (node->isLeaf()) {
-                    for (auto p = node->start; p != node->end; p++) {
-                        total_isects++;
-                        if ((*p)->intersect(ray, i))
+            bool hit = false;
+            int dir_is_neg[3] = {ray.inv_d.x < 0, ray.inv_d.y < 0, ray.inv_d.z < 0};
+            double tfar_scale = precision == BVH_PRECISION_FLOAT ? BINARY_TFAR_SCALE_FLOAT : 1.0;
+            BVHTraversalStack<uint32_t, BVH_STACK_SIZE> stack;
+            uint32_t current = 0;
+
+            while (true) {
+                const LinearBVHNode &node = nodes[current];
+                ++stats.nodes_visited;
+                // primitives shorten ray.max_t on hit, which culls farther nodes
+                if (intersect_node(node, ray, dir_is_neg, tfar_scale)) {
+                    if (node.n_primitives > 0) {
+                        if (intersect_leaf(ray, node.primitives_offset, node.n_primitives, i))
                             hit = true;
                     }
-                    return hit;
+                    else {
+                        if (dir_is_neg[node.axis]) {
+                            stack.push(current + 1);
+                            current = node.second_child_offset;
+                        }
+                        else {
+                            stack.push(node.second_child_offset);
+                            current = current + 1;
+                        }
+                        continue;
+                    }
                 }
-
-                bool hit_l = intersect(ray, i, node->l);
-                bool hit_r = intersect(ray, i, node->r);
-
-                return hit_l || hit_r;
+                if (stack.empty()) break;
+                current = stack.pop();
             }
-            return false;
+            return hit;
         }
 
     } // namespace SceneObjects
@@ -5,10 +5,167 @@
 #include "aggregate.h"
 
 #include <vector>
+#include <string>
+#include <cstdint>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+#define BVH_STACK_SIZE 64 ///< entries the traversal stacks hold before they spill to the heap
+
+#define SAH_BIN_COUNT 16            ///< number of bins per axis of the SAH builder
+#define SAH_TRAVERSAL_COST 0.125    ///< cost of a node traversal relative to a primitive test
+#define SAH_INTERSECTION_COST 1.0   ///< cost of a primitive intersection test
+
+#define BVH_PARALLEL_THRESHOLD 4096 ///< smallest node that is split across threads
+
+// width of the wide BVH, matched to the SIMD registers the build targets
+#if defined(__AVX__)
+#define BVH_WIDTH 8
+#else
+#define BVH_WIDTH 4
+#endif
+
+#define BVH_PACKET_SIZE BVH_WIDTH ///< rays traced together by the packet traversal, one per SIMD lane
+#define BVH_PACKET_MIN 2          ///< smallest packet worth tracing together, smaller ones trace ray by ray
+
+#define BVH_NO_OCCLUDER UINT32_MAX ///< empty occluder cache of the shadow ray traversal
+
+#define BVH_TREELET_BYTES 4096 ///< size of the node blocks laid out together by the treelet orders
+
+#define BVH_STATS_SLOTS 256 ///< threads alive at once that get traversal counters, the others are not counted
 
 namespace CGL {
     namespace SceneObjects {
 
+        class Triangle;
+
+/**
+ * Strategy used to split the primitives of a node while constructing the BVH.
+ */
+        enum BVHBuildMethod {
+            BVH_BUILD_MEDIAN,   ///< sort along the longest axis and split at the median
+            BVH_BUILD_SAH,      ///< binned Surface Area Heuristic
+            BVH_BUILD_LBVH,     ///< linear BVH from radix sorted Morton codes
+            BVH_BUILD_HLBVH,    ///< LBVH treelets joined by SAH top levels
+            BVH_BUILD_SBVH      ///< SAH with spatial splits that duplicate straddling primitives
+        };
+
+/**
+ * Node layout the BVH is traversed with.
+ */
+        enum BVHLayout {
+            BVH_LAYOUT_BINARY,    ///< flattened binary tree (LinearBVHNode)
+            BVH_LAYOUT_WIDE,      ///< BVH_WIDTH children per node tested with SIMD (WideBVHNode)
+            BVH_LAYOUT_COMPRESSED ///< wide nodes with child bounds quantized to 8 bits (QuantizedBVHNode)
+        };
+
+/**
+ * Order the traversal nodes of the wide layouts are stored in. The binary
+ * layout always stays depth first, its traversal relies on the left child
+ * following its parent.
+ */
+        enum BVHNodeOrder {
+            BVH_ORDER_DEPTH_FIRST, ///< order of construction, each subtree after its parent
+            BVH_ORDER_TREELET,     ///< blocks of BVH_TREELET_BYTES grown from the largest child boxes
+            BVH_ORDER_PROFILED     ///< blocks grown from the nodes visited most during a warm-up render
+        };
+
+/**
+ * Precision the leaves test triangles in. The traversal is single precision
+ * in both modes.
+ */
+        enum BVHPrecision {
+            BVH_PRECISION_DOUBLE, ///< single precision filter, candidates confirmed by Triangle::intersect
+            BVH_PRECISION_FLOAT   ///< watertight single precision test, the double triangles are only read on hits
+        };
+
+/**
+ * How BVHAccel::update brought the tree up to date.
+ */
+        enum BVHUpdate {
+            BVH_UPDATE_REFIT,           ///< bounds refitted, topology unchanged
+            BVH_UPDATE_SUBTREE_REBUILD, ///< one subtree rebuilt
+            BVH_UPDATE_FULL_REBUILD     ///< whole tree rebuilt
+        };
+
+/**
+ * Parameters of the BVHs the renderer has built on its behalf, such as the
+ * BVHs of the meshes under the top level BVH.
+ */
+        struct BVHBuildOptions {
+            BVHBuildMethod method = BVH_BUILD_SAH;              ///< split strategy
+            BVHLayout layout = BVH_LAYOUT_WIDE;                 ///< node layout
+            size_t max_leaf_size = 4;                           ///< primitives per leaf
+            size_t num_threads = 1;                             ///< build threads, no effect on the tree
+            double split_budget = 0.3;                          ///< SBVH reference budget
+            BVHPrecision precision = BVH_PRECISION_DOUBLE;      ///< leaf test precision
+            BVHNodeOrder node_order = BVH_ORDER_DEPTH_FIRST;    ///< memory order of the nodes
+
+            /**
+             * Whether a BVH built with these options has the same tree as one built
+             * with the other options. The precision and node order can be changed
+             * on a built tree.
+             */
+            bool same_tree(const BVHBuildOptions &other) const {
+                return method == other.method && layout == other.layout &&
+                       max_leaf_size == other.max_leaf_size && split_budget == other.split_budget;
+            }
+        };
+
+/**
+ * Traversal counters. Every thread counts into its own copy, and
+ * BVHAccel::traversal_stats adds them up.
+ */
+        struct BVHTraversalStats {
+            unsigned long long rays = 0;          ///< rays traced, shadow rays included
+            unsigned long long shadow_rays = 0;   ///< rays traced by has_intersection
+            unsigned long long nodes_visited = 0; ///< traversal nodes fetched, per ray
+            unsigned long long isects = 0;        ///< primitives tested
+            unsigned long long occluded = 0;      ///< shadow rays that hit something
+            unsigned long long occluder_hits = 0; ///< shadow rays stopped by their cached occluder
+
+            void add(const BVHTraversalStats &other) {
+                rays += other.rays;
+                shadow_rays += other.shadow_rays;
+                nodes_visited += other.nodes_visited;
+                isects += other.isects;
+                occluded += other.occluded;
+                occluder_hits += other.occluder_hits;
+            }
+        };
+
+/**
+ * Shape of a built tree.
+ */
+        struct BVHTreeStats {
+            double sah_cost;          ///< as returned by BVHAccel::sah_cost
+            size_t primitives;        ///< primitives the tree was built from
+            size_t references;        ///< primitive references in the leaves, spatial splits included
+            size_t max_leaf_size;     ///< build parameter
+            size_t interior_nodes;    ///< interior nodes of the traversal layout
+            size_t leaf_nodes;        ///< leaves of the traversal layout, leaf children for the wide ones
+            size_t traversal_nodes;   ///< nodes of the traversal layout
+            size_t node_bytes;        ///< memory used by the traversal nodes
+            size_t max_depth;         ///< depth of the deepest leaf, the root being at depth 0
+            std::vector<size_t> depth_histogram;     ///< number of leaves at each depth
+            std::vector<size_t> leaf_size_histogram; ///< number of leaves holding each number of references
+        };
+
+/**
+ * Per-primitive data cached for BVH construction.
+ * Bounding boxes and centroids are queried once before the build so that the
+ * builders never go through the virtual Primitive::get_bbox while splitting.
+ */
+        struct BVHBuildPrimitive {
+            Primitive *primitive; ///< the primitive itself
+            BBox bb;              ///< world space bounding box of the primitive
+            Vector3D centroid;    ///< centroid of the bounding box
+            size_t index;         ///< position of the primitive in the input list
+        };
 
 /**
  * A node in the BVH accelerator aggregate.
@@ -39,6 +196,156 @@ namespace CGL {
             std::vector<Primitive *>::const_iterator end;
         };
 
+/**
+ * Run f(chunk, chunk_start, chunk_end) over num_threads contiguous chunks of
+ * [start, end), one per thread. Small ranges run as a single chunk on the
+ * calling thread. Callers keep one result per chunk and merge them in chunk
+ * order, so the outcome does not depend on the thread count.
+ */
+        template<typename F>
+        void parallel_chunks(size_t start, size_t end, size_t num_threads, F f) {
+            size_t n = end - start;
+            if (num_threads <= 1 || n < BVH_PARALLEL_THRESHOLD) {
+                f(0, start, end);
+                return;
+            }
+
+            size_t chunk = (n + num_threads - 1) / num_threads;
+            std::vector<std::thread> workers;
+            for (size_t t = 1; t < num_threads; t++) {
+                size_t s = std::min(end, start + t * chunk);
+                size_t e = std::min(end, s + chunk);
+                workers.emplace_back(f, t, s, e);
+            }
+            f(0, start, std::min(end, start + chunk));
+            for (auto &w: workers)
+                w.join();
+        }
+
+/**
+ * Round a double down (dir < 0) or up (dir > 0) to the nearest float so that
+ * single precision bounds always contain the double precision ones.
+ */
+        inline float round_outward(double v, float dir) {
+            float f = (float) v;
+            if (dir < 0 ? f > v : f < v)
+                f = nextafterf(f, dir * INFINITY);
+            return f;
+        }
+
+/**
+ * Stack of the iterative traversals. The first N entries live in the stack
+ * frame of the traversal; deeper trees, which no builder rules out, spill to
+ * the heap instead of writing past the array. Entries can be indexed, for
+ * the traversals that keep the children they push sorted.
+ */
+        template<typename T, size_t N>
+        class BVHTraversalStack {
+        public:
+            BVHTraversalStack() : data(local), capacity(N), top(0) {}
+
+            BVHTraversalStack(const BVHTraversalStack &) = delete;
+
+            BVHTraversalStack &operator=(const BVHTraversalStack &) = delete;
+
+            bool empty() const { return top == 0; }
+
+            size_t size() const { return top; }
+
+            void push(const T &entry) {
+                if (top == capacity) grow();
+                data[top++] = entry;
+            }
+
+            T pop() { return data[--top]; }
+
+            T &operator[](size_t k) { return data[k]; }
+
+        private:
+            void grow() {
+                std::vector<T> larger(2 * capacity);
+                std::copy(data, data + top, larger.begin());
+                overflow.swap(larger);
+                data = overflow.data();
+                capacity = overflow.size();
+            }
+
+            T local[N];               ///< entries of shallow traversals
+            std::vector<T> overflow;  ///< all the entries, once more than N were pushed
+            T *data;                  ///< local or overflow
+            size_t capacity;
+            size_t top;
+        };
+
+/**
+ * A node of the flattened BVH used for traversal.
+ * Nodes are stored depth first in one array, so the left child of an interior
+ * node immediately follows it and only the offset of the right child is kept.
+ * Bounds are single precision and rounded outward so that they still enclose
+ * the double precision bounds of the original tree.
+ */
+        struct LinearBVHNode {
+            float min[3];    ///< lower corner of the bounding box
+            float max[3];    ///< upper corner of the bounding box
+            union {
+                uint32_t primitives_offset;  ///< leaf: index of the first primitive
+                uint32_t second_child_offset; ///< interior: index of the right child
+            };
+            uint16_t n_primitives;  ///< number of primitives, 0 for interior nodes
+            uint8_t axis;           ///< interior: axis the children were split along
+            uint8_t pad;            ///< padding to 32 bytes
+        };
+
+        static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+/**
+ * A node of the wide BVH.
+ * The binary tree is collapsed into nodes of BVH_WIDTH children whose bounds
+ * are stored as structure of arrays, so that all the child boxes of a node
+ * can be tested against a ray in a single SIMD pass. Unused slots have empty
+ * bounds and are never hit.
+ */
+        struct WideBVHNode {
+            float min_x[BVH_WIDTH], min_y[BVH_WIDTH], min_z[BVH_WIDTH]; ///< lower corners of the children
+            float max_x[BVH_WIDTH], max_y[BVH_WIDTH], max_z[BVH_WIDTH]; ///< upper corners of the children
+            uint32_t child[BVH_WIDTH];        ///< interior: node index, leaf: index of the first primitive
+            uint16_t n_primitives[BVH_WIDTH]; ///< number of primitives, 0 for interior children
+        };
+
+/**
+ * A node of the wide BVH with compressed child bounds.
+ * Child bounds are stored as 8 bit offsets from the lower corner of the node,
+ * in steps of a power of two per axis so that decoding origin + q * scale is
+ * exact up to the final rounding. Offsets are rounded outward when encoding,
+ * so the decoded boxes always contain the float bounds of the wide node.
+ * Unused slots decode to inverted boxes, which are never hit.
+ */
+        struct QuantizedBVHNode {
+            float origin[3];  ///< lower corner of the node
+            float scale[3];   ///< size of a quantization step along each axis
+            uint8_t q_min_x[BVH_WIDTH], q_min_y[BVH_WIDTH], q_min_z[BVH_WIDTH]; ///< lower corners of the children
+            uint8_t q_max_x[BVH_WIDTH], q_max_y[BVH_WIDTH], q_max_z[BVH_WIDTH]; ///< upper corners of the children
+            uint32_t child[BVH_WIDTH];        ///< interior: node index, leaf: index of the first primitive
+            uint16_t n_primitives[BVH_WIDTH]; ///< number of primitives, 0 for interior children
+        };
+
+/**
+ * Triangles of the BVH in reference order, as structure of arrays.
+ * Each triangle is stored as its first vertex and either its two edges, for
+ * the filter of the double precision mode, or its other two vertices, for the
+ * watertight test of the float mode, in single precision. Either way the leaf
+ * kernels test BVH_WIDTH consecutive triangles in one SIMD pass. The arrays
+ * are padded with BVH_WIDTH degenerate triangles, which also stand in for
+ * references that are not triangles.
+ */
+        struct TriangleSoA {
+            std::vector<float> v0_x, v0_y, v0_z; ///< first vertices
+            std::vector<float> e1_x, e1_y, e1_z; ///< double mode: edges from the first to the second vertex
+            std::vector<float> e2_x, e2_y, e2_z; ///< double mode: edges from the first to the third vertex
+            std::vector<float> v1_x, v1_y, v1_z; ///< float mode: second vertices
+            std::vector<float> v2_x, v2_y, v2_z; ///< float mode: third vertices
+        };
+
 /**
  * Bounding Volume Hierarchy for fast Ray - Primitive intersection.
  * Note that the BVHAccel is an Aggregate (A Primitive itself) that contains
@@ -49,7 +356,7 @@ namespace CGL {
         class BVHAccel : public Aggregate {
         public:
 
-            BVHAccel() {}
+            BVHAccel();
 
             /**
              * Parameterized Constructor.
@@ -58,8 +365,16 @@ namespace CGL {
              * in memory for the aggregate to function properly.
              * \param primitives primitives to build from
              * \param max_leaf_size maximum number of primitives to be stored in leaves
+             * \param method strategy used to split the nodes
+             * \param layout node layout used for traversal
+             * \param num_threads number of threads used to build the tree, the
+             *        resulting tree does not depend on it
+             * \param split_budget SBVH only, references that spatial splits may add,
+             *        as a fraction of the number of primitives
              */
-            BVHAccel(const std::vector<Primitive *> &primitives, size_t max_leaf_size = 4);
+            BVHAccel(const std::vector<Primitive *> &primitives, size_t max_leaf_size = 4,
+                     BVHBuildMethod method = BVH_BUILD_SAH, BVHLayout layout = BVH_LAYOUT_WIDE,
+                     size_t num_threads = 1, double split_budget = 0.3);
 
             /**
              * Destructor.
@@ -82,12 +397,22 @@ namespace CGL {
              * \return true if the given ray intersects with the aggregate,
                        false otherwise
              */
-            bool has_intersection(const Ray &r) const {
-                ++total_rays;
-                return has_intersection(r, root);
-            }
+            bool has_intersection(const Ray &r) const;
 
-            bool has_intersection(const Ray &r, BVHNode *node) const;
+            /**
+             * Ray - Aggregate occlusion with an occluder cache, for shadow rays.
+             * The reference in *occluder, usually the one that blocked the last
+             * shadow ray toward the same light, is tested before the traversal
+             * starts. If the ray is occluded, *occluder is set to the reference
+             * that blocked it, otherwise the cache is emptied so that lit regions
+             * do not pay for it. As for has_intersection, the traversal stops at
+             * the first hit and computes no hit attributes.
+             * \param r ray to test intersection with
+             * \param occluder cached reference, BVH_NO_OCCLUDER if none
+             * \return true if the given ray intersects with the aggregate,
+                       false otherwise
+             */
+            bool has_intersection(const Ray &r, uint32_t *occluder) const;
 
             /**
              * Ray - Aggregate intersection 2.
@@ -96,18 +421,73 @@ namespace CGL {
              * intersection information for the point of intersection. Note that the
              * intersected primitive entry in the intersection should be updated to
              * the actual primitive in the aggregate that the ray intersected with and
-             * not the aggregate itself.
+             * not the aggregate itself. Only the closest hit is finished with the
+             * normal and BSDF of its primitive.
              * \param r ray to test intersection with
              * \param i address to store intersection info
              * \return true if the given ray intersects with the aggregate,
                        false otherwise
              */
-            bool intersect(const Ray &r, Intersection *i) const {
-                ++total_rays;
-                return intersect(r, i, root);
-            }
+            bool intersect(const Ray &r, Intersection *i) const;
 
-            bool intersect(const Ray &r, Intersection *i, BVHNode *node) const;
+            /**
+             * Ray packet - Aggregate intersection.
+             * Same as intersect for each of the n rays, but coherent rays are traced
+             * BVH_PACKET_SIZE at a time so that they share node fetches and test
+             * each box with SIMD over the rays. Rays whose directions do not share
+             * their signs, and every ray of the binary layout, are traced one by one.
+             * \param rays rays to test intersection with
+             * \param i intersection info of each ray
+             * \param hit set to whether each ray intersects with the aggregate
+             * \param n number of rays
+             */
+            void intersect_packet(const Ray *rays, Intersection *i, bool *hit, size_t n) const;
+
+            /**
+             * Ray packet - Aggregate occlusion, has_intersection for each of the n
+             * rays, traced as in intersect_packet.
+             * \param rays rays to test intersection with
+             * \param hit set to whether each ray intersects with the aggregate
+             * \param n number of rays
+             * \param occluder cache shared by the rays as in has_intersection, or
+             *        NULL. It is emptied only if none of the rays is occluded
+             */
+            void has_intersection_packet(const Ray *rays, bool *hit, size_t n, uint32_t *occluder = NULL) const;
+
+            /**
+             * Select the precision the leaves test triangles in, and repack the
+             * triangles for it. Trees built or loaded start in double precision.
+             * In float mode a shared edge is computed identically for both of
+             * its triangles, so rays never leak between them, and the leaves
+             * read the double precision triangles only to shade the closest hit.
+             */
+            void set_precision(BVHPrecision precision);
+
+            /**
+             * Lay out the traversal nodes of the wide layouts in the given order.
+             * The treelet orders fill blocks of BVH_TREELET_BYTES with the nodes
+             * a ray is most likely to visit next, so that a traversal touches
+             * few blocks. Blocks are grown from their root by repeatedly adding
+             * the most likely child, the others start new blocks, and the most
+             * likely blocks are stored first. The static order estimates the
+             * likelihood of a child by the surface area of its box, the profiled
+             * order by the visits counted since begin_profile, and falls back to
+             * the static order until end_profile is called. The order is kept
+             * through updates, where profiles fall back to the static order.
+             */
+            void set_node_order(BVHNodeOrder order);
+
+            /**
+             * Start counting the visits of every traversal node. Counting is not
+             * thread safe, the warm-up must trace from the calling thread only.
+             */
+            void begin_profile();
+
+            /**
+             * Stop counting visits and, if the node order is profiled, lay out
+             * the nodes by the counts.
+             */
+            void end_profile();
 
             /**
              * Get BSDF of the surface material
@@ -136,13 +516,294 @@ namespace CGL {
 
             void drawOutline(BVHNode *node, const Color &c, float alpha) const;
 
-            mutable unsigned long long total_rays, total_isects;
+            /**
+             * Surface Area Heuristic cost of the whole tree.
+             * The expected cost of tracing a ray through the tree, with the
+             * probability of visiting a node given by the ratio of its surface area
+             * to the one of the root.
+             */
+            double sah_cost() const;
+
+            /**
+             * Update the tree after the primitives it was built from were edited.
+             * If the new list matches the old one primitive by primitive (moved
+             * vertices or flipped edges), the bounds are refitted bottom up.
+             * Otherwise unchanged primitives are matched by their bounds, and the
+             * smallest subtree holding the removed and added ones is rebuilt. The
+             * whole tree is rebuilt if that subtree is too large or the SAH cost
+             * degrades too much compared to the last full build. Trees with
+             * spatial splits are always rebuilt. The bounds of the old primitives
+             * are kept by the tree, which never reads the old primitives, so they
+             * may be deleted before the update.
+             * \param primitives the edited list of primitives
+             * \return how the tree was updated
+             */
+            BVHUpdate update(const std::vector<Primitive *> &primitives);
+
+            /**
+             * Memory used by the traversal nodes of the current layout, in bytes.
+             */
+            size_t node_bytes() const;
+
+            /**
+             * Memory the traversal nodes would use with float bounds, in bytes.
+             * Same as node_bytes unless the layout is compressed.
+             */
+            size_t uncompressed_node_bytes() const;
+
+            /**
+             * Key identifying a BVH over the given primitives built with the given
+             * parameters, used to name and validate cache files. Triangles are
+             * hashed by their vertices, other primitives by their bounds.
+             */
+            static uint64_t cache_key(const std::vector<Primitive *> &primitives, size_t max_leaf_size,
+                                      BVHBuildMethod method, BVHLayout layout, double split_budget);
+
+            /**
+             * Write the tree, the primitive order and the traversal nodes to a
+             * versioned cache file.
+             * \param path file to write
+             * \param key cache key of the primitives and build parameters
+             * \return false if the file could not be written
+             */
+            bool save(const std::string &path, uint64_t key) const;
+
+            /**
+             * Load a BVH saved under the given key, skipping construction. The
+             * file is memory mapped and its nodes are copied out as they are.
+             * \param path file to read
+             * \param key cache key of the primitives and build parameters
+             * \param primitives the primitives the BVH was built from, in the same order
+             * \param num_threads number of threads used by later rebuilds
+             * \return the loaded BVH, or NULL if the file is missing, stale or malformed
+             */
+            static BVHAccel *load(const std::string &path, uint64_t key,
+                                  const std::vector<Primitive *> &primitives, size_t num_threads = 1);
+
+            /**
+             * Tree metrics: SAH cost, node counts and the histograms of the leaf
+             * depths and sizes. The shape is read from the traversal nodes, so it
+             * is also known for loaded trees.
+             */
+            BVHTreeStats tree_stats() const;
+
+            /**
+             * Sum of the traversal counters of every thread since the last reset.
+             * Only meaningful while no thread is tracing.
+             */
+            BVHTraversalStats traversal_stats() const;
+
+            /**
+             * Zero the traversal counters of every thread, while no thread is tracing.
+             */
+            void reset_traversal_stats();
 
         private:
+            /**
+             * Counters of one thread, behind a cache line of padding so that no
+             * two threads ever write to the same line.
+             */
+            struct ThreadStats {
+                char pad[64];
+                BVHTraversalStats stats;
+            };
+
+            /**
+             * Counters of each thread that traced, indexed by the stats slot of the
+             * thread. A slot is only written by the thread holding it, and slots
+             * are handed again to new threads once their thread exits.
+             */
+            mutable std::atomic<ThreadStats *> thread_stats_slots[BVH_STATS_SLOTS] = {};
+
+            /**
+             * Counters of the calling thread, allocated on its first ray.
+             */
+            BVHTraversalStats &thread_stats() const;
+
             std::vector<Primitive *> primitives;
             BVHNode *root; ///< root node of the BVH
-            BVHNode *construct_bvh(std::vector<Primitive *>::iterator start, std::vector<Primitive *>::iterator end,
-                                   size_t max_leaf_size);
+            std::vector<LinearBVHNode> nodes; ///< flattened tree used for traversal
+            std::vector<WideBVHNode> wide_nodes; ///< collapsed wide tree used for traversal
+            std::vector<QuantizedBVHNode> quantized_nodes; ///< compressed wide tree used for traversal
+            TriangleSoA triangles;                      ///< packed triangles tested by the leaves
+            std::vector<const Triangle *> leaf_triangles; ///< triangle of each reference, NULL for other primitives
+            BVHLayout layout;                    ///< which of the trees is traversed
+            BVHPrecision precision;              ///< how the leaves test triangles
+            BVHNodeOrder node_order;             ///< how the wide nodes are laid out
+            mutable std::vector<uint32_t> node_visits; ///< visits of each traversal node while profiling
+            std::thread::id profile_thread;            ///< thread tracing the profile warm-up
+
+            std::vector<size_t> input_index; ///< position of each primitive in the input list
+            std::vector<BBox> reference_bounds; ///< bounds of each reference when last flattened, for updates
+            size_t max_leaf_size;            ///< build parameters, kept for updates
+            BVHBuildMethod method;
+            size_t num_threads;
+            double split_budget;
+            double build_cost;               ///< SAH cost of the tree when it was last built
+
+            /**
+             * Build the whole tree over the given primitives.
+             */
+            void build_tree(const std::vector<Primitive *> &primitives);
+
+            /**
+             * Regenerate the traversal nodes of the current layout from the tree.
+             */
+            void flatten();
+
+            /**
+             * Copy the bounds of the primitives into reference_bounds.
+             */
+            void record_bounds();
+
+            /**
+             * Pack the triangles among the primitives for the leaf kernel.
+             */
+            void pack_triangles();
+
+            /**
+             * Intersect the references [offset, offset + n) of a leaf. Triangles
+             * are filtered in single precision by the SIMD kernel, and only the
+             * candidates it keeps are tested exactly, without virtual dispatch.
+             * Other primitives go through their virtual intersection routines.
+             * On a hit, has_intersection_leaf stores the reference in *occluder
+             * unless it is NULL. In float precision the triangles are tested by
+             * the watertight kernel instead.
+             */
+            bool has_intersection_leaf(const Ray &r, uint32_t offset, uint32_t n, uint32_t *occluder) const;
+
+            bool intersect_leaf(const Ray &r, uint32_t offset, uint32_t n, Intersection *i) const;
+
+            bool has_intersection_leaf_watertight(const Ray &r, uint32_t offset, uint32_t n,
+                                                  uint32_t *occluder) const;
+
+            bool intersect_leaf_watertight(const Ray &r, uint32_t offset, uint32_t n, Intersection *i) const;
+
+            /**
+             * Recompute the bounds of node's subtree from its primitives.
+             */
+            void refit(BVHNode *node);
+
+            /**
+             * Rebuild the subtree of the given node over the surviving primitives of
+             * its range and the added ones. path holds the ancestors of node from
+             * the root down.
+             */
+            void rebuild_subtree(BVHNode *node, const std::vector<BVHNode *> &path,
+                                 const std::vector<bool> &dead, const std::vector<Primitive *> &added,
+                                 const std::vector<size_t> &added_index);
+
+            BVHNode *construct_bvh(std::vector<BVHBuildPrimitive> &build, size_t start, size_t end,
+                                   size_t max_leaf_size, BVHBuildMethod method, size_t num_threads);
+
+            /**
+             * Find the binned SAH split of build[start, end).
+             * Returns false if the node is cheaper as a leaf, otherwise partitions
+             * the range and stores the first index of the right child in mid.
+             */
+            bool split_sah(std::vector<BVHBuildPrimitive> &build, size_t start, size_t end,
+                           const BBox &bbox, const BBox &centroid_bounds,
+                           size_t max_leaf_size, size_t num_threads, size_t &mid);
+
+            double sah_cost(BVHNode *node) const;
+
+            /**
+             * Build a linear BVH: sort the primitives along a Morton curve and
+             * split the sorted range at the bits where the codes differ. With
+             * treelets, the top bits only cluster the primitives and the levels
+             * above the clusters are built with the SAH instead.
+             */
+            BVHNode *construct_lbvh(std::vector<BVHBuildPrimitive> &build, size_t max_leaf_size,
+                                    bool treelets, size_t num_threads);
+
+            BVHNode *emit_lbvh(std::vector<BVHBuildPrimitive> &build, const std::vector<uint64_t> &codes,
+                               size_t start, size_t end, int bit, size_t max_leaf_size);
+
+            /**
+             * Build a spatial split BVH. Nodes choose between the binned SAH
+             * object split and a binned spatial split that clips the primitives
+             * straddling the plane to both sides, as long as the split budget
+             * allows more references. On return build holds the references in
+             * leaf order, duplicates included.
+             */
+            BVHNode *construct_sbvh(std::vector<BVHBuildPrimitive> &build, size_t max_leaf_size,
+                                    double split_budget);
+
+            BVHNode *emit_sbvh(std::vector<BVHBuildPrimitive> &refs, std::vector<BVHBuildPrimitive> &ordered,
+                               size_t &spare, double root_area, int depth, size_t max_leaf_size);
+
+            /**
+             * Append the build entries of node's leaves to ordered in depth first
+             * order and update the ranges of the subtree to point at the new order.
+             */
+            void gather_subtree(BVHNode *node, const std::vector<BVHBuildPrimitive> &build,
+                                std::vector<BVHBuildPrimitive> &ordered);
+
+            /**
+             * Append node and its subtree to nodes in depth first order.
+             * Returns the index of node in the flattened array.
+             */
+            uint32_t flatten_bvh(BVHNode *node);
+
+            /**
+             * Collapse node and its subtree into wide nodes appended to wide_nodes.
+             * Returns the index of the wide node created for node.
+             */
+            uint32_t collapse_wide(BVHNode *node);
+
+            /**
+             * Encode wide_nodes into quantized_nodes, node by node.
+             */
+            void quantize_wide();
+
+            /**
+             * Lay out the traversal nodes of the wide layouts as node_order says,
+             * by the visit counts if given, by the child surface areas otherwise.
+             */
+            void reorder_nodes(const std::vector<uint32_t> *visits);
+
+            /**
+             * Any hit traversal of the binary layout.
+             */
+            bool has_intersection_binary(const Ray &r, uint32_t *occluder) const;
+
+            bool has_intersection_wide(const Ray &r, uint32_t *occluder) const;
+
+            /**
+             * Closest hit traversals, intersect finishes the hit they record.
+             */
+            bool intersect_binary(const Ray &r, Intersection *i) const;
+
+            bool intersect_wide(const Ray &r, Intersection *i) const;
+
+            /**
+             * Whether a warm-up is counting node visits. Only the thread that
+             * began the profile may trace meanwhile, which is asserted.
+             */
+            bool profiling() const;
+
+            /**
+             * Traversals shared by the wide and the compressed wide nodes. The
+             * Profile instances also count node visits, so that the traversals
+             * of the render do not test for it at every node.
+             */
+            template<bool Profile, typename Node>
+            bool has_intersection_wide(const std::vector<Node> &tree, const Ray &r, uint32_t *occluder) const;
+
+            template<bool Profile, typename Node>
+            bool intersect_wide(const std::vector<Node> &tree, const Ray &r, Intersection *i) const;
+
+            /**
+             * Packet traversals of the wide layouts, for at most BVH_PACKET_SIZE
+             * rays whose directions share their signs.
+             */
+            template<bool Profile, typename Node>
+            void has_intersection_packet(const std::vector<Node> &tree, const Ray *rays, bool *hit, int n,
+                                         uint32_t *occluder) const;
+
+            template<bool Profile, typename Node>
+            void intersect_packet(const std::vector<Node> &tree, const Ray *rays, Intersection *i,
+                                  bool *hit, int n) const;
         };
 
     } // namespace SceneObjects
@@ -0,0 +1,366 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+#include "triangle.h"
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define BVH_CACHE_VERSION 1 ///< bump whenever the layout of the nodes or of the file changes
+
+using namespace std;
+
+namespace CGL {
+    namespace SceneObjects {
+
+        /**
+         * Header of a cache file, followed by the input index of every
+         * reference, the tree in depth first order and the traversal nodes.
+         */
+        struct BVHCacheHeader {
+            char magic[4];
+            uint32_t version;
+            uint64_t key;
+            uint32_t width;
+            uint32_t layout;
+            uint32_t method;
+            uint32_t max_leaf_size;
+            double split_budget;
+            double build_cost;
+            uint64_t n_primitives;
+            uint64_t n_references;
+            uint64_t n_tree;
+            uint64_t n_linear;
+            uint64_t n_wide;
+            uint64_t n_quantized;
+        };
+
+        /**
+         * A node of the tree as stored in the cache, its left child follows it.
+         */
+        struct BVHCacheNode {
+            double min[3], max[3];
+            uint64_t start, end;  ///< range of the node in the reference order
+            uint64_t leaf;
+        };
+
+        /**
+         * 64 bit FNV-1a over raw bytes.
+         */
+        static inline void hash_bytes(uint64_t &h, const void *data, size_t size) {
+            const unsigned char *bytes = (const unsigned char *) data;
+            for (size_t i = 0; i < size; i++) {
+                h ^= bytes[i];
+                h *= 0x100000001b3ull;
+            }
+        }
+
+        template<typename T>
+        static inline void hash_value(uint64_t &h, const T &v) {
+            hash_bytes(h, &v, sizeof(T));
+        }
+
+        uint64_t BVHAccel::cache_key(const vector<Primitive *> &primitives, size_t max_leaf_size,
+                                     BVHBuildMethod method, BVHLayout layout, double split_budget) {
+            uint64_t h = 0xcbf29ce484222325ull;
+            hash_value(h, (uint32_t) BVH_CACHE_VERSION);
+            hash_value(h, (uint32_t) BVH_WIDTH);
+            hash_value(h, (uint64_t) max_leaf_size);
+            hash_value(h, (uint32_t) method);
+            hash_value(h, (uint32_t) layout);
+            if (method == BVH_BUILD_SBVH)
+                hash_value(h, split_budget);
+
+            hash_value(h, (uint64_t) primitives.size());
+            for (Primitive *p: primitives) {
+                // spatial splits clip the triangles themselves, the other
+                // builders only look at the bounds
+                const Triangle *tri = dynamic_cast<const Triangle *>(p);
+                if (tri) {
+                    for (const Vector3D *v: {&tri->p1, &tri->p2, &tri->p3})
+                        hash_bytes(h, &(*v)[0], 3 * sizeof(double));
+                    continue;
+                }
+                BBox bb = p->get_bbox();
+                hash_bytes(h, &bb.min[0], 3 * sizeof(double));
+                hash_bytes(h, &bb.max[0], 3 * sizeof(double));
+            }
+            return h;
+        }
+
+        static void write_tree(BVHNode *node, vector<Primitive *>::const_iterator begin,
+                               vector<BVHCacheNode> &tree) {
+            BVHCacheNode cached;
+            for (int a = 0; a < 3; a++) {
+                cached.min[a] = node->bb.min[a];
+                cached.max[a] = node->bb.max[a];
+            }
+            cached.start = node->start - begin;
+            cached.end = node->end - begin;
+            cached.leaf = node->isLeaf();
+            tree.push_back(cached);
+            if (node->isLeaf()) return;
+            write_tree(node->l, begin, tree);
+            write_tree(node->r, begin, tree);
+        }
+
+        /**
+         * Rebuild the tree from its depth first order, returns NULL if the
+         * stored tree is malformed.
+         */
+        static BVHNode *read_tree(const BVHCacheNode *tree, size_t n_tree, size_t &next,
+                                  vector<Primitive *> &primitives) {
+            if (next >= n_tree) return NULL;
+            const BVHCacheNode &cached = tree[next++];
+            if (cached.start > cached.end || cached.end > primitives.size()) return NULL;
+
+            BVHNode *node = new BVHNode(BBox(Vector3D(cached.min[0], cached.min[1], cached.min[2]),
+                                             Vector3D(cached.max[0], cached.max[1], cached.max[2])));
+            node->start = primitives.begin() + cached.start;
+            node->end = primitives.begin() + cached.end;
+            if (cached.leaf) return node;
+
+            node->l = read_tree(tree, n_tree, next, primitives);
+            node->r = node->l ? read_tree(tree, n_tree, next, primitives) : NULL;
+            if (!node->r) {
+                delete node;
+                return NULL;
+            }
+            return node;
+        }
+
+        /**
+         * Whether the binary traversal nodes only refer to nodes and references
+         * that exist. Children follow their parent in depth first order, which
+         * also rules out cycles.
+         */
+        static bool valid_nodes(const vector<LinearBVHNode> &nodes, size_t n_references) {
+            for (size_t i = 0; i < nodes.size(); i++) {
+                const LinearBVHNode &node = nodes[i];
+                if (node.n_primitives > 0) {
+                    if ((uint64_t) node.primitives_offset + node.n_primitives > n_references) return false;
+                }
+                else if (node.second_child_offset <= i + 1 || node.second_child_offset >= nodes.size())
+                    return false;
+            }
+            return true;
+        }
+
+        // unused slots of the wide nodes are only safe to skip with inverted bounds
+        static inline bool inverted_slot(const WideBVHNode &node, int c) {
+            return !(node.min_x[c] <= node.max_x[c]);
+        }
+
+        static inline bool inverted_slot(const QuantizedBVHNode &node, int c) {
+            return node.q_min_x[c] > node.q_max_x[c];
+        }
+
+        /**
+         * Same as above for the wide layouts, whose interior children are also
+         * stored after their parent.
+         */
+        template<typename Node>
+        static bool valid_nodes(const vector<Node> &nodes, size_t n_references) {
+            for (size_t i = 0; i < nodes.size(); i++) {
+                const Node &node = nodes[i];
+                for (int c = 0; c < BVH_WIDTH; c++) {
+                    if (node.child[c] == UINT32_MAX) {
+                        if (node.n_primitives[c] > 0 || !inverted_slot(node, c)) return false;
+                    }
+                    else if (node.n_primitives[c] > 0) {
+                        if ((uint64_t) node.child[c] + node.n_primitives[c] > n_references) return false;
+                    }
+                    else if (node.child[c] <= i || node.child[c] >= nodes.size())
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        bool BVHAccel::save(const string &path, uint64_t key) const {
+            if (!root) return false;
+
+            vector<BVHCacheNode> tree;
+            write_tree(root, primitives.cbegin(), tree);
+
+            size_t n_primitives = 0;
+            for (size_t index: input_index)
+                n_primitives = std::max(n_primitives, index + 1);
+
+            BVHCacheHeader header;
+            memcpy(header.magic, "BVHC", 4);
+            header.version = BVH_CACHE_VERSION;
+            header.key = key;
+            header.width = BVH_WIDTH;
+            header.layout = layout;
+            header.method = method;
+            header.max_leaf_size = max_leaf_size;
+            header.split_budget = split_budget;
+            header.build_cost = build_cost;
+            header.n_primitives = n_primitives;
+            header.n_references = primitives.size();
+            header.n_tree = tree.size();
+            header.n_linear = nodes.size();
+            header.n_wide = wide_nodes.size();
+            header.n_quantized = quantized_nodes.size();
+
+            vector<uint64_t> index(input_index.begin(), input_index.end());
+
+            // write to a temporary file first so that readers never see a partial cache
+            string tmp = path + ".tmp";
+            FILE *file = fopen(tmp.c_str(), "wb");
+            if (!file) return false;
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                      fwrite(index.data(), sizeof(uint64_t), index.size(), file) == index.size() &&
+                      fwrite(tree.data(), sizeof(BVHCacheNode), tree.size(), file) == tree.size() &&
+                      fwrite(nodes.data(), sizeof(LinearBVHNode), nodes.size(), file) == nodes.size() &&
+                      fwrite(wide_nodes.data(), sizeof(WideBVHNode), wide_nodes.size(), file) == wide_nodes.size() &&
+                      fwrite(quantized_nodes.data(), sizeof(QuantizedBVHNode), quantized_nodes.size(), file) ==
+                      quantized_nodes.size();
+            ok = fclose(file) == 0 && ok;
+            if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+                remove(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Read-only view of a whole file, memory mapped where available.
+         */
+        class MappedFile {
+        public:
+            MappedFile(const string &path) : data(NULL), size(0) {
+#ifdef _WIN32
+                ifstream in(path, ios::binary | ios::ate);
+                if (!in) return;
+                buffer.resize(in.tellg());
+                in.seekg(0);
+                if (!in.read(buffer.data(), buffer.size())) return;
+                data = buffer.data();
+                size = buffer.size();
+#else
+                int fd = open(path.c_str(), O_RDONLY);
+                if (fd < 0) return;
+                struct stat st;
+                if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                    void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (mapped != MAP_FAILED) {
+                        data = (const char *) mapped;
+                        size = st.st_size;
+                    }
+                }
+                close(fd);
+#endif
+            }
+
+            ~MappedFile() {
+#ifndef _WIN32
+                if (data) munmap((void *) data, size);
+#endif
+            }
+
+            const char *data;
+            size_t size;
+
+        private:
+#ifdef _WIN32
+            vector<char> buffer;
+#endif
+        };
+
+        BVHAccel *BVHAccel::load(const string &path, uint64_t key, const vector<Primitive *> &_primitives,
+                                 size_t num_threads) {
+            MappedFile file(path);
+            if (!file.data || file.size < sizeof(BVHCacheHeader)) return NULL;
+
+            BVHCacheHeader header;
+            memcpy(&header, file.data, sizeof(header));
+            if (memcmp(header.magic, "BVHC", 4) != 0 || header.version != BVH_CACHE_VERSION ||
+                header.key != key || header.width != BVH_WIDTH || header.n_primitives != _primitives.size() ||
+                header.layout > BVH_LAYOUT_COMPRESSED || header.method > BVH_BUILD_SBVH)
+                return NULL;
+
+            // each count fits in the file on its own, so the sum below cannot wrap
+            // around to the size of a damaged file
+            if (header.n_references > file.size / sizeof(uint64_t) ||
+                header.n_tree > file.size / sizeof(BVHCacheNode) ||
+                header.n_linear > file.size / sizeof(LinearBVHNode) ||
+                header.n_wide > file.size / sizeof(WideBVHNode) ||
+                header.n_quantized > file.size / sizeof(QuantizedBVHNode))
+                return NULL;
+
+            size_t expected = sizeof(header) + header.n_references * sizeof(uint64_t) +
+                              header.n_tree * sizeof(BVHCacheNode) + header.n_linear * sizeof(LinearBVHNode) +
+                              header.n_wide * sizeof(WideBVHNode) + header.n_quantized * sizeof(QuantizedBVHNode);
+            if (file.size != expected) return NULL;
+
+            BVHAccel *bvh = new BVHAccel();
+            bvh->root = NULL;
+            bvh->layout = (BVHLayout) header.layout;
+            bvh->method = (BVHBuildMethod) header.method;
+            bvh->max_leaf_size = header.max_leaf_size;
+            bvh->split_budget = header.split_budget;
+            bvh->build_cost = header.build_cost;
+            bvh->num_threads = std::max(num_threads, (size_t) 1);
+
+            const char *cursor = file.data + sizeof(header);
+            const uint64_t *index = (const uint64_t *) cursor;
+            cursor += header.n_references * sizeof(uint64_t);
+
+            bvh->primitives.resize(header.n_references);
+            bvh->input_index.resize(header.n_references);
+            for (size_t i = 0; i < header.n_references; i++) {
+                uint64_t input;
+                memcpy(&input, index + i, sizeof(input));
+                if (input >= _primitives.size()) {
+                    delete bvh;
+                    return NULL;
+                }
+                bvh->primitives[i] = _primitives[input];
+                bvh->input_index[i] = input;
+            }
+
+            vector<BVHCacheNode> tree(header.n_tree);
+            memcpy(tree.data(), cursor, header.n_tree * sizeof(BVHCacheNode));
+            cursor += header.n_tree * sizeof(BVHCacheNode);
+            size_t next = 0;
+            bvh->root = read_tree(tree.data(), tree.size(), next, bvh->primitives);
+            if (!bvh->root || next != tree.size()) {
+                delete bvh;
+                return NULL;
+            }
+
+            bvh->nodes.resize(header.n_linear);
+            memcpy(bvh->nodes.data(), cursor, header.n_linear * sizeof(LinearBVHNode));
+            cursor += header.n_linear * sizeof(LinearBVHNode);
+            bvh->wide_nodes.resize(header.n_wide);
+            memcpy(bvh->wide_nodes.data(), cursor, header.n_wide * sizeof(WideBVHNode));
+            cursor += header.n_wide * sizeof(WideBVHNode);
+            bvh->quantized_nodes.resize(header.n_quantized);
+            memcpy(bvh->quantized_nodes.data(), cursor, header.n_quantized * sizeof(QuantizedBVHNode));
+
+            // a damaged file must not send the traversal out of the arrays, it is
+            // rejected and the tree built again
+            if (!valid_nodes(bvh->nodes, header.n_references) || !valid_nodes(bvh->wide_nodes, header.n_references) ||
+                !valid_nodes(bvh->quantized_nodes, header.n_references)) {
+                delete bvh;
+                return NULL;
+            }
+
+            bvh->pack_triangles();
+            bvh->record_bounds();
+            return bvh;
+        }
+
+    } // namespace SceneObjects
+} // namespace CGL
@@ -0,0 +1,254 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+
+#include <algorithm>
+
+#define LBVH_MORTON30_LIMIT (1 << 20) ///< largest scene that uses 30-bit Morton codes
+#define LBVH_RADIX_BITS 8             ///< bits sorted per radix sort pass
+#define LBVH_TREELET_BITS 12          ///< top Morton bits that define the HLBVH treelets
+
+using namespace std;
+
+namespace CGL {
+    namespace SceneObjects {
+
+        /**
+         * Spread the low bits of v so that two zero bits separate each of them.
+         * \param v value to spread
+         * \param bits number of bits of v to keep, at most 21
+         */
+        static inline uint64_t spread_bits(uint64_t v, int bits) {
+            v &= (1ull << bits) - 1;
+            v = (v | (v << 32)) & 0x1f00000000ffffull;
+            v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+            v = (v | (v << 8)) & 0x100f00f00f00f00full;
+            v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+            v = (v | (v << 2)) & 0x1249249249249249ull;
+            return v;
+        }
+
+        /**
+         * Stable LSD radix sort of the codes, permuting the build entries along.
+         */
+        static void radix_sort(vector<uint64_t> &codes, vector<BVHBuildPrimitive> &build, int bits) {
+            size_t n = codes.size();
+            vector<uint64_t> codes_tmp(n);
+            vector<BVHBuildPrimitive> build_tmp(n);
+
+            const int buckets = 1 << LBVH_RADIX_BITS;
+            for (int shift = 0; shift < bits; shift += LBVH_RADIX_BITS) {
+                size_t offsets[buckets] = {0};
+                for (size_t i = 0; i < n; i++)
+                    offsets[(codes[i] >> shift) & (buckets - 1)]++;
+
+                size_t sum = 0;
+                for (int b = 0; b < buckets; b++) {
+                    size_t count = offsets[b];
+                    offsets[b] = sum;
+                    sum += count;
+                }
+
+                for (size_t i = 0; i < n; i++) {
+                    size_t dst = offsets[(codes[i] >> shift) & (buckets - 1)]++;
+                    codes_tmp[dst] = codes[i];
+                    build_tmp[dst] = build[i];
+                }
+                codes.swap(codes_tmp);
+                build.swap(build_tmp);
+            }
+        }
+
+        /**
+         * Join the roots[start, end) with binned SAH splits along the axis their
+         * centroids spread the most.
+         */
+        static BVHNode *build_upper_sah(vector<BVHNode *> &roots, size_t start, size_t end) {
+            size_t n = end - start;
+            if (n == 1) return roots[start];
+
+            BBox bbox, centroid_bounds;
+            for (size_t i = start; i < end; i++) {
+                bbox.expand(roots[i]->bb);
+                centroid_bounds.expand(roots[i]->bb.centroid());
+            }
+
+            Vector3D diag = centroid_bounds.extent;
+            int axis = 0;
+            if (diag.y > diag[axis]) axis = 1;
+            if (diag.z > diag[axis]) axis = 2;
+
+            size_t mid = start + n / 2;
+            if (diag[axis] > 0) {
+                double cmin = centroid_bounds.min[axis];
+                double scale = SAH_BIN_COUNT / diag[axis];
+                auto bin_of = [=](BVHNode *node) {
+                    int b = (int) ((node->bb.centroid()[axis] - cmin) * scale);
+                    return std::min(b, SAH_BIN_COUNT - 1);
+                };
+
+                BBox bin_bounds[SAH_BIN_COUNT];
+                size_t bin_count[SAH_BIN_COUNT] = {0};
+                for (size_t i = start; i < end; i++) {
+                    int b = bin_of(roots[i]);
+                    bin_count[b]++;
+                    bin_bounds[b].expand(roots[i]->bb);
+                }
+
+                double best_cost = INF_D;
+                int best_split = 1;
+                for (int split = 1; split < SAH_BIN_COUNT; split++) {
+                    BBox l, r;
+                    size_t nl = 0, nr = 0;
+                    for (int b = 0; b < split; b++) {
+                        l.expand(bin_bounds[b]);
+                        nl += bin_count[b];
+                    }
+                    for (int b = split; b < SAH_BIN_COUNT; b++) {
+                        r.expand(bin_bounds[b]);
+                        nr += bin_count[b];
+                    }
+                    if (nl == 0 || nr == 0) continue;
+                    double cost = nl * l.surface_area() + nr * r.surface_area();
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_split = split;
+                    }
+                }
+
+                auto it = partition(roots.begin() + start, roots.begin() + end,
+                                    [&](BVHNode *node) { return bin_of(node) < best_split; });
+                mid = it - roots.begin();
+            }
+
+            BVHNode *node = new BVHNode(bbox);
+            node->l = build_upper_sah(roots, start, mid);
+            node->r = build_upper_sah(roots, mid, end);
+            return node;
+        }
+
+        BVHNode *BVHAccel::emit_lbvh(vector<BVHBuildPrimitive> &build, const vector<uint64_t> &codes,
+                                     size_t start, size_t end, int bit, size_t max_leaf_size) {
+            size_t n = end - start;
+            size_t mid;
+
+            if (n <= max_leaf_size) {
+                BBox bbox;
+                for (size_t i = start; i < end; i++)
+                    bbox.expand(build[i].bb);
+                BVHNode *node = new BVHNode(bbox);
+                node->start = primitives.begin() + start;
+                node->end = primitives.begin() + end;
+                return node;
+            }
+
+            if (bit < 0) {
+                // primitives share a Morton cell, split them evenly
+                mid = start + n / 2;
+            }
+            else {
+                uint64_t mask = 1ull << bit;
+                if ((codes[start] & mask) == (codes[end - 1] & mask))
+                    return emit_lbvh(build, codes, start, end, bit - 1, max_leaf_size);
+
+                // the range is sorted, so find the first code with the bit set
+                mid = partition_point(codes.begin() + start, codes.begin() + end,
+                                      [mask](uint64_t code) { return !(code & mask); }) - codes.begin();
+            }
+
+            BVHNode *l = emit_lbvh(build, codes, start, mid, bit - 1, max_leaf_size);
+            BVHNode *r = emit_lbvh(build, codes, mid, end, bit - 1, max_leaf_size);
+
+            BBox bbox = l->bb;
+            bbox.expand(r->bb);
+            BVHNode *node = new BVHNode(bbox);
+            node->l = l;
+            node->r = r;
+            node->start = primitives.begin() + start;
+            node->end = primitives.begin() + end;
+            return node;
+        }
+
+        BVHNode *BVHAccel::construct_lbvh(vector<BVHBuildPrimitive> &build, size_t max_leaf_size,
+                                          bool treelets, size_t num_threads) {
+            size_t n = build.size();
+            if (n == 0) {
+                BVHNode *node = new BVHNode(BBox());
+                node->start = node->end = primitives.begin();
+                return node;
+            }
+
+            vector<BBox> chunk_centroids(num_threads);
+            parallel_chunks(0, n, num_threads, [&](size_t chunk, size_t s, size_t e) {
+                for (size_t i = s; i < e; i++)
+                    chunk_centroids[chunk].expand(build[i].centroid);
+            });
+            BBox centroid_bounds;
+            for (auto &bb: chunk_centroids)
+                centroid_bounds.expand(bb);
+
+            // quantize the centroids to a grid of 2^axis_bits cells per axis
+            int axis_bits = n > LBVH_MORTON30_LIMIT ? 21 : 10;
+            int total_bits = 3 * axis_bits;
+            double cells = (double) (1ull << axis_bits);
+
+            vector<uint64_t> codes(n);
+            parallel_chunks(0, n, num_threads, [&](size_t, size_t s, size_t e) {
+                for (size_t i = s; i < e; i++) {
+                    uint64_t code = 0;
+                    for (int a = 0; a < 3; a++) {
+                        double ext = centroid_bounds.extent[a];
+                        double q = ext > 0 ? (build[i].centroid[a] - centroid_bounds.min[a]) / ext * cells : 0;
+                        uint64_t cell = std::min<uint64_t>((uint64_t) std::max(q, 0.0), (1ull << axis_bits) - 1);
+                        code |= spread_bits(cell, axis_bits) << (2 - a);
+                    }
+                    codes[i] = code;
+                }
+            });
+
+            radix_sort(codes, build, total_bits);
+
+            if (!treelets)
+                return emit_lbvh(build, codes, 0, n, total_bits - 1, max_leaf_size);
+
+            // emit one treelet per run of equal top bits, then join the treelets
+            int shift = total_bits - LBVH_TREELET_BITS;
+            vector<BVHNode *> roots;
+            for (size_t start = 0; start < n;) {
+                size_t end = start + 1;
+                while (end < n && (codes[end] >> shift) == (codes[start] >> shift))
+                    end++;
+                roots.push_back(emit_lbvh(build, codes, start, end, shift - 1, max_leaf_size));
+                start = end;
+            }
+
+            BVHNode *root = build_upper_sah(roots, 0, roots.size());
+
+            // the SAH reorders the treelets, gather the primitives again so that
+            // every subtree covers a contiguous range
+            vector<BVHBuildPrimitive> ordered;
+            ordered.reserve(n);
+            gather_subtree(root, build, ordered);
+            build.swap(ordered);
+            return root;
+        }
+
+        void BVHAccel::gather_subtree(BVHNode *node, const vector<BVHBuildPrimitive> &build,
+                                      vector<BVHBuildPrimitive> &ordered) {
+            if (node->isLeaf()) {
+                size_t start = node->start - primitives.cbegin();
+                size_t end = node->end - primitives.cbegin();
+                node->start = primitives.begin() + ordered.size();
+                ordered.insert(ordered.end(), build.begin() + start, build.begin() + end);
+                node->end = primitives.begin() + ordered.size();
+                return;
+            }
+
+            gather_subtree(node->l, build, ordered);
+            gather_subtree(node->r, build, ordered);
+            node->start = node->l->start;
+            node->end = node->r->end;
+        }
+
+    } // namespace SceneObjects
+} // namespace CGL
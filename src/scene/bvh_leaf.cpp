@@ -0,0 +1,569 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+#include "triangle.h"
+
+#include <cmath>
+#include <cfloat>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define LEAF_FILTER_ULPS 64.0f      ///< rounding error, in units of FLT_EPSILON, the filter allows on every term
+#define LEAF_FILTER_CONDITION 1e-6f ///< squared sine between ray and triangle under which the filter keeps the lane
+
+using namespace std;
+
+namespace CGL {
+    namespace SceneObjects {
+
+        /**
+         * Single precision copy of a ray, shared by the lanes of the filter.
+         */
+        struct LeafRay {
+            float o[3];
+            float d[3];
+            float o_max;  ///< largest coordinate of the origin, in magnitude
+            float d_len;  ///< length of the direction
+
+            LeafRay(const Ray &r) {
+                for (int a = 0; a < 3; a++) {
+                    o[a] = r.o[a];
+                    d[a] = r.d[a];
+                }
+                o_max = std::max(fabsf(o[0]), std::max(fabsf(o[1]), fabsf(o[2])));
+                d_len = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+            }
+        };
+
+        /**
+         * Moller-Trumbore test of the BVH_WIDTH packed triangles starting at base.
+         * Returns a bit mask of the lanes that may be hit within [tmin, tmax].
+         * The test keeps every lane whose triangle is nearly parallel to the ray
+         * and is relaxed by a bound on its rounding errors, so that it never
+         * drops a hit the exact test would find. The inputs are off by a few
+         * ulps of the largest coordinate among the origin, the first vertex and
+         * the hit point, which moves the barycentrics and the distance by that
+         * much over the size of the triangle. The arithmetic adds errors that
+         * grow with the conditioning |s1| |e1| / |det| of the lane. Both are
+         * allowed LEAF_FILTER_ULPS each. Degenerate lanes, including the
+         * padding, produce NaNs or infinities and fail the ordered comparisons.
+         */
+        static inline int filter_triangles(const TriangleSoA &tris, size_t base, const LeafRay &ray,
+                                           float tmin, float tmax) {
+#if defined(__AVX__)
+            __m256 v0x = _mm256_loadu_ps(&tris.v0_x[base]), v0y = _mm256_loadu_ps(&tris.v0_y[base]),
+                   v0z = _mm256_loadu_ps(&tris.v0_z[base]);
+            __m256 e1x = _mm256_loadu_ps(&tris.e1_x[base]), e1y = _mm256_loadu_ps(&tris.e1_y[base]),
+                   e1z = _mm256_loadu_ps(&tris.e1_z[base]);
+            __m256 e2x = _mm256_loadu_ps(&tris.e2_x[base]), e2y = _mm256_loadu_ps(&tris.e2_y[base]),
+                   e2z = _mm256_loadu_ps(&tris.e2_z[base]);
+            __m256 dx = _mm256_set1_ps(ray.d[0]), dy = _mm256_set1_ps(ray.d[1]), dz = _mm256_set1_ps(ray.d[2]);
+
+            __m256 sx = _mm256_sub_ps(_mm256_set1_ps(ray.o[0]), v0x);
+            __m256 sy = _mm256_sub_ps(_mm256_set1_ps(ray.o[1]), v0y);
+            __m256 sz = _mm256_sub_ps(_mm256_set1_ps(ray.o[2]), v0z);
+
+            __m256 s1x = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+            __m256 s1y = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+            __m256 s1z = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+            __m256 s2x = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+            __m256 s2y = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+            __m256 s2z = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+
+#define DOT8(ax, ay, az, bx, by, bz) \
+            _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, bx), _mm256_mul_ps(ay, by)), _mm256_mul_ps(az, bz))
+            __m256 det = DOT8(s1x, s1y, s1z, e1x, e1y, e1z);
+            __m256 s1_len2 = DOT8(s1x, s1y, s1z, s1x, s1y, s1z);
+            __m256 e1_len2 = DOT8(e1x, e1y, e1z, e1x, e1y, e1z);
+            __m256 e2_len2 = DOT8(e2x, e2y, e2z, e2x, e2y, e2z);
+            __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+            __m256 t = _mm256_mul_ps(DOT8(s2x, s2y, s2z, e2x, e2y, e2z), inv_det);
+            __m256 b1 = _mm256_mul_ps(DOT8(s1x, s1y, s1z, sx, sy, sz), inv_det);
+            __m256 b2 = _mm256_mul_ps(DOT8(s2x, s2y, s2z, dx, dy, dz), inv_det);
+#undef DOT8
+
+            __m256 sign = _mm256_set1_ps(-0.0f);
+            __m256 abs_t = _mm256_andnot_ps(sign, t);
+            __m256 v0_max = _mm256_max_ps(_mm256_andnot_ps(sign, v0x),
+                                          _mm256_max_ps(_mm256_andnot_ps(sign, v0y), _mm256_andnot_ps(sign, v0z)));
+            __m256 scale = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(ray.o_max), v0_max),
+                                         _mm256_mul_ps(abs_t, _mm256_set1_ps(ray.d_len)));
+            __m256 s1_len = _mm256_sqrt_ps(s1_len2), e1_len = _mm256_sqrt_ps(e1_len2), e2_len = _mm256_sqrt_ps(e2_len2);
+            __m256 cond = _mm256_mul_ps(s1_len, e1_len);
+            __m256 error = _mm256_mul_ps(_mm256_set1_ps(LEAF_FILTER_ULPS * FLT_EPSILON), _mm256_andnot_ps(sign, inv_det));
+            __m256 slack = _mm256_mul_ps(error, _mm256_add_ps(cond, _mm256_mul_ps(scale, _mm256_add_ps(
+                    s1_len, _mm256_mul_ps(e1_len, _mm256_set1_ps(ray.d_len))))));
+            __m256 t_slack = _mm256_mul_ps(error, _mm256_add_ps(_mm256_mul_ps(cond, abs_t),
+                                                                _mm256_mul_ps(scale, _mm256_mul_ps(e1_len, e2_len))));
+
+            __m256 hit = _mm256_cmp_ps(b1, _mm256_sub_ps(_mm256_setzero_ps(), slack), _CMP_GE_OQ);
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(b2, _mm256_sub_ps(_mm256_setzero_ps(), slack), _CMP_GE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(b1, b2),
+                                                   _mm256_add_ps(_mm256_set1_ps(1.0f), slack), _CMP_LE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(t, t_slack), _mm256_set1_ps(tmin), _CMP_GE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_sub_ps(t, t_slack), _mm256_set1_ps(tmax), _CMP_LE_OQ));
+
+            __m256 grazing = _mm256_cmp_ps(_mm256_mul_ps(det, det),
+                                           _mm256_mul_ps(_mm256_set1_ps(LEAF_FILTER_CONDITION),
+                                                         _mm256_mul_ps(s1_len2, e1_len2)), _CMP_LT_OQ);
+            return _mm256_movemask_ps(_mm256_or_ps(hit, grazing));
+#elif defined(__SSE2__)
+            __m128 v0x = _mm_loadu_ps(&tris.v0_x[base]), v0y = _mm_loadu_ps(&tris.v0_y[base]),
+                   v0z = _mm_loadu_ps(&tris.v0_z[base]);
+            __m128 e1x = _mm_loadu_ps(&tris.e1_x[base]), e1y = _mm_loadu_ps(&tris.e1_y[base]),
+                   e1z = _mm_loadu_ps(&tris.e1_z[base]);
+            __m128 e2x = _mm_loadu_ps(&tris.e2_x[base]), e2y = _mm_loadu_ps(&tris.e2_y[base]),
+                   e2z = _mm_loadu_ps(&tris.e2_z[base]);
+            __m128 dx = _mm_set1_ps(ray.d[0]), dy = _mm_set1_ps(ray.d[1]), dz = _mm_set1_ps(ray.d[2]);
+
+            __m128 sx = _mm_sub_ps(_mm_set1_ps(ray.o[0]), v0x);
+            __m128 sy = _mm_sub_ps(_mm_set1_ps(ray.o[1]), v0y);
+            __m128 sz = _mm_sub_ps(_mm_set1_ps(ray.o[2]), v0z);
+
+            __m128 s1x = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+            __m128 s1y = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+            __m128 s1z = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+            __m128 s2x = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+            __m128 s2y = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+            __m128 s2z = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+#define DOT4(ax, ay, az, bx, by, bz) \
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz))
+            __m128 det = DOT4(s1x, s1y, s1z, e1x, e1y, e1z);
+            __m128 s1_len2 = DOT4(s1x, s1y, s1z, s1x, s1y, s1z);
+            __m128 e1_len2 = DOT4(e1x, e1y, e1z, e1x, e1y, e1z);
+            __m128 e2_len2 = DOT4(e2x, e2y, e2z, e2x, e2y, e2z);
+            __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+            __m128 t = _mm_mul_ps(DOT4(s2x, s2y, s2z, e2x, e2y, e2z), inv_det);
+            __m128 b1 = _mm_mul_ps(DOT4(s1x, s1y, s1z, sx, sy, sz), inv_det);
+            __m128 b2 = _mm_mul_ps(DOT4(s2x, s2y, s2z, dx, dy, dz), inv_det);
+#undef DOT4
+
+            __m128 sign = _mm_set1_ps(-0.0f);
+            __m128 abs_t = _mm_andnot_ps(sign, t);
+            __m128 v0_max = _mm_max_ps(_mm_andnot_ps(sign, v0x),
+                                       _mm_max_ps(_mm_andnot_ps(sign, v0y), _mm_andnot_ps(sign, v0z)));
+            __m128 scale = _mm_add_ps(_mm_add_ps(_mm_set1_ps(ray.o_max), v0_max),
+                                      _mm_mul_ps(abs_t, _mm_set1_ps(ray.d_len)));
+            __m128 s1_len = _mm_sqrt_ps(s1_len2), e1_len = _mm_sqrt_ps(e1_len2), e2_len = _mm_sqrt_ps(e2_len2);
+            __m128 cond = _mm_mul_ps(s1_len, e1_len);
+            __m128 error = _mm_mul_ps(_mm_set1_ps(LEAF_FILTER_ULPS * FLT_EPSILON), _mm_andnot_ps(sign, inv_det));
+            __m128 slack = _mm_mul_ps(error, _mm_add_ps(cond, _mm_mul_ps(scale, _mm_add_ps(
+                    s1_len, _mm_mul_ps(e1_len, _mm_set1_ps(ray.d_len))))));
+            __m128 t_slack = _mm_mul_ps(error, _mm_add_ps(_mm_mul_ps(cond, abs_t),
+                                                          _mm_mul_ps(scale, _mm_mul_ps(e1_len, e2_len))));
+
+            __m128 hit = _mm_cmpge_ps(b1, _mm_sub_ps(_mm_setzero_ps(), slack));
+            hit = _mm_and_ps(hit, _mm_cmpge_ps(b2, _mm_sub_ps(_mm_setzero_ps(), slack)));
+            hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(b1, b2), _mm_add_ps(_mm_set1_ps(1.0f), slack)));
+            hit = _mm_and_ps(hit, _mm_cmpge_ps(_mm_add_ps(t, t_slack), _mm_set1_ps(tmin)));
+            hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_sub_ps(t, t_slack), _mm_set1_ps(tmax)));
+
+            __m128 grazing = _mm_cmplt_ps(_mm_mul_ps(det, det),
+                                          _mm_mul_ps(_mm_set1_ps(LEAF_FILTER_CONDITION), _mm_mul_ps(s1_len2, e1_len2)));
+            return _mm_movemask_ps(_mm_or_ps(hit, grazing));
+#else
+            int mask = 0;
+            for (int c = 0; c < BVH_WIDTH; c++) {
+                size_t k = base + c;
+                float e1[3] = {tris.e1_x[k], tris.e1_y[k], tris.e1_z[k]};
+                float e2[3] = {tris.e2_x[k], tris.e2_y[k], tris.e2_z[k]};
+                float s[3] = {ray.o[0] - tris.v0_x[k], ray.o[1] - tris.v0_y[k], ray.o[2] - tris.v0_z[k]};
+                const float *d = ray.d;
+
+                float s1[3] = {d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0]};
+                float s2[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0]};
+                float det = s1[0] * e1[0] + s1[1] * e1[1] + s1[2] * e1[2];
+                float s1_len2 = s1[0] * s1[0] + s1[1] * s1[1] + s1[2] * s1[2];
+                float e1_len2 = e1[0] * e1[0] + e1[1] * e1[1] + e1[2] * e1[2];
+                float e2_len2 = e2[0] * e2[0] + e2[1] * e2[1] + e2[2] * e2[2];
+                float inv_det = 1.0f / det;
+                float t = (s2[0] * e2[0] + s2[1] * e2[1] + s2[2] * e2[2]) * inv_det;
+                float b1 = (s1[0] * s[0] + s1[1] * s[1] + s1[2] * s[2]) * inv_det;
+                float b2 = (s2[0] * d[0] + s2[1] * d[1] + s2[2] * d[2]) * inv_det;
+                float v0_max = std::max(fabsf(tris.v0_x[k]), std::max(fabsf(tris.v0_y[k]), fabsf(tris.v0_z[k])));
+                float scale = ray.o_max + v0_max + fabsf(t) * ray.d_len;
+                float s1_len = sqrtf(s1_len2), e1_len = sqrtf(e1_len2), e2_len = sqrtf(e2_len2);
+                float cond = s1_len * e1_len;
+                float error = LEAF_FILTER_ULPS * FLT_EPSILON * fabsf(inv_det);
+                float slack = error * (cond + scale * (s1_len + e1_len * ray.d_len));
+                float t_slack = error * (cond * fabsf(t) + scale * e1_len * e2_len);
+
+                bool hit = b1 >= -slack && b2 >= -slack &&
+                           b1 + b2 <= 1.0f + slack && t + t_slack >= tmin && t - t_slack <= tmax;
+                bool grazing = det * det < LEAF_FILTER_CONDITION * s1_len2 * e1_len2;
+                if (hit || grazing) mask |= 1 << c;
+            }
+            return mask;
+#endif
+        }
+
+        /**
+         * Single precision ray of the watertight test. The ray is sheared so that
+         * it runs along +z from the origin: kz is the axis of the largest
+         * direction component, and shear maps the direction onto (0, 0, 1).
+         */
+        struct WatertightRay {
+            float o[3];
+            float shear[3];
+            float min_t, max_t;
+            int kx, ky, kz;
+
+            WatertightRay(const Ray &r) {
+                kz = 0;
+                for (int a = 1; a < 3; a++)
+                    if (fabs(r.d[a]) > fabs(r.d[kz])) kz = a;
+                kx = (kz + 1) % 3;
+                ky = (kx + 1) % 3;
+                // keep the winding of the triangles when looking down -z
+                if (r.d[kz] < 0) std::swap(kx, ky);
+
+                for (int a = 0; a < 3; a++)
+                    o[a] = r.o[a];
+                shear[0] = r.d[kx] / r.d[kz];
+                shear[1] = r.d[ky] / r.d[kz];
+                shear[2] = 1.0 / r.d[kz];
+                min_t = r.min_t;
+                max_t = r.max_t;
+            }
+        };
+
+        /**
+         * Watertight test of one packed triangle, with the edge functions
+         * evaluated in double. The vertices are sheared in float exactly as in
+         * watertight_triangles, so this settles the lanes where one of the
+         * float edge functions is zero and its sign is not reliable.
+         */
+        static inline bool watertight_exact(const TriangleSoA &tris, size_t k, const WatertightRay &ray,
+                                            float &t, float &b1, float &b2) {
+            const vector<float> *v0[3] = {&tris.v0_x, &tris.v0_y, &tris.v0_z};
+            const vector<float> *v1[3] = {&tris.v1_x, &tris.v1_y, &tris.v1_z};
+            const vector<float> *v2[3] = {&tris.v2_x, &tris.v2_y, &tris.v2_z};
+
+            float a[3], b[3], c[3];
+            for (int i = 0; i < 3; i++) {
+                a[i] = (*v0[i])[k] - ray.o[i];
+                b[i] = (*v1[i])[k] - ray.o[i];
+                c[i] = (*v2[i])[k] - ray.o[i];
+            }
+            float ax = a[ray.kx] - ray.shear[0] * a[ray.kz], ay = a[ray.ky] - ray.shear[1] * a[ray.kz];
+            float bx = b[ray.kx] - ray.shear[0] * b[ray.kz], by = b[ray.ky] - ray.shear[1] * b[ray.kz];
+            float cx = c[ray.kx] - ray.shear[0] * c[ray.kz], cy = c[ray.ky] - ray.shear[1] * c[ray.kz];
+
+            double u = (double) cx * by - (double) cy * bx;
+            double v = (double) ax * cy - (double) ay * cx;
+            double w = (double) bx * ay - (double) by * ax;
+            if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+
+            double det = u + v + w;
+            if (det == 0) return false;
+            double z = u * (ray.shear[2] * a[ray.kz]) + v * (ray.shear[2] * b[ray.kz]) +
+                       w * (ray.shear[2] * c[ray.kz]);
+            t = z / det;
+            b1 = v / det;
+            b2 = w / det;
+            return t >= ray.min_t && t <= ray.max_t;
+        }
+
+        /**
+         * Watertight ray - triangle test (Woop et al. 2013) of the BVH_WIDTH
+         * packed triangles starting at base, in single precision. Returns a bit
+         * mask of the lanes hit within [min_t, max_t] and stores their distances
+         * and barycentrics. Lanes where an edge function is exactly zero are
+         * flagged in exact instead and must go through watertight_exact, this
+         * includes the degenerate padding. The edge functions have to stay plain
+         * products and differences, contracting them to fused multiply-adds would
+         * break the symmetry between the two triangles of an edge.
+         */
+        static inline int watertight_triangles(const TriangleSoA &tris, size_t base, const WatertightRay &ray,
+                                               float *t, float *b1, float *b2, int &exact) {
+            const vector<float> *v0[3] = {&tris.v0_x, &tris.v0_y, &tris.v0_z};
+            const vector<float> *v1[3] = {&tris.v1_x, &tris.v1_y, &tris.v1_z};
+            const vector<float> *v2[3] = {&tris.v2_x, &tris.v2_y, &tris.v2_z};
+            int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+#if defined(__AVX__)
+            __m256 okx = _mm256_set1_ps(ray.o[kx]), oky = _mm256_set1_ps(ray.o[ky]), okz = _mm256_set1_ps(ray.o[kz]);
+            __m256 ax = _mm256_sub_ps(_mm256_loadu_ps(&(*v0[kx])[base]), okx);
+            __m256 ay = _mm256_sub_ps(_mm256_loadu_ps(&(*v0[ky])[base]), oky);
+            __m256 az = _mm256_sub_ps(_mm256_loadu_ps(&(*v0[kz])[base]), okz);
+            __m256 bx = _mm256_sub_ps(_mm256_loadu_ps(&(*v1[kx])[base]), okx);
+            __m256 by = _mm256_sub_ps(_mm256_loadu_ps(&(*v1[ky])[base]), oky);
+            __m256 bz = _mm256_sub_ps(_mm256_loadu_ps(&(*v1[kz])[base]), okz);
+            __m256 cx = _mm256_sub_ps(_mm256_loadu_ps(&(*v2[kx])[base]), okx);
+            __m256 cy = _mm256_sub_ps(_mm256_loadu_ps(&(*v2[ky])[base]), oky);
+            __m256 cz = _mm256_sub_ps(_mm256_loadu_ps(&(*v2[kz])[base]), okz);
+
+            __m256 sx = _mm256_set1_ps(ray.shear[0]), sy = _mm256_set1_ps(ray.shear[1]), sz = _mm256_set1_ps(ray.shear[2]);
+            ax = _mm256_sub_ps(ax, _mm256_mul_ps(sx, az));
+            ay = _mm256_sub_ps(ay, _mm256_mul_ps(sy, az));
+            bx = _mm256_sub_ps(bx, _mm256_mul_ps(sx, bz));
+            by = _mm256_sub_ps(by, _mm256_mul_ps(sy, bz));
+            cx = _mm256_sub_ps(cx, _mm256_mul_ps(sx, cz));
+            cy = _mm256_sub_ps(cy, _mm256_mul_ps(sy, cz));
+
+            __m256 u = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+            __m256 v = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+            __m256 w = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+
+            __m256 zero = _mm256_setzero_ps();
+            __m256 neg = _mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ));
+            neg = _mm256_or_ps(neg, _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+            __m256 pos = _mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ));
+            pos = _mm256_or_ps(pos, _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+            __m256 on_edge = _mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ), _mm256_cmp_ps(v, zero, _CMP_EQ_OQ));
+            on_edge = _mm256_or_ps(on_edge, _mm256_cmp_ps(w, zero, _CMP_EQ_OQ));
+
+            __m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+            __m256 z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, _mm256_mul_ps(sz, az)),
+                                                   _mm256_mul_ps(v, _mm256_mul_ps(sz, bz))),
+                                     _mm256_mul_ps(w, _mm256_mul_ps(sz, cz)));
+            __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+            __m256 dist = _mm256_mul_ps(z, inv_det);
+            _mm256_storeu_ps(t, dist);
+            _mm256_storeu_ps(b1, _mm256_mul_ps(v, inv_det));
+            _mm256_storeu_ps(b2, _mm256_mul_ps(w, inv_det));
+
+            // a zero determinant gives an infinite or NaN distance, which fails the range
+            __m256 hit = _mm256_andnot_ps(_mm256_and_ps(neg, pos), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(dist, _mm256_set1_ps(ray.min_t), _CMP_GE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(dist, _mm256_set1_ps(ray.max_t), _CMP_LE_OQ));
+
+            exact = _mm256_movemask_ps(on_edge) & ~_mm256_movemask_ps(_mm256_and_ps(neg, pos));
+            return _mm256_movemask_ps(hit) & ~exact;
+#elif defined(__SSE2__)
+            __m128 okx = _mm_set1_ps(ray.o[kx]), oky = _mm_set1_ps(ray.o[ky]), okz = _mm_set1_ps(ray.o[kz]);
+            __m128 ax = _mm_sub_ps(_mm_loadu_ps(&(*v0[kx])[base]), okx);
+            __m128 ay = _mm_sub_ps(_mm_loadu_ps(&(*v0[ky])[base]), oky);
+            __m128 az = _mm_sub_ps(_mm_loadu_ps(&(*v0[kz])[base]), okz);
+            __m128 bx = _mm_sub_ps(_mm_loadu_ps(&(*v1[kx])[base]), okx);
+            __m128 by = _mm_sub_ps(_mm_loadu_ps(&(*v1[ky])[base]), oky);
+            __m128 bz = _mm_sub_ps(_mm_loadu_ps(&(*v1[kz])[base]), okz);
+            __m128 cx = _mm_sub_ps(_mm_loadu_ps(&(*v2[kx])[base]), okx);
+            __m128 cy = _mm_sub_ps(_mm_loadu_ps(&(*v2[ky])[base]), oky);
+            __m128 cz = _mm_sub_ps(_mm_loadu_ps(&(*v2[kz])[base]), okz);
+
+            __m128 sx = _mm_set1_ps(ray.shear[0]), sy = _mm_set1_ps(ray.shear[1]), sz = _mm_set1_ps(ray.shear[2]);
+            ax = _mm_sub_ps(ax, _mm_mul_ps(sx, az));
+            ay = _mm_sub_ps(ay, _mm_mul_ps(sy, az));
+            bx = _mm_sub_ps(bx, _mm_mul_ps(sx, bz));
+            by = _mm_sub_ps(by, _mm_mul_ps(sy, bz));
+            cx = _mm_sub_ps(cx, _mm_mul_ps(sx, cz));
+            cy = _mm_sub_ps(cy, _mm_mul_ps(sy, cz));
+
+            __m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+            __m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+            __m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+            __m128 zero = _mm_setzero_ps();
+            __m128 neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+            __m128 pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+            __m128 on_edge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero));
+
+            __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+            __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, _mm_mul_ps(sz, az)), _mm_mul_ps(v, _mm_mul_ps(sz, bz))),
+                                  _mm_mul_ps(w, _mm_mul_ps(sz, cz)));
+            __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+            __m128 dist = _mm_mul_ps(z, inv_det);
+            _mm_storeu_ps(t, dist);
+            _mm_storeu_ps(b1, _mm_mul_ps(v, inv_det));
+            _mm_storeu_ps(b2, _mm_mul_ps(w, inv_det));
+
+            // a zero determinant gives an infinite or NaN distance, which fails the range
+            __m128 hit = _mm_andnot_ps(_mm_and_ps(neg, pos), _mm_cmpneq_ps(det, zero));
+            hit = _mm_and_ps(hit, _mm_cmpge_ps(dist, _mm_set1_ps(ray.min_t)));
+            hit = _mm_and_ps(hit, _mm_cmple_ps(dist, _mm_set1_ps(ray.max_t)));
+
+            exact = _mm_movemask_ps(on_edge) & ~_mm_movemask_ps(_mm_and_ps(neg, pos));
+            return _mm_movemask_ps(hit) & ~exact;
+#else
+            int mask = 0;
+            exact = 0;
+            for (int c = 0; c < BVH_WIDTH; c++) {
+                size_t k = base + c;
+                float a[3], b[3], p[3];
+                for (int i = 0; i < 3; i++) {
+                    a[i] = (*v0[i])[k] - ray.o[i];
+                    b[i] = (*v1[i])[k] - ray.o[i];
+                    p[i] = (*v2[i])[k] - ray.o[i];
+                }
+                float ax = a[kx] - ray.shear[0] * a[kz], ay = a[ky] - ray.shear[1] * a[kz];
+                float bx = b[kx] - ray.shear[0] * b[kz], by = b[ky] - ray.shear[1] * b[kz];
+                float cx = p[kx] - ray.shear[0] * p[kz], cy = p[ky] - ray.shear[1] * p[kz];
+
+                float u = cx * by - cy * bx, v = ax * cy - ay * cx, w = bx * ay - by * ax;
+                if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) continue;
+                if (u == 0 || v == 0 || w == 0) {
+                    exact |= 1 << c;
+                    continue;
+                }
+
+                float det = u + v + w;
+                float z = u * (ray.shear[2] * a[kz]) + v * (ray.shear[2] * b[kz]) + w * (ray.shear[2] * p[kz]);
+                float inv_det = 1.0f / det;
+                t[c] = z * inv_det;
+                b1[c] = v * inv_det;
+                b2[c] = w * inv_det;
+                if (t[c] >= ray.min_t && t[c] <= ray.max_t) mask |= 1 << c;
+            }
+            return mask;
+#endif
+        }
+
+        void BVHAccel::pack_triangles() {
+            size_t n = primitives.size();
+            leaf_triangles.assign(n, NULL);
+
+            bool watertight = precision == BVH_PRECISION_FLOAT;
+            vector<float> *v0[3] = {&triangles.v0_x, &triangles.v0_y, &triangles.v0_z};
+            vector<float> *e1[3] = {&triangles.e1_x, &triangles.e1_y, &triangles.e1_z};
+            vector<float> *e2[3] = {&triangles.e2_x, &triangles.e2_y, &triangles.e2_z};
+            vector<float> *v1[3] = {&triangles.v1_x, &triangles.v1_y, &triangles.v1_z};
+            vector<float> *v2[3] = {&triangles.v2_x, &triangles.v2_y, &triangles.v2_z};
+            for (int a = 0; a < 3; a++) {
+                v0[a]->assign(n + BVH_WIDTH, 0.0f);
+                // only the arrays of the current precision are kept
+                for (vector<float> *array: {e1[a], e2[a]})
+                    vector<float>(watertight ? 0 : n + BVH_WIDTH, 0.0f).swap(*array);
+                for (vector<float> *array: {v1[a], v2[a]})
+                    vector<float>(watertight ? n + BVH_WIDTH : 0, 0.0f).swap(*array);
+            }
+
+            for (size_t k = 0; k < n; k++) {
+                const Triangle *tri = dynamic_cast<const Triangle *>(primitives[k]);
+                if (!tri) continue;
+                leaf_triangles[k] = tri;
+
+                if (watertight) {
+                    // vertices are rounded on their own so that triangles sharing
+                    // an edge see the same float coordinates
+                    for (int a = 0; a < 3; a++) {
+                        (*v0[a])[k] = tri->p1[a];
+                        (*v1[a])[k] = tri->p2[a];
+                        (*v2[a])[k] = tri->p3[a];
+                    }
+                    continue;
+                }
+
+                // the edges are taken in double so that thin triangles keep their shape
+                Vector3D d1 = tri->p2 - tri->p1, d2 = tri->p3 - tri->p1;
+                for (int a = 0; a < 3; a++) {
+                    (*v0[a])[k] = tri->p1[a];
+                    (*e1[a])[k] = d1[a];
+                    (*e2[a])[k] = d2[a];
+                }
+            }
+        }
+
+        bool BVHAccel::has_intersection_leaf(const Ray &r, uint32_t offset, uint32_t n, uint32_t *occluder) const {
+            if (precision == BVH_PRECISION_FLOAT)
+                return has_intersection_leaf_watertight(r, offset, n, occluder);
+            thread_stats().isects += n;
+            LeafRay ray(r);
+
+            for (uint32_t j = 0; j < n; j += BVH_WIDTH) {
+                uint32_t lanes = std::min<uint32_t>(n - j, BVH_WIDTH);
+                int mask = filter_triangles(triangles, offset + j, ray, r.min_t, r.max_t) & ((1 << lanes) - 1);
+                for (uint32_t c = 0; c < lanes; c++) {
+                    size_t k = offset + j + c;
+                    const Triangle *tri = leaf_triangles[k];
+                    if (tri ? (mask >> c & 1) && tri->Triangle::has_intersection(r)
+                            : primitives[k]->has_intersection(r)) {
+                        if (occluder) *occluder = k;
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        bool BVHAccel::intersect_leaf(const Ray &r, uint32_t offset, uint32_t n, Intersection *i) const {
+            if (precision == BVH_PRECISION_FLOAT)
+                return intersect_leaf_watertight(r, offset, n, i);
+            thread_stats().isects += n;
+            LeafRay ray(r);
+            bool hit = false;
+
+            // lanes are confirmed in order, so ties resolve as in a plain loop
+            for (uint32_t j = 0; j < n; j += BVH_WIDTH) {
+                uint32_t lanes = std::min<uint32_t>(n - j, BVH_WIDTH);
+                int mask = filter_triangles(triangles, offset + j, ray, r.min_t, r.max_t) & ((1 << lanes) - 1);
+                for (uint32_t c = 0; c < lanes; c++) {
+                    size_t k = offset + j + c;
+                    const Triangle *tri = leaf_triangles[k];
+                    if (tri ? (mask >> c & 1) && tri->Triangle::intersect(r, i)
+                            : primitives[k]->intersect(r, i))
+                        hit = true;
+                }
+            }
+            return hit;
+        }
+
+        bool BVHAccel::has_intersection_leaf_watertight(const Ray &r, uint32_t offset, uint32_t n,
+                                                        uint32_t *occluder) const {
+            thread_stats().isects += n;
+            WatertightRay ray(r);
+            float t[BVH_WIDTH], b1[BVH_WIDTH], b2[BVH_WIDTH];
+
+            for (uint32_t j = 0; j < n; j += BVH_WIDTH) {
+                uint32_t lanes = std::min<uint32_t>(n - j, BVH_WIDTH);
+                int exact;
+                int mask = watertight_triangles(triangles, offset + j, ray, t, b1, b2, exact);
+                for (uint32_t c = 0; c < lanes; c++) {
+                    size_t k = offset + j + c;
+                    bool hit;
+                    if (!leaf_triangles[k])
+                        hit = primitives[k]->has_intersection(r);
+                    else
+                        hit = (mask >> c & 1) ||
+                              ((exact >> c & 1) && watertight_exact(triangles, k, ray, t[c], b1[c], b2[c]));
+                    if (hit) {
+                        if (occluder) *occluder = k;
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        bool BVHAccel::intersect_leaf_watertight(const Ray &r, uint32_t offset, uint32_t n, Intersection *i) const {
+            thread_stats().isects += n;
+            WatertightRay ray(r);
+            float t[BVH_WIDTH], b1[BVH_WIDTH], b2[BVH_WIDTH];
+            bool hit = false;
+
+            // lanes are confirmed in order against the shrinking r.max_t, so ties
+            // resolve as in a plain loop
+            for (uint32_t j = 0; j < n; j += BVH_WIDTH) {
+                uint32_t lanes = std::min<uint32_t>(n - j, BVH_WIDTH);
+                int exact;
+                int mask = watertight_triangles(triangles, offset + j, ray, t, b1, b2, exact);
+                for (uint32_t c = 0; c < lanes; c++) {
+                    size_t k = offset + j + c;
+                    const Triangle *tri = leaf_triangles[k];
+                    if (!tri) {
+                        if (primitives[k]->intersect(r, i)) {
+                            ray.max_t = r.max_t;
+                            hit = true;
+                        }
+                        continue;
+                    }
+                    bool candidate = (mask >> c & 1) ||
+                                     ((exact >> c & 1) && watertight_exact(triangles, k, ray, t[c], b1[c], b2[c]));
+                    if (!candidate || t[c] > r.max_t) continue;
+
+                    i->t = t[c];
+                    i->primitive = tri;
+                    i->u = b1[c];
+                    i->v = b2[c];
+                    r.max_t = t[c];
+                    ray.max_t = t[c];
+                    hit = true;
+                }
+            }
+            return hit;
+        }
+
+    } // namespace SceneObjects
+} // namespace CGL
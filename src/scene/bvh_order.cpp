@@ -0,0 +1,170 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+
+#include <queue>
+#include <utility>
+
+using namespace std;
+
+namespace CGL {
+    namespace SceneObjects {
+
+        /**
+         * Surface area of the box of child c.
+         */
+        static inline double child_area(const WideBVHNode &node, int c) {
+            double dx = node.max_x[c] - node.min_x[c];
+            double dy = node.max_y[c] - node.min_y[c];
+            double dz = node.max_z[c] - node.min_z[c];
+            return 2 * (dx * dy + dy * dz + dz * dx);
+        }
+
+        static inline double child_area(const QuantizedBVHNode &node, int c) {
+            double dx = (node.q_max_x[c] - node.q_min_x[c]) * (double) node.scale[0];
+            double dy = (node.q_max_y[c] - node.q_min_y[c]) * (double) node.scale[1];
+            double dz = (node.q_max_z[c] - node.q_min_z[c]) * (double) node.scale[2];
+            return 2 * (dx * dy + dy * dz + dz * dx);
+        }
+
+        template<typename Node>
+        static inline bool is_interior_child(const Node &node, int c) {
+            return node.child[c] != UINT32_MAX && node.n_primitives[c] == 0;
+        }
+
+        /**
+         * A node waiting to be laid out, with how likely a ray is to visit it.
+         */
+        typedef pair<double, uint32_t> OrderCandidate;
+
+        /**
+         * Most likely node first, ties go to the node built first so that the
+         * order does not depend on the heap.
+         */
+        struct OrderCandidateLess {
+            bool operator()(const OrderCandidate &a, const OrderCandidate &b) const {
+                return a.first < b.first || (a.first == b.first && a.second > b.second);
+            }
+        };
+
+        typedef priority_queue<OrderCandidate, vector<OrderCandidate>, OrderCandidateLess> OrderQueue;
+
+        template<typename Node>
+        static vector<uint32_t> depth_first_order(const vector<Node> &tree) {
+            vector<uint32_t> order;
+            order.reserve(tree.size());
+            vector<uint32_t> stack(1, 0);
+            while (!stack.empty()) {
+                uint32_t index = stack.back();
+                stack.pop_back();
+                order.push_back(index);
+                const Node &node = tree[index];
+                for (int c = BVH_WIDTH - 1; c >= 0; c--)
+                    if (is_interior_child(node, c)) stack.push_back(node.child[c]);
+            }
+            return order;
+        }
+
+        /**
+         * Lay the nodes out in blocks of block_size. A block grows from its root
+         * by taking the most likely node among the children of the nodes it
+         * holds, the children left out become the roots of later blocks, and the
+         * most likely root is always laid out next.
+         */
+        template<typename Node>
+        static vector<uint32_t> treelet_order(const vector<Node> &tree, const vector<double> &weight,
+                                              size_t block_size) {
+            vector<uint32_t> order;
+            order.reserve(tree.size());
+            OrderQueue roots;
+            roots.push(OrderCandidate(weight[0], 0));
+            while (!roots.empty()) {
+                OrderQueue block;
+                block.push(roots.top());
+                roots.pop();
+                for (size_t n = 0; n < block_size && !block.empty(); n++) {
+                    uint32_t index = block.top().second;
+                    block.pop();
+                    order.push_back(index);
+                    const Node &node = tree[index];
+                    for (int c = 0; c < BVH_WIDTH; c++)
+                        if (is_interior_child(node, c))
+                            block.push(OrderCandidate(weight[node.child[c]], node.child[c]));
+                }
+                for (; !block.empty(); block.pop())
+                    roots.push(block.top());
+            }
+            return order;
+        }
+
+        /**
+         * Store the nodes of tree in the given order, the root first.
+         */
+        template<typename Node>
+        static void permute_nodes(vector<Node> &tree, const vector<uint32_t> &order) {
+            vector<uint32_t> position(tree.size());
+            for (size_t i = 0; i < order.size(); i++)
+                position[order[i]] = i;
+
+            vector<Node> reordered(tree.size());
+            for (size_t i = 0; i < order.size(); i++) {
+                Node node = tree[order[i]];
+                for (int c = 0; c < BVH_WIDTH; c++)
+                    if (is_interior_child(node, c)) node.child[c] = position[node.child[c]];
+                reordered[i] = node;
+            }
+            tree.swap(reordered);
+        }
+
+        template<typename Node>
+        static void reorder_tree(vector<Node> &tree, BVHNodeOrder node_order, const vector<uint32_t> *visits) {
+            if (tree.empty()) return;
+            if (node_order == BVH_ORDER_DEPTH_FIRST) {
+                permute_nodes(tree, depth_first_order(tree));
+                return;
+            }
+
+            // a ray that enters a node visits a child with a probability
+            // proportional to its surface area, or as often as it was measured to
+            vector<double> weight(tree.size(), 0.0);
+            weight[0] = INF_D;
+            for (const Node &node: tree) {
+                for (int c = 0; c < BVH_WIDTH; c++) {
+                    if (!is_interior_child(node, c)) continue;
+                    weight[node.child[c]] = visits ? (*visits)[node.child[c]] : child_area(node, c);
+                }
+            }
+            size_t block_size = std::max<size_t>(BVH_TREELET_BYTES / sizeof(Node), 1);
+            permute_nodes(tree, treelet_order(tree, weight, block_size));
+        }
+
+        void BVHAccel::reorder_nodes(const vector<uint32_t> *visits) {
+            if (layout == BVH_LAYOUT_COMPRESSED)
+                reorder_tree(quantized_nodes, node_order, visits);
+            else if (layout == BVH_LAYOUT_WIDE)
+                reorder_tree(wide_nodes, node_order, visits);
+        }
+
+        void BVHAccel::set_node_order(BVHNodeOrder order) {
+            if (order == node_order) return;
+            node_order = order;
+            node_visits.clear();
+            reorder_nodes(NULL);
+        }
+
+        void BVHAccel::begin_profile() {
+            size_t n = layout == BVH_LAYOUT_COMPRESSED ? quantized_nodes.size() : wide_nodes.size();
+            if (layout == BVH_LAYOUT_BINARY) n = 0;
+            node_visits.assign(n, 0);
+            profile_thread = this_thread::get_id();
+        }
+
+        void BVHAccel::end_profile() {
+            vector<uint32_t> visits;
+            visits.swap(node_visits);
+            if (node_order == BVH_ORDER_PROFILED && !visits.empty())
+                reorder_nodes(&visits);
+        }
+
+    } // namespace SceneObjects
+} // namespace CGL
@@ -0,0 +1,257 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+
+#include <algorithm>
+#include <array>
+
+#define BVH_REBUILD_SAH_RATIO 1.5   ///< SAH degradation over the last full build that triggers a rebuild
+#define BVH_REBUILD_FRACTION 0.25   ///< largest share of the primitives rebuilt as a subtree
+
+using namespace std;
+
+namespace CGL {
+    namespace SceneObjects {
+
+        typedef array<double, 6> BoundsKey;
+
+        static inline BoundsKey bounds_key(const BBox &bb) {
+            return {bb.min.x, bb.min.y, bb.min.z, bb.max.x, bb.max.y, bb.max.z};
+        }
+
+        static inline bool contains(const BBox &outer, const BBox &inner) {
+            return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && outer.min.z <= inner.min.z &&
+                   outer.max.x >= inner.max.x && outer.max.y >= inner.max.y && outer.max.z >= inner.max.z;
+        }
+
+        /**
+         * Record the primitive ranges of every node but skip and its subtree, in
+         * depth first order, as offsets into primitives.
+         */
+        static void record_ranges(BVHNode *node, BVHNode *skip, const vector<Primitive *> &primitives,
+                                  vector<size_t> &ranges) {
+            if (node == skip) return;
+            ranges.push_back(node->start - primitives.cbegin());
+            ranges.push_back(node->end - primitives.cbegin());
+            if (node->isLeaf()) return;
+            record_ranges(node->l, skip, primitives, ranges);
+            record_ranges(node->r, skip, primitives, ranges);
+        }
+
+        /**
+         * Point the nodes recorded by record_ranges into the resized primitives,
+         * shifting every offset past the end of the rebuilt range by delta.
+         */
+        static void apply_ranges(BVHNode *node, BVHNode *skip, vector<Primitive *> &primitives,
+                                 const vector<size_t> &ranges, size_t &cursor, size_t end, long delta) {
+            if (node == skip) return;
+            size_t s = ranges[cursor++];
+            size_t e = ranges[cursor++];
+            node->start = primitives.begin() + (s >= end ? s + delta : s);
+            node->end = primitives.begin() + (e >= end ? e + delta : e);
+            if (node->isLeaf()) return;
+            apply_ranges(node->l, skip, primitives, ranges, cursor, end, delta);
+            apply_ranges(node->r, skip, primitives, ranges, cursor, end, delta);
+        }
+
+        static void shift_ranges(BVHNode *node, size_t offset) {
+            node->start += offset;
+            node->end += offset;
+            if (node->isLeaf()) return;
+            shift_ranges(node->l, offset);
+            shift_ranges(node->r, offset);
+        }
+
+        void BVHAccel::refit(BVHNode *node) {
+            if (node->isLeaf()) {
+                node->bb = BBox();
+                for (auto p = node->start; p != node->end; p++)
+                    node->bb.expand((*p)->get_bbox());
+                return;
+            }
+
+            refit(node->l);
+            refit(node->r);
+            node->bb = node->l->bb;
+            node->bb.expand(node->r->bb);
+        }
+
+        void BVHAccel::rebuild_subtree(BVHNode *node, const vector<BVHNode *> &path,
+                                       const vector<bool> &dead, const vector<Primitive *> &added,
+                                       const vector<size_t> &added_index) {
+            size_t n = primitives.size();
+            size_t start = node->start - primitives.cbegin();
+            size_t end = node->end - primitives.cbegin();
+
+            vector<BVHBuildPrimitive> build;
+            auto add_entry = [&](Primitive *p, size_t index) {
+                BVHBuildPrimitive entry;
+                entry.primitive = p;
+                entry.bb = p->get_bbox();
+                entry.centroid = entry.bb.centroid();
+                entry.index = index;
+                build.push_back(entry);
+            };
+            for (size_t i = start; i < end; i++)
+                if (!dead[i]) add_entry(primitives[i], input_index[i]);
+            for (size_t k = 0; k < added.size(); k++)
+                add_entry(added[k], added_index[k]);
+
+            size_t m = build.size();
+            long delta = (long) m - (long) (end - start);
+
+            // move the primitives after the rebuilt range, then repoint the rest
+            // of the tree into the resized array
+            vector<size_t> ranges;
+            record_ranges(root, node, primitives, ranges);
+
+            vector<Primitive *> prims(n + delta);
+            vector<size_t> index(n + delta);
+            copy(primitives.begin(), primitives.begin() + start, prims.begin());
+            copy(primitives.begin() + end, primitives.end(), prims.begin() + start + m);
+            copy(input_index.begin(), input_index.begin() + start, index.begin());
+            copy(input_index.begin() + end, input_index.end(), index.begin() + start + m);
+            primitives.swap(prims);
+            input_index.swap(index);
+
+            size_t cursor = 0;
+            apply_ranges(root, node, primitives, ranges, cursor, end, delta);
+
+            // the linear builders only make sense over the whole scene
+            BVHBuildMethod local_method = method == BVH_BUILD_MEDIAN ? BVH_BUILD_MEDIAN : BVH_BUILD_SAH;
+            BVHNode *subtree = construct_bvh(build, 0, m, max_leaf_size, local_method, num_threads);
+            shift_ranges(subtree, start);
+            for (size_t i = 0; i < m; i++) {
+                primitives[start + i] = build[i].primitive;
+                input_index[start + i] = build[i].index;
+            }
+
+            if (path.empty()) {
+                root = subtree;
+            }
+            else if (path.back()->l == node) {
+                path.back()->l = subtree;
+            }
+            else {
+                path.back()->r = subtree;
+            }
+            delete node;
+
+            for (auto it = path.rbegin(); it != path.rend(); it++) {
+                (*it)->bb = (*it)->l->bb;
+                (*it)->bb.expand((*it)->r->bb);
+            }
+        }
+
+        BVHUpdate BVHAccel::update(const vector<Primitive *> &_primitives) {
+            size_t n = primitives.size();
+            BVHUpdate result;
+
+            // spatial splits clip the bounds of the references, which cannot be refitted
+            if (!root || n == 0 || _primitives.empty() || method == BVH_BUILD_SBVH) {
+                build_tree(_primitives);
+                return BVH_UPDATE_FULL_REBUILD;
+            }
+
+            if (_primitives.size() == n) {
+                // same primitives in the same order, only the geometry moved
+                for (size_t i = 0; i < n; i++)
+                    primitives[i] = _primitives[input_index[i]];
+                refit(root);
+                result = BVH_UPDATE_REFIT;
+            }
+            else {
+                // match unchanged primitives by their bounds, the rest of the old
+                // ones were removed and the rest of the new ones were added. The
+                // old primitives may be gone, so their recorded bounds are used
+                vector<pair<BoundsKey, size_t>> old_keys(n), new_keys(_primitives.size());
+                for (size_t i = 0; i < n; i++)
+                    old_keys[i] = make_pair(bounds_key(reference_bounds[i]), i);
+                for (size_t j = 0; j < _primitives.size(); j++)
+                    new_keys[j] = make_pair(bounds_key(_primitives[j]->get_bbox()), j);
+                sort(old_keys.begin(), old_keys.end());
+                sort(new_keys.begin(), new_keys.end());
+
+                vector<bool> dead(n, true);
+                vector<Primitive *> added;
+                vector<size_t> added_index;
+                size_t i = 0, j = 0;
+                while (j < new_keys.size()) {
+                    if (i < n && old_keys[i].first == new_keys[j].first) {
+                        size_t slot = old_keys[i].second;
+                        primitives[slot] = _primitives[new_keys[j].second];
+                        input_index[slot] = new_keys[j].second;
+                        dead[slot] = false;
+                        i++;
+                        j++;
+                    }
+                    else if (i < n && old_keys[i].first < new_keys[j].first) {
+                        i++;
+                    }
+                    else {
+                        added.push_back(_primitives[new_keys[j].second]);
+                        added_index.push_back(new_keys[j].second);
+                        j++;
+                    }
+                }
+
+                size_t dead_min = n, dead_max = 0;
+                for (size_t k = 0; k < n; k++) {
+                    if (!dead[k]) continue;
+                    dead_min = std::min(dead_min, k);
+                    dead_max = k;
+                }
+                BBox added_bb;
+                for (Primitive *p: added)
+                    added_bb.expand(p->get_bbox());
+
+                // descend to the smallest subtree holding every removed primitive
+                // and enclosing every added one
+                auto covers = [&](BVHNode *node) {
+                    size_t s = node->start - primitives.cbegin(), e = node->end - primitives.cbegin();
+                    bool holds_dead = dead_min > dead_max || (s <= dead_min && dead_max < e);
+                    return holds_dead && (added.empty() || contains(node->bb, added_bb));
+                };
+
+                vector<BVHNode *> path;
+                BVHNode *node = root;
+                while (!node->isLeaf()) {
+                    BVHNode *next = covers(node->l) ? node->l : covers(node->r) ? node->r : NULL;
+                    if (!next) break;
+                    path.push_back(node);
+                    node = next;
+                }
+
+                // a subtree left without primitives is merged into its parent
+                auto subtree_size = [&](BVHNode *node) {
+                    size_t s = node->start - primitives.cbegin(), e = node->end - primitives.cbegin();
+                    size_t alive = 0;
+                    for (size_t k = s; k < e; k++)
+                        if (!dead[k]) alive++;
+                    return alive + added.size();
+                };
+                while (subtree_size(node) == 0 && !path.empty()) {
+                    node = path.back();
+                    path.pop_back();
+                }
+
+                if (path.empty() || subtree_size(node) > BVH_REBUILD_FRACTION * _primitives.size()) {
+                    build_tree(_primitives);
+                    return BVH_UPDATE_FULL_REBUILD;
+                }
+
+                rebuild_subtree(node, path, dead, added, added_index);
+                result = BVH_UPDATE_SUBTREE_REBUILD;
+            }
+
+            if (sah_cost() > BVH_REBUILD_SAH_RATIO * build_cost) {
+                build_tree(_primitives);
+                return BVH_UPDATE_FULL_REBUILD;
+            }
+
+            flatten();
+            return result;
+        }
+
+    } // namespace SceneObjects
+} // namespace CGL
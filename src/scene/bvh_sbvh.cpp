@@ -0,0 +1,290 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+
+#include <algorithm>
+
+#define SBVH_OVERLAP_THRESHOLD 1e-5 ///< child overlap, relative to the root area, above which spatial splits are tried
+#define SBVH_MAX_DEPTH 48           ///< deepest node split spatially, deeper nodes only get object splits
+
+using namespace std;
+
+namespace CGL {
+    namespace SceneObjects {
+
+        /**
+         * Best split found for a node, with the SAH cost of its children
+         * before normalization by the area of the node.
+         */
+        struct SBVHSplit {
+            double cost = INF_D;
+            int axis = -1;
+            int split = 0;         ///< first bin of the right child
+            double position = 0;   ///< spatial splits: plane separating the children
+            BBox left, right;
+        };
+
+        /**
+         * Bounds of the part of a reference between lo and hi along axis.
+         */
+        static inline BBox clip_reference(const BVHBuildPrimitive &ref, int axis, double lo, double hi) {
+            Vector3D min = ref.bb.min, max = ref.bb.max;
+            min[axis] = std::max(min[axis], lo);
+            max[axis] = std::min(max[axis], hi);
+            if (min[axis] > max[axis]) return BBox();
+            return ref.primitive->get_clipped_bbox(BBox(min, max));
+        }
+
+        static inline int object_bin(const BVHBuildPrimitive &ref, const BBox &centroid_bounds, int axis) {
+            double scale = SAH_BIN_COUNT / centroid_bounds.extent[axis];
+            int b = (int) ((ref.centroid[axis] - centroid_bounds.min[axis]) * scale);
+            return std::min(b, SAH_BIN_COUNT - 1);
+        }
+
+        static inline int spatial_bin(double v, const BBox &bbox, int axis) {
+            int b = (int) ((v - bbox.min[axis]) * SAH_BIN_COUNT / bbox.extent[axis]);
+            return std::min(std::max(b, 0), SAH_BIN_COUNT - 1);
+        }
+
+        /**
+         * Binned SAH over the centroids of the references, as in split_sah.
+         */
+        static void find_object_split(const vector<BVHBuildPrimitive> &refs, const BBox &centroid_bounds,
+                                      SBVHSplit &best) {
+            for (int axis = 0; axis < 3; axis++) {
+                if (centroid_bounds.extent[axis] <= 0) continue;
+
+                BBox bounds[SAH_BIN_COUNT];
+                size_t count[SAH_BIN_COUNT] = {0};
+                for (const BVHBuildPrimitive &ref: refs) {
+                    int b = object_bin(ref, centroid_bounds, axis);
+                    count[b]++;
+                    bounds[b].expand(ref.bb);
+                }
+
+                BBox right_bounds[SAH_BIN_COUNT];
+                size_t right_count[SAH_BIN_COUNT];
+                BBox acc;
+                size_t cnt = 0;
+                for (int b = SAH_BIN_COUNT - 1; b > 0; b--) {
+                    acc.expand(bounds[b]);
+                    cnt += count[b];
+                    right_bounds[b] = acc;
+                    right_count[b] = cnt;
+                }
+
+                acc = BBox();
+                cnt = 0;
+                for (int b = 1; b < SAH_BIN_COUNT; b++) {
+                    acc.expand(bounds[b - 1]);
+                    cnt += count[b - 1];
+                    if (cnt == 0 || right_count[b] == 0) continue;
+                    double cost = cnt * acc.surface_area() + right_count[b] * right_bounds[b].surface_area();
+                    if (cost < best.cost) {
+                        best.cost = cost;
+                        best.axis = axis;
+                        best.split = b;
+                        best.left = acc;
+                        best.right = right_bounds[b];
+                    }
+                }
+            }
+        }
+
+        /**
+         * Binned SAH over planes cutting the node, where references spanning
+         * several bins are clipped to each of them and counted on both sides.
+         */
+        static void find_spatial_split(const vector<BVHBuildPrimitive> &refs, const BBox &bbox,
+                                       SBVHSplit &best) {
+            for (int axis = 0; axis < 3; axis++) {
+                double extent = bbox.extent[axis];
+                if (extent <= 0) continue;
+                double width = extent / SAH_BIN_COUNT;
+
+                BBox bounds[SAH_BIN_COUNT];
+                size_t entry[SAH_BIN_COUNT] = {0}, exit[SAH_BIN_COUNT] = {0};
+                for (const BVHBuildPrimitive &ref: refs) {
+                    int b0 = spatial_bin(ref.bb.min[axis], bbox, axis);
+                    int b1 = spatial_bin(ref.bb.max[axis], bbox, axis);
+                    entry[b0]++;
+                    exit[b1]++;
+                    if (b0 == b1) {
+                        bounds[b0].expand(ref.bb);
+                        continue;
+                    }
+                    for (int b = b0; b <= b1; b++) {
+                        double lo = bbox.min[axis] + b * width;
+                        double hi = b == SAH_BIN_COUNT - 1 ? bbox.max[axis] : lo + width;
+                        bounds[b].expand(clip_reference(ref, axis, lo, hi));
+                    }
+                }
+
+                BBox right_bounds[SAH_BIN_COUNT];
+                size_t right_count[SAH_BIN_COUNT];
+                BBox acc;
+                size_t cnt = 0;
+                for (int b = SAH_BIN_COUNT - 1; b > 0; b--) {
+                    acc.expand(bounds[b]);
+                    cnt += exit[b];
+                    right_bounds[b] = acc;
+                    right_count[b] = cnt;
+                }
+
+                acc = BBox();
+                cnt = 0;
+                for (int b = 1; b < SAH_BIN_COUNT; b++) {
+                    acc.expand(bounds[b - 1]);
+                    cnt += entry[b - 1];
+                    if (cnt == 0 || right_count[b] == 0) continue;
+                    double cost = cnt * acc.surface_area() + right_count[b] * right_bounds[b].surface_area();
+                    if (cost < best.cost) {
+                        best.cost = cost;
+                        best.axis = axis;
+                        best.split = b;
+                        best.position = bbox.min[axis] + b * width;
+                        best.left = acc;
+                        best.right = right_bounds[b];
+                    }
+                }
+            }
+        }
+
+        BVHNode *BVHAccel::emit_sbvh(vector<BVHBuildPrimitive> &refs, vector<BVHBuildPrimitive> &ordered,
+                                     size_t &spare, double root_area, int depth, size_t max_leaf_size) {
+            BBox bbox, centroid_bounds;
+            for (const BVHBuildPrimitive &ref: refs) {
+                bbox.expand(ref.bb);
+                centroid_bounds.expand(ref.centroid);
+            }
+
+            BVHNode *node = new BVHNode(bbox);
+            size_t n = refs.size();
+
+            SBVHSplit object, spatial;
+            if (n > 1) {
+                find_object_split(refs, centroid_bounds, object);
+
+                // only split spatially where the object split leaves the children overlapping
+                if (spare > 0 && depth < SBVH_MAX_DEPTH) {
+                    double overlap = 0;
+                    if (object.axis >= 0) {
+                        Vector3D lo, hi;
+                        for (int a = 0; a < 3; a++) {
+                            lo[a] = std::max(object.left.min[a], object.right.min[a]);
+                            hi[a] = std::min(object.left.max[a], object.right.max[a]);
+                        }
+                        if (lo.x <= hi.x && lo.y <= hi.y && lo.z <= hi.z)
+                            overlap = BBox(lo, hi).surface_area();
+                    }
+                    if (object.axis < 0 || overlap > SBVH_OVERLAP_THRESHOLD * root_area)
+                        find_spatial_split(refs, bbox, spatial);
+                }
+            }
+
+            double best_cost = std::min(object.cost, spatial.cost);
+            bool leaf = n <= 1 || (best_cost == INF_D && n <= max_leaf_size) ||
+                        (n <= max_leaf_size && SAH_INTERSECTION_COST * n <=
+                                               SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * best_cost / bbox.surface_area());
+            if (leaf) {
+                node->start = primitives.begin() + ordered.size();
+                ordered.insert(ordered.end(), refs.begin(), refs.end());
+                node->end = primitives.begin() + ordered.size();
+                return node;
+            }
+
+            vector<BVHBuildPrimitive> left, right;
+            if (spatial.cost < object.cost) {
+                int axis = spatial.axis;
+                double x = spatial.position;
+                for (const BVHBuildPrimitive &ref: refs) {
+                    if (ref.bb.max[axis] <= x) {
+                        left.push_back(ref);
+                        continue;
+                    }
+                    if (ref.bb.min[axis] >= x) {
+                        right.push_back(ref);
+                        continue;
+                    }
+
+                    // straddling references are split in two while the budget lasts
+                    BBox lb, rb;
+                    if (spare > 0) {
+                        lb = clip_reference(ref, axis, -INF_D, x);
+                        rb = clip_reference(ref, axis, x, INF_D);
+                    }
+                    if (lb.empty() && rb.empty()) {
+                        (ref.centroid[axis] < x ? left : right).push_back(ref);
+                        continue;
+                    }
+                    BVHBuildPrimitive part = ref;
+                    if (!lb.empty()) {
+                        part.bb = lb;
+                        part.centroid = lb.centroid();
+                        left.push_back(part);
+                    }
+                    if (!rb.empty()) {
+                        part.bb = rb;
+                        part.centroid = rb.centroid();
+                        right.push_back(part);
+                    }
+                    if (!lb.empty() && !rb.empty())
+                        spare--;
+                }
+
+                // numerical corner cases, fall back to the object split
+                if (left.empty() || right.empty()) {
+                    left.clear();
+                    right.clear();
+                }
+            }
+
+            if (left.empty() && object.axis >= 0) {
+                for (const BVHBuildPrimitive &ref: refs)
+                    (object_bin(ref, centroid_bounds, object.axis) < object.split ? left : right).push_back(ref);
+            }
+            else if (left.empty()) {
+                // all centroids coincide, split the references evenly
+                left.assign(refs.begin(), refs.begin() + n / 2);
+                right.assign(refs.begin() + n / 2, refs.end());
+            }
+
+            // the references of the node are no longer needed once distributed
+            vector<BVHBuildPrimitive>().swap(refs);
+
+            node->l = emit_sbvh(left, ordered, spare, root_area, depth + 1, max_leaf_size);
+            node->r = emit_sbvh(right, ordered, spare, root_area, depth + 1, max_leaf_size);
+            node->start = node->l->start;
+            node->end = node->r->end;
+            return node;
+        }
+
+        BVHNode *BVHAccel::construct_sbvh(vector<BVHBuildPrimitive> &build, size_t max_leaf_size,
+                                          double split_budget) {
+            size_t n = build.size();
+            if (n == 0) {
+                BVHNode *node = new BVHNode(BBox());
+                node->start = node->end = primitives.begin();
+                return node;
+            }
+
+            // leaves point into primitives, so make room for every reference the
+            // budget allows before building and trim it afterwards
+            size_t spare = (size_t) (std::max(split_budget, 0.0) * n);
+            primitives.resize(n + spare);
+
+            BBox bbox;
+            for (const BVHBuildPrimitive &ref: build)
+                bbox.expand(ref.bb);
+
+            vector<BVHBuildPrimitive> ordered;
+            ordered.reserve(n + spare);
+            BVHNode *root = emit_sbvh(build, ordered, spare, bbox.surface_area(), 0, max_leaf_size);
+
+            primitives.resize(ordered.size());
+            build.swap(ordered);
+            return root;
+        }
+
+    } // namespace SceneObjects
+} // namespace CGL
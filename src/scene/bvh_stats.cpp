@@ -0,0 +1,148 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+
+#include <utility>
+#include <mutex>
+#include <atomic>
+
+using namespace std;
+
+namespace CGL {
+    namespace SceneObjects {
+
+        static void add_leaf(BVHTreeStats &stats, size_t depth, size_t size) {
+            stats.leaf_nodes++;
+            stats.max_depth = std::max(stats.max_depth, depth);
+            if (stats.depth_histogram.size() <= depth)
+                stats.depth_histogram.resize(depth + 1, 0);
+            if (stats.leaf_size_histogram.size() <= size)
+                stats.leaf_size_histogram.resize(size + 1, 0);
+            stats.depth_histogram[depth]++;
+            stats.leaf_size_histogram[size]++;
+        }
+
+        static void gather_tree_stats(const vector<LinearBVHNode> &tree, BVHTreeStats &stats) {
+            vector<pair<uint32_t, size_t>> stack(1, make_pair(0u, (size_t) 0));
+            while (!stack.empty()) {
+                uint32_t index = stack.back().first;
+                size_t depth = stack.back().second;
+                stack.pop_back();
+                const LinearBVHNode &node = tree[index];
+                if (node.n_primitives > 0) {
+                    add_leaf(stats, depth, node.n_primitives);
+                    continue;
+                }
+                stats.interior_nodes++;
+                stack.push_back(make_pair(index + 1, depth + 1));
+                stack.push_back(make_pair(node.second_child_offset, depth + 1));
+            }
+        }
+
+        /**
+         * Same as above for the wide layouts, whose leaves are children of the
+         * nodes rather than nodes.
+         */
+        template<typename Node>
+        static void gather_tree_stats(const vector<Node> &tree, BVHTreeStats &stats) {
+            vector<pair<uint32_t, size_t>> stack(1, make_pair(0u, (size_t) 0));
+            while (!stack.empty()) {
+                const Node &node = tree[stack.back().first];
+                size_t depth = stack.back().second;
+                stack.pop_back();
+                stats.interior_nodes++;
+                for (int c = 0; c < BVH_WIDTH; c++) {
+                    if (node.child[c] == UINT32_MAX) continue;
+                    if (node.n_primitives[c] > 0)
+                        add_leaf(stats, depth + 1, node.n_primitives[c]);
+                    else
+                        stack.push_back(make_pair(node.child[c], depth + 1));
+                }
+            }
+        }
+
+        BVHTreeStats BVHAccel::tree_stats() const {
+            BVHTreeStats stats;
+            stats.sah_cost = sah_cost();
+            stats.primitives = 0;
+            for (size_t index: input_index)
+                stats.primitives = std::max(stats.primitives, index + 1);
+            stats.references = primitives.size();
+            stats.max_leaf_size = max_leaf_size;
+            stats.interior_nodes = stats.leaf_nodes = 0;
+            stats.node_bytes = node_bytes();
+            stats.max_depth = 0;
+            if (layout == BVH_LAYOUT_BINARY) {
+                stats.traversal_nodes = nodes.size();
+                if (!nodes.empty()) gather_tree_stats(nodes, stats);
+            }
+            else if (layout == BVH_LAYOUT_COMPRESSED) {
+                stats.traversal_nodes = quantized_nodes.size();
+                if (!quantized_nodes.empty()) gather_tree_stats(quantized_nodes, stats);
+            }
+            else {
+                stats.traversal_nodes = wide_nodes.size();
+                if (!wide_nodes.empty()) gather_tree_stats(wide_nodes, stats);
+            }
+            return stats;
+        }
+
+        // a small index per live thread, handed to the next thread once it exits
+        static mutex stats_slot_mutex;
+        static vector<size_t> free_stats_slots;
+        static size_t next_stats_slot = 0;
+
+        struct StatsSlot {
+            size_t index;
+
+            StatsSlot() {
+                lock_guard<mutex> lock(stats_slot_mutex);
+                if (free_stats_slots.empty()) {
+                    index = next_stats_slot++;
+                }
+                else {
+                    index = free_stats_slots.back();
+                    free_stats_slots.pop_back();
+                }
+            }
+
+            ~StatsSlot() {
+                lock_guard<mutex> lock(stats_slot_mutex);
+                free_stats_slots.push_back(index);
+            }
+        };
+
+        BVHTraversalStats &BVHAccel::thread_stats() const {
+            thread_local StatsSlot slot;
+            if (slot.index >= BVH_STATS_SLOTS) {
+                thread_local BVHTraversalStats uncounted;
+                return uncounted;
+            }
+
+            // only this thread allocates the block of its slot, the others read it
+            ThreadStats *block = thread_stats_slots[slot.index].load(memory_order_acquire);
+            if (!block) {
+                block = new ThreadStats();
+                thread_stats_slots[slot.index].store(block, memory_order_release);
+            }
+            return block->stats;
+        }
+
+        BVHTraversalStats BVHAccel::traversal_stats() const {
+            BVHTraversalStats total;
+            for (const atomic<ThreadStats *> &slot: thread_stats_slots) {
+                ThreadStats *block = slot.load(memory_order_acquire);
+                if (block) total.add(block->stats);
+            }
+            return total;
+        }
+
+        void BVHAccel::reset_traversal_stats() {
+            for (atomic<ThreadStats *> &slot: thread_stats_slots) {
+                ThreadStats *block = slot.load(memory_order_acquire);
+                if (block) block->stats = BVHTraversalStats();
+            }
+        }
+
+    } // namespace SceneObjects
+} // namespace CGL
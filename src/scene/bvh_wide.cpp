@@ -0,0 +1,798 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <bitset>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// far distances are scaled up a few ulps to cover the rounding of the
+// subtraction, the product and the inverse direction of the slab tests
+#define WIDE_TFAR_SCALE 1.0000004f
+
+using namespace std;
+
+namespace CGL {
+    namespace SceneObjects {
+
+        uint32_t BVHAccel::collapse_wide(BVHNode *node) {
+            uint32_t index = wide_nodes.size();
+            wide_nodes.emplace_back();
+
+            // gather up to BVH_WIDTH children by repeatedly opening the interior
+            // child with the largest surface area
+            vector<BVHNode *> children;
+            if (node->isLeaf()) {
+                children.push_back(node);
+            }
+            else {
+                children.push_back(node->l);
+                children.push_back(node->r);
+            }
+
+            while (children.size() < BVH_WIDTH) {
+                size_t best = children.size();
+                double best_area = -1;
+                for (size_t c = 0; c < children.size(); c++) {
+                    if (children[c]->isLeaf()) continue;
+                    double area = children[c]->bb.surface_area();
+                    if (area > best_area) {
+                        best_area = area;
+                        best = c;
+                    }
+                }
+                if (best == children.size()) break;
+
+                BVHNode *opened = children[best];
+                children[best] = opened->l;
+                children.push_back(opened->r);
+            }
+
+            uint32_t child[BVH_WIDTH];
+            uint16_t n_primitives[BVH_WIDTH];
+            for (size_t c = 0; c < BVH_WIDTH; c++) {
+                child[c] = UINT32_MAX;
+                n_primitives[c] = 0;
+                if (c >= children.size()) continue;
+                if (children[c]->isLeaf()) {
+                    child[c] = children[c]->start - primitives.cbegin();
+                    n_primitives[c] = children[c]->end - children[c]->start;
+                }
+                else {
+                    child[c] = collapse_wide(children[c]);
+                }
+            }
+
+            // wide_nodes may have been reallocated by the recursion
+            WideBVHNode &wide = wide_nodes[index];
+            for (size_t c = 0; c < BVH_WIDTH; c++) {
+                wide.child[c] = child[c];
+                wide.n_primitives[c] = n_primitives[c];
+                if (c < children.size()) {
+                    const BBox &bb = children[c]->bb;
+                    wide.min_x[c] = round_outward(bb.min.x, -1);
+                    wide.min_y[c] = round_outward(bb.min.y, -1);
+                    wide.min_z[c] = round_outward(bb.min.z, -1);
+                    wide.max_x[c] = round_outward(bb.max.x, 1);
+                    wide.max_y[c] = round_outward(bb.max.y, 1);
+                    wide.max_z[c] = round_outward(bb.max.z, 1);
+                }
+                else {
+                    wide.min_x[c] = wide.min_y[c] = wide.min_z[c] = INFINITY;
+                    wide.max_x[c] = wide.max_y[c] = wide.max_z[c] = -INFINITY;
+                }
+            }
+
+            return index;
+        }
+
+        /**
+         * Smallest power of two step such that 255 steps from lo reach hi in
+         * float arithmetic.
+         */
+        static inline float quantization_step(float lo, float hi) {
+            int exponent;
+            frexpf((hi - lo) / 255, &exponent);
+            float step = ldexpf(1, exponent);
+            while (lo + 255 * step < hi)
+                step *= 2;
+            return step;
+        }
+
+        /**
+         * Largest q such that lo + q * step <= v.
+         */
+        static inline uint8_t quantize_down(float v, float lo, float step) {
+            int q = std::min(std::max((int) floorf((v - lo) / step), 0), 255);
+            while (q > 0 && lo + q * step > v)
+                q--;
+            return q;
+        }
+
+        /**
+         * Smallest q such that lo + q * step >= v.
+         */
+        static inline uint8_t quantize_up(float v, float lo, float step) {
+            int q = std::min(std::max((int) ceilf((v - lo) / step), 0), 255);
+            while (q < 255 && lo + q * step < v)
+                q++;
+            return q;
+        }
+
+        void BVHAccel::quantize_wide() {
+            quantized_nodes.resize(wide_nodes.size());
+            for (size_t n = 0; n < wide_nodes.size(); n++) {
+                const WideBVHNode &wide = wide_nodes[n];
+                QuantizedBVHNode &node = quantized_nodes[n];
+
+                const float *mins[3] = {wide.min_x, wide.min_y, wide.min_z};
+                const float *maxs[3] = {wide.max_x, wide.max_y, wide.max_z};
+                uint8_t *q_mins[3] = {node.q_min_x, node.q_min_y, node.q_min_z};
+                uint8_t *q_maxs[3] = {node.q_max_x, node.q_max_y, node.q_max_z};
+
+                for (int a = 0; a < 3; a++) {
+                    float lo = INFINITY, hi = -INFINITY;
+                    for (int c = 0; c < BVH_WIDTH; c++) {
+                        if (wide.child[c] == UINT32_MAX) continue;
+                        lo = std::min(lo, mins[a][c]);
+                        hi = std::max(hi, maxs[a][c]);
+                    }
+                    node.origin[a] = lo;
+                    node.scale[a] = quantization_step(lo, hi);
+
+                    for (int c = 0; c < BVH_WIDTH; c++) {
+                        if (wide.child[c] == UINT32_MAX) {
+                            q_mins[a][c] = 255;
+                            q_maxs[a][c] = 0;
+                            continue;
+                        }
+                        q_mins[a][c] = quantize_down(mins[a][c], lo, node.scale[a]);
+                        q_maxs[a][c] = quantize_up(maxs[a][c], lo, node.scale[a]);
+                    }
+                }
+
+                for (int c = 0; c < BVH_WIDTH; c++) {
+                    node.child[c] = wide.child[c];
+                    node.n_primitives[c] = wide.n_primitives[c];
+                }
+            }
+        }
+
+        /**
+         * Ray data converted once to single precision for the wide traversal.
+         * The origin is rounded outward to the two floats around it, and each
+         * slab uses the one that moves its plane toward the ray: the nearer
+         * for the near plane and the farther for the far plane. The slabs thus
+         * contain those of the double precision ray the leaves are tested with.
+         */
+        struct WideRay {
+            float o_near[3];  ///< origin for the distances to the near planes
+            float o_far[3];   ///< origin for the distances to the far planes
+            float inv_d[3];
+            int dir_is_neg[3];
+
+            WideRay(const Ray &r) {
+                for (int a = 0; a < 3; a++) {
+                    inv_d[a] = r.inv_d[a];
+                    dir_is_neg[a] = r.inv_d[a] < 0;
+                    o_near[a] = round_outward(r.o[a], dir_is_neg[a] ? -1 : 1);
+                    o_far[a] = round_outward(r.o[a], dir_is_neg[a] ? 1 : -1);
+                }
+            }
+        };
+
+        /**
+         * Slab test of all the children of a wide node.
+         * Returns a bit mask of the children hit within [tmin, tmax] and stores
+         * their entry distances in tnear. NaNs produced by axis aligned rays are
+         * dropped by keeping the ray interval as the second operand of min/max.
+         * The interval is rounded outward by the callers, so together with the
+         * origins of WideRay and WIDE_TFAR_SCALE the test is conservative.
+         */
+        static inline int intersect_children(const WideBVHNode &node, const WideRay &ray,
+                                             float tmin, float tmax, float *tnear) {
+
+            const float *near_x = ray.dir_is_neg[0] ? node.max_x : node.min_x;
+            const float *near_y = ray.dir_is_neg[1] ? node.max_y : node.min_y;
+            const float *near_z = ray.dir_is_neg[2] ? node.max_z : node.min_z;
+            const float *far_x = ray.dir_is_neg[0] ? node.min_x : node.max_x;
+            const float *far_y = ray.dir_is_neg[1] ? node.min_y : node.max_y;
+            const float *far_z = ray.dir_is_neg[2] ? node.min_z : node.max_z;
+
+#if defined(__AVX__)
+            __m256 nx = _mm256_set1_ps(ray.o_near[0]), ny = _mm256_set1_ps(ray.o_near[1]), nz = _mm256_set1_ps(ray.o_near[2]);
+            __m256 fx = _mm256_set1_ps(ray.o_far[0]), fy = _mm256_set1_ps(ray.o_far[1]), fz = _mm256_set1_ps(ray.o_far[2]);
+            __m256 ix = _mm256_set1_ps(ray.inv_d[0]), iy = _mm256_set1_ps(ray.inv_d[1]), iz = _mm256_set1_ps(ray.inv_d[2]);
+            __m256 scale = _mm256_set1_ps(WIDE_TFAR_SCALE);
+
+            __m256 t0 = _mm256_set1_ps(tmin);
+            t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_x), nx), ix), t0);
+            t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_y), ny), iy), t0);
+            t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_z), nz), iz), t0);
+
+            __m256 t1 = _mm256_set1_ps(tmax);
+            t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_x), fx), ix), scale), t1);
+            t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_y), fy), iy), scale), t1);
+            t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_z), fz), iz), scale), t1);
+
+            _mm256_storeu_ps(tnear, t0);
+            return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#elif defined(__SSE2__)
+            __m128 nx = _mm_set1_ps(ray.o_near[0]), ny = _mm_set1_ps(ray.o_near[1]), nz = _mm_set1_ps(ray.o_near[2]);
+            __m128 fx = _mm_set1_ps(ray.o_far[0]), fy = _mm_set1_ps(ray.o_far[1]), fz = _mm_set1_ps(ray.o_far[2]);
+            __m128 ix = _mm_set1_ps(ray.inv_d[0]), iy = _mm_set1_ps(ray.inv_d[1]), iz = _mm_set1_ps(ray.inv_d[2]);
+            __m128 scale = _mm_set1_ps(WIDE_TFAR_SCALE);
+
+            __m128 t0 = _mm_set1_ps(tmin);
+            t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_x), nx), ix), t0);
+            t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_y), ny), iy), t0);
+            t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_z), nz), iz), t0);
+
+            __m128 t1 = _mm_set1_ps(tmax);
+            t1 = _mm_min_ps(_mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_x), fx), ix), scale), t1);
+            t1 = _mm_min_ps(_mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_y), fy), iy), scale), t1);
+            t1 = _mm_min_ps(_mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_z), fz), iz), scale), t1);
+
+            _mm_storeu_ps(tnear, t0);
+            return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+            int mask = 0;
+            for (int c = 0; c < BVH_WIDTH; c++) {
+                float t0 = tmin, t1 = tmax;
+                float tn[3] = {(near_x[c] - ray.o_near[0]) * ray.inv_d[0],
+                               (near_y[c] - ray.o_near[1]) * ray.inv_d[1],
+                               (near_z[c] - ray.o_near[2]) * ray.inv_d[2]};
+                float tf[3] = {(far_x[c] - ray.o_far[0]) * ray.inv_d[0] * WIDE_TFAR_SCALE,
+                               (far_y[c] - ray.o_far[1]) * ray.inv_d[1] * WIDE_TFAR_SCALE,
+                               (far_z[c] - ray.o_far[2]) * ray.inv_d[2] * WIDE_TFAR_SCALE};
+                for (int a = 0; a < 3; a++) {
+                    if (tn[a] > t0) t0 = tn[a];
+                    if (tf[a] < t1) t1 = tf[a];
+                }
+                tnear[c] = t0;
+                if (t0 <= t1) mask |= 1 << c;
+            }
+            return mask;
+#endif
+        }
+
+        /**
+         * Decode BVH_WIDTH quantized coordinates along one axis.
+         */
+        static inline void decode_bounds(const uint8_t *q, float origin, float scale, float *out) {
+#if defined(__AVX2__) && BVH_WIDTH == 8
+            __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) q)));
+            _mm256_storeu_ps(out, _mm256_add_ps(_mm256_set1_ps(origin), _mm256_mul_ps(v, _mm256_set1_ps(scale))));
+#else
+            for (int c = 0; c < BVH_WIDTH; c++)
+                out[c] = origin + q[c] * scale;
+#endif
+        }
+
+        /**
+         * Float bounds of the children of a node, decoded into box for the
+         * compressed nodes. Only the bounds of the returned node are valid.
+         */
+        static inline const WideBVHNode &decode_node(const WideBVHNode &node, WideBVHNode &box) {
+            return node;
+        }
+
+        static inline const WideBVHNode &decode_node(const QuantizedBVHNode &node, WideBVHNode &box) {
+            decode_bounds(node.q_min_x, node.origin[0], node.scale[0], box.min_x);
+            decode_bounds(node.q_min_y, node.origin[1], node.scale[1], box.min_y);
+            decode_bounds(node.q_min_z, node.origin[2], node.scale[2], box.min_z);
+            decode_bounds(node.q_max_x, node.origin[0], node.scale[0], box.max_x);
+            decode_bounds(node.q_max_y, node.origin[1], node.scale[1], box.max_y);
+            decode_bounds(node.q_max_z, node.origin[2], node.scale[2], box.max_z);
+            return box;
+        }
+
+        /**
+         * Slab test of all the children of a compressed wide node, on their
+         * decoded bounds.
+         */
+        static inline int intersect_children(const QuantizedBVHNode &node, const WideRay &ray,
+                                             float tmin, float tmax, float *tnear) {
+            WideBVHNode box;
+            return intersect_children(decode_node(node, box), ray, tmin, tmax, tnear);
+        }
+
+        /**
+         * Entry of the wide traversal stack, a child slot of a node together
+         * with the distance at which the ray enters it.
+         */
+        struct WideStackEntry {
+            uint32_t child;
+            uint32_t n_primitives;
+            float tnear;
+        };
+
+        bool BVHAccel::profiling() const {
+            if (node_visits.empty()) return false;
+            assert(this_thread::get_id() == profile_thread);
+            return true;
+        }
+
+        bool BVHAccel::has_intersection_wide(const Ray &r, uint32_t *occluder) const {
+            if (layout == BVH_LAYOUT_COMPRESSED)
+                return profiling() ? has_intersection_wide<true>(quantized_nodes, r, occluder)
+                                   : has_intersection_wide<false>(quantized_nodes, r, occluder);
+            return profiling() ? has_intersection_wide<true>(wide_nodes, r, occluder)
+                               : has_intersection_wide<false>(wide_nodes, r, occluder);
+        }
+
+        bool BVHAccel::intersect_wide(const Ray &r, Intersection *i) const {
+            if (layout == BVH_LAYOUT_COMPRESSED)
+                return profiling() ? intersect_wide<true>(quantized_nodes, r, i)
+                                   : intersect_wide<false>(quantized_nodes, r, i);
+            return profiling() ? intersect_wide<true>(wide_nodes, r, i) : intersect_wide<false>(wide_nodes, r, i);
+        }
+
+        template<bool Profile, typename Node>
+        bool BVHAccel::has_intersection_wide(const vector<Node> &tree, const Ray &r, uint32_t *occluder) const {
+            BVHTraversalStats &stats = thread_stats();
+            ++stats.rays;
+            if (tree.empty()) return false;
+
+            WideRay ray(r);
+            float tmin = round_outward(r.min_t, -1);
+            float tnear[BVH_WIDTH];
+
+            BVHTraversalStack<WideStackEntry, BVH_STACK_SIZE * BVH_WIDTH> stack;
+            stack.push({0, 0, tmin});
+
+            while (!stack.empty()) {
+                uint32_t index = stack.pop().child;
+                const Node &node = tree[index];
+                ++stats.nodes_visited;
+                if (Profile) ++node_visits[index];
+                int mask = intersect_children(node, ray, tmin, round_outward(r.max_t, 1), tnear);
+
+                // the leaves the ray enters are the most likely occluders, so they
+                // are tested right away, and the subtrees are pushed farthest first
+                // so that the geometry around the origin of the ray comes next
+                size_t base = stack.size();
+                for (int c = 0; mask; c++, mask >>= 1) {
+                    if (!(mask & 1)) continue;
+                    if (node.n_primitives[c] > 0) {
+                        if (has_intersection_leaf(r, node.child[c], node.n_primitives[c], occluder))
+                            return true;
+                        continue;
+                    }
+                    WideStackEntry child = {node.child[c], 0, tnear[c]};
+                    stack.push(child);
+                    size_t k = stack.size() - 1;
+                    while (k > base && stack[k - 1].tnear < child.tnear) {
+                        stack[k] = stack[k - 1];
+                        k--;
+                    }
+                    stack[k] = child;
+                }
+            }
+            return false;
+        }
+
+        template<bool Profile, typename Node>
+        bool BVHAccel::intersect_wide(const vector<Node> &tree, const Ray &r, Intersection *i) const {
+            BVHTraversalStats &stats = thread_stats();
+            ++stats.rays;
+            if (tree.empty()) return false;
+
+            bool hit = false;
+            WideRay ray(r);
+            float tmin = round_outward(r.min_t, -1);
+            float tnear[BVH_WIDTH];
+
+            BVHTraversalStack<WideStackEntry, BVH_STACK_SIZE * BVH_WIDTH> stack;
+            stack.push({0, 0, tmin});
+
+            while (!stack.empty()) {
+                WideStackEntry entry = stack.pop();
+                // primitives shorten r.max_t on hit, which culls farther entries
+                if (entry.tnear > r.max_t) continue;
+
+                if (entry.n_primitives > 0) {
+                    if (intersect_leaf(r, entry.child, entry.n_primitives, i))
+                        hit = true;
+                    continue;
+                }
+
+                const Node &node = tree[entry.child];
+                ++stats.nodes_visited;
+                if (Profile) ++node_visits[entry.child];
+                int mask = intersect_children(node, ray, tmin, round_outward(r.max_t, 1), tnear);
+
+                // push the hit children farthest first so the nearest is popped next
+                size_t base = stack.size();
+                for (int c = 0; mask; c++, mask >>= 1) {
+                    if (!(mask & 1)) continue;
+                    WideStackEntry child = {node.child[c], node.n_primitives[c], tnear[c]};
+                    stack.push(child);
+                    size_t k = stack.size() - 1;
+                    while (k > base && stack[k - 1].tnear < child.tnear) {
+                        stack[k] = stack[k - 1];
+                        k--;
+                    }
+                    stack[k] = child;
+                }
+            }
+            return hit;
+        }
+
+        /**
+         * Rays of a packet converted to single precision, one SIMD lane each.
+         * Unused lanes keep an empty interval so that they never enter a box.
+         * The ranges of the origins, inverse directions and intervals of the
+         * rays bound the whole packet, for culling boxes missed by every ray.
+         */
+        struct PacketRays {
+            float o_near[3][BVH_PACKET_SIZE];  ///< origins for the near planes, as in WideRay
+            float o_far[3][BVH_PACKET_SIZE];   ///< origins for the far planes
+            float inv_d[3][BVH_PACKET_SIZE];
+            float tmin[BVH_PACKET_SIZE];
+            float tmax[BVH_PACKET_SIZE];
+            int dir_is_neg[3];
+
+            float o_lo[3], o_hi[3];
+            float inv_d_lo[3], inv_d_hi[3];
+            float tmin_lo, tmax_hi;
+
+            PacketRays(const Ray *rays, int n) {
+                for (int a = 0; a < 3; a++)
+                    dir_is_neg[a] = rays[0].inv_d[a] < 0;
+                for (int k = 0; k < BVH_PACKET_SIZE; k++) {
+                    const Ray &r = rays[std::min(k, n - 1)];
+                    for (int a = 0; a < 3; a++) {
+                        o_near[a][k] = round_outward(r.o[a], dir_is_neg[a] ? -1 : 1);
+                        o_far[a][k] = round_outward(r.o[a], dir_is_neg[a] ? 1 : -1);
+                        inv_d[a][k] = r.inv_d[a];
+                    }
+                    tmin[k] = k < n ? round_outward(r.min_t, -1) : 0.0f;
+                    tmax[k] = k < n ? round_outward(r.max_t, 1) : -1.0f;
+                }
+                for (int a = 0; a < 3; a++) {
+                    const float *lo = dir_is_neg[a] ? o_near[a] : o_far[a];
+                    const float *hi = dir_is_neg[a] ? o_far[a] : o_near[a];
+                    o_lo[a] = *std::min_element(lo, lo + n);
+                    o_hi[a] = *std::max_element(hi, hi + n);
+                    inv_d_lo[a] = *std::min_element(inv_d[a], inv_d[a] + n);
+                    inv_d_hi[a] = *std::max_element(inv_d[a], inv_d[a] + n);
+                }
+                tmin_lo = *std::min_element(tmin, tmin + n);
+                update_tmax();
+            }
+
+            void update_tmax() {
+                tmax_hi = *std::max_element(tmax, tmax + BVH_PACKET_SIZE);
+            }
+        };
+
+        /**
+         * Whether the directions of the rays all share their signs, so that
+         * they visit the near and far planes of every box in the same order.
+         * Directions parallel to an axis would make the bounds of the packet
+         * produce NaNs, so such packets are traced ray by ray as well.
+         */
+        static inline bool is_coherent(const Ray *rays, int n) {
+            for (int k = 0; k < n; k++)
+                for (int a = 0; a < 3; a++)
+                    if ((rays[k].inv_d[a] < 0) != (rays[0].inv_d[a] < 0) || !std::isfinite((float) rays[k].inv_d[a]))
+                        return false;
+            return true;
+        }
+
+        /**
+         * Interval arithmetic slab test of all the children of a wide node
+         * against the bounds of a packet. Returns a bit mask of the children
+         * that some ray of the packet may enter, the others are missed by all,
+         * and stores a lower bound of the entry distances of the rays in tnear.
+         * Rounding is monotonic, so a child kept by the slab test of any single
+         * ray is never culled.
+         */
+        static inline int intersect_children_packet(const WideBVHNode &node, const PacketRays &packet,
+                                                    float *tnear) {
+            const float *nears[3], *fars[3];
+            for (int a = 0; a < 3; a++) {
+                const float *mins = a == 0 ? node.min_x : a == 1 ? node.min_y : node.min_z;
+                const float *maxs = a == 0 ? node.max_x : a == 1 ? node.max_y : node.max_z;
+                nears[a] = packet.dir_is_neg[a] ? maxs : mins;
+                fars[a] = packet.dir_is_neg[a] ? mins : maxs;
+            }
+
+#if defined(__AVX__)
+            __m256 lower = _mm256_set1_ps(packet.tmin_lo);
+            __m256 upper = _mm256_set1_ps(packet.tmax_hi);
+            for (int a = 0; a < 3; a++) {
+                __m256 o_lo = _mm256_set1_ps(packet.o_lo[a]), o_hi = _mm256_set1_ps(packet.o_hi[a]);
+                __m256 i_lo = _mm256_set1_ps(packet.inv_d_lo[a]), i_hi = _mm256_set1_ps(packet.inv_d_hi[a]);
+                __m256 n_lo = _mm256_sub_ps(_mm256_loadu_ps(nears[a]), o_hi);
+                __m256 n_hi = _mm256_sub_ps(_mm256_loadu_ps(nears[a]), o_lo);
+                __m256 f_lo = _mm256_sub_ps(_mm256_loadu_ps(fars[a]), o_hi);
+                __m256 f_hi = _mm256_sub_ps(_mm256_loadu_ps(fars[a]), o_lo);
+                __m256 tn = _mm256_min_ps(_mm256_min_ps(_mm256_mul_ps(n_lo, i_lo), _mm256_mul_ps(n_lo, i_hi)),
+                                          _mm256_min_ps(_mm256_mul_ps(n_hi, i_lo), _mm256_mul_ps(n_hi, i_hi)));
+                __m256 tf = _mm256_max_ps(_mm256_max_ps(_mm256_mul_ps(f_lo, i_lo), _mm256_mul_ps(f_lo, i_hi)),
+                                          _mm256_max_ps(_mm256_mul_ps(f_hi, i_lo), _mm256_mul_ps(f_hi, i_hi)));
+                lower = _mm256_max_ps(tn, lower);
+                upper = _mm256_min_ps(_mm256_mul_ps(tf, _mm256_set1_ps(WIDE_TFAR_SCALE)), upper);
+            }
+            _mm256_storeu_ps(tnear, lower);
+            return _mm256_movemask_ps(_mm256_cmp_ps(lower, upper, _CMP_LE_OQ));
+#elif defined(__SSE2__)
+            __m128 lower = _mm_set1_ps(packet.tmin_lo);
+            __m128 upper = _mm_set1_ps(packet.tmax_hi);
+            for (int a = 0; a < 3; a++) {
+                __m128 o_lo = _mm_set1_ps(packet.o_lo[a]), o_hi = _mm_set1_ps(packet.o_hi[a]);
+                __m128 i_lo = _mm_set1_ps(packet.inv_d_lo[a]), i_hi = _mm_set1_ps(packet.inv_d_hi[a]);
+                __m128 n_lo = _mm_sub_ps(_mm_loadu_ps(nears[a]), o_hi);
+                __m128 n_hi = _mm_sub_ps(_mm_loadu_ps(nears[a]), o_lo);
+                __m128 f_lo = _mm_sub_ps(_mm_loadu_ps(fars[a]), o_hi);
+                __m128 f_hi = _mm_sub_ps(_mm_loadu_ps(fars[a]), o_lo);
+                __m128 tn = _mm_min_ps(_mm_min_ps(_mm_mul_ps(n_lo, i_lo), _mm_mul_ps(n_lo, i_hi)),
+                                       _mm_min_ps(_mm_mul_ps(n_hi, i_lo), _mm_mul_ps(n_hi, i_hi)));
+                __m128 tf = _mm_max_ps(_mm_max_ps(_mm_mul_ps(f_lo, i_lo), _mm_mul_ps(f_lo, i_hi)),
+                                       _mm_max_ps(_mm_mul_ps(f_hi, i_lo), _mm_mul_ps(f_hi, i_hi)));
+                lower = _mm_max_ps(tn, lower);
+                upper = _mm_min_ps(_mm_mul_ps(tf, _mm_set1_ps(WIDE_TFAR_SCALE)), upper);
+            }
+            _mm_storeu_ps(tnear, lower);
+            return _mm_movemask_ps(_mm_cmple_ps(lower, upper));
+#else
+            int mask = 0;
+            for (int c = 0; c < BVH_WIDTH; c++) {
+                float lower = packet.tmin_lo, upper = packet.tmax_hi;
+                for (int a = 0; a < 3; a++) {
+                    float n_lo = nears[a][c] - packet.o_hi[a], n_hi = nears[a][c] - packet.o_lo[a];
+                    float f_lo = fars[a][c] - packet.o_hi[a], f_hi = fars[a][c] - packet.o_lo[a];
+                    float i_lo = packet.inv_d_lo[a], i_hi = packet.inv_d_hi[a];
+                    float tn = std::min(std::min(n_lo * i_lo, n_lo * i_hi), std::min(n_hi * i_lo, n_hi * i_hi));
+                    float tf = std::max(std::max(f_lo * i_lo, f_lo * i_hi), std::max(f_hi * i_lo, f_hi * i_hi));
+                    lower = std::max(tn, lower);
+                    upper = std::min(tf * WIDE_TFAR_SCALE, upper);
+                }
+                tnear[c] = lower;
+                if (lower <= upper) mask |= 1 << c;
+            }
+            return mask;
+#endif
+        }
+
+        /**
+         * Slab test of child c of a wide node against all the rays of a packet.
+         * Returns a bit mask of the rays that enter the child. NaNs are dropped
+         * as in intersect_children.
+         */
+        static inline int intersect_child_packet(const WideBVHNode &node, int c, const PacketRays &packet) {
+            const float mins[3] = {node.min_x[c], node.min_y[c], node.min_z[c]};
+            const float maxs[3] = {node.max_x[c], node.max_y[c], node.max_z[c]};
+
+#if defined(__AVX__)
+            __m256 scale = _mm256_set1_ps(WIDE_TFAR_SCALE);
+            __m256 t0 = _mm256_loadu_ps(packet.tmin);
+            __m256 t1 = _mm256_loadu_ps(packet.tmax);
+            for (int a = 0; a < 3; a++) {
+                __m256 o_near = _mm256_loadu_ps(packet.o_near[a]), o_far = _mm256_loadu_ps(packet.o_far[a]);
+                __m256 inv_d = _mm256_loadu_ps(packet.inv_d[a]);
+                __m256 near = _mm256_set1_ps(packet.dir_is_neg[a] ? maxs[a] : mins[a]);
+                __m256 far = _mm256_set1_ps(packet.dir_is_neg[a] ? mins[a] : maxs[a]);
+                t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near, o_near), inv_d), t0);
+                t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(far, o_far), inv_d), scale), t1);
+            }
+            return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#elif defined(__SSE2__)
+            __m128 scale = _mm_set1_ps(WIDE_TFAR_SCALE);
+            __m128 t0 = _mm_loadu_ps(packet.tmin);
+            __m128 t1 = _mm_loadu_ps(packet.tmax);
+            for (int a = 0; a < 3; a++) {
+                __m128 o_near = _mm_loadu_ps(packet.o_near[a]), o_far = _mm_loadu_ps(packet.o_far[a]);
+                __m128 inv_d = _mm_loadu_ps(packet.inv_d[a]);
+                __m128 near = _mm_set1_ps(packet.dir_is_neg[a] ? maxs[a] : mins[a]);
+                __m128 far = _mm_set1_ps(packet.dir_is_neg[a] ? mins[a] : maxs[a]);
+                t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near, o_near), inv_d), t0);
+                t1 = _mm_min_ps(_mm_mul_ps(_mm_mul_ps(_mm_sub_ps(far, o_far), inv_d), scale), t1);
+            }
+            return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+            int mask = 0;
+            for (int k = 0; k < BVH_PACKET_SIZE; k++) {
+                float t0 = packet.tmin[k], t1 = packet.tmax[k];
+                for (int a = 0; a < 3; a++) {
+                    float near = packet.dir_is_neg[a] ? maxs[a] : mins[a];
+                    float far = packet.dir_is_neg[a] ? mins[a] : maxs[a];
+                    float tn = (near - packet.o_near[a][k]) * packet.inv_d[a][k];
+                    float tf = (far - packet.o_far[a][k]) * packet.inv_d[a][k] * WIDE_TFAR_SCALE;
+                    if (tn > t0) t0 = tn;
+                    if (tf < t1) t1 = tf;
+                }
+                if (t0 <= t1) mask |= 1 << k;
+            }
+            return mask;
+#endif
+        }
+
+        /**
+         * Entry of the packet traversal stack, a child slot of a node together
+         * with the rays that enter it and a lower bound of their entry distances.
+         */
+        struct PacketStackEntry {
+            uint32_t child;
+            uint32_t n_primitives;
+            int mask;
+            float tnear;
+        };
+
+        void BVHAccel::has_intersection_packet(const Ray *rays, bool *hit, size_t n, uint32_t *occluder) const {
+            for (size_t start = 0; start < n; start += BVH_PACKET_SIZE) {
+                int count = (int) std::min(n - start, (size_t) BVH_PACKET_SIZE);
+                if (layout == BVH_LAYOUT_BINARY || count < BVH_PACKET_MIN || !is_coherent(rays + start, count)) {
+                    for (int k = 0; k < count; k++)
+                        hit[start + k] = has_intersection(rays[start + k], occluder);
+                }
+                else if (layout == BVH_LAYOUT_COMPRESSED) {
+                    if (profiling())
+                        has_intersection_packet<true>(quantized_nodes, rays + start, hit + start, count, occluder);
+                    else
+                        has_intersection_packet<false>(quantized_nodes, rays + start, hit + start, count, occluder);
+                }
+                else {
+                    if (profiling())
+                        has_intersection_packet<true>(wide_nodes, rays + start, hit + start, count, occluder);
+                    else
+                        has_intersection_packet<false>(wide_nodes, rays + start, hit + start, count, occluder);
+                }
+            }
+        }
+
+        void BVHAccel::intersect_packet(const Ray *rays, Intersection *i, bool *hit, size_t n) const {
+            for (size_t start = 0; start < n; start += BVH_PACKET_SIZE) {
+                int count = (int) std::min(n - start, (size_t) BVH_PACKET_SIZE);
+                if (layout == BVH_LAYOUT_BINARY || count < BVH_PACKET_MIN || !is_coherent(rays + start, count)) {
+                    for (int k = 0; k < count; k++)
+                        hit[start + k] = intersect(rays[start + k], i + start + k);
+                }
+                else {
+                    if (layout == BVH_LAYOUT_COMPRESSED && profiling())
+                        intersect_packet<true>(quantized_nodes, rays + start, i + start, hit + start, count);
+                    else if (layout == BVH_LAYOUT_COMPRESSED)
+                        intersect_packet<false>(quantized_nodes, rays + start, i + start, hit + start, count);
+                    else if (profiling())
+                        intersect_packet<true>(wide_nodes, rays + start, i + start, hit + start, count);
+                    else
+                        intersect_packet<false>(wide_nodes, rays + start, i + start, hit + start, count);
+                    for (int k = 0; k < count; k++)
+                        if (hit[start + k]) i[start + k].primitive->finish_intersection(rays[start + k], i + start + k);
+                }
+            }
+        }
+
+        template<bool Profile, typename Node>
+        void BVHAccel::has_intersection_packet(const vector<Node> &tree, const Ray *rays, bool *hit, int n,
+                                               uint32_t *occluder) const {
+            BVHTraversalStats &stats = thread_stats();
+            stats.rays += n;
+            stats.shadow_rays += n;
+            int active = (1 << n) - 1;
+            bool cached = occluder && *occluder < primitives.size();
+            for (int k = 0; k < n; k++) {
+                hit[k] = cached && has_intersection_leaf(rays[k], *occluder, 1, NULL);
+                if (!hit[k]) continue;
+                active &= ~(1 << k);
+                ++stats.occluded;
+                ++stats.occluder_hits;
+            }
+            if (tree.empty() || !active) return;
+
+            PacketRays packet(rays, n);
+            for (int k = 0; k < n; k++)
+                if (hit[k]) packet.tmax[k] = -1.0f;
+            packet.update_tmax();
+            WideBVHNode box;
+            float tnear[BVH_WIDTH];
+
+            BVHTraversalStack<PacketStackEntry, BVH_STACK_SIZE * BVH_WIDTH> stack;
+            stack.push({0, 0, active, 0.0f});
+
+            while (!stack.empty()) {
+                PacketStackEntry entry = stack.pop();
+                // rays leave the packet as soon as they are occluded
+                int mask = entry.mask & active;
+                if (!mask) continue;
+
+                if (entry.n_primitives > 0) {
+                    for (int k = 0; mask; k++, mask >>= 1) {
+                        if (!(mask & 1)) continue;
+                        if (has_intersection_leaf(rays[k], entry.child, entry.n_primitives, occluder)) {
+                            hit[k] = true;
+                            active &= ~(1 << k);
+                            packet.tmax[k] = -1.0f;
+                            ++stats.occluded;
+                        }
+                    }
+                    if (!active) return;
+                    packet.update_tmax();
+                    continue;
+                }
+
+                // any hit ends the traversal of a ray, so children are not sorted
+                const Node &node = tree[entry.child];
+                stats.nodes_visited += bitset<BVH_PACKET_SIZE>(mask).count();
+                if (Profile) node_visits[entry.child] += bitset<BVH_PACKET_SIZE>(mask).count();
+                const WideBVHNode &bounds = decode_node(node, box);
+                int children = intersect_children_packet(bounds, packet, tnear);
+                for (int c = 0; children; c++, children >>= 1) {
+                    if (!(children & 1)) continue;
+                    int child_mask = intersect_child_packet(bounds, c, packet) & mask;
+                    if (child_mask)
+                        stack.push({node.child[c], node.n_primitives[c], child_mask, tnear[c]});
+                }
+            }
+
+            if (occluder && active == (1 << n) - 1)
+                *occluder = BVH_NO_OCCLUDER;
+        }
+
+        template<bool Profile, typename Node>
+        void BVHAccel::intersect_packet(const vector<Node> &tree, const Ray *rays, Intersection *i,
+                                        bool *hit, int n) const {
+            BVHTraversalStats &stats = thread_stats();
+            stats.rays += n;
+            for (int k = 0; k < n; k++)
+                hit[k] = false;
+            if (tree.empty()) return;
+
+            PacketRays packet(rays, n);
+            WideBVHNode box;
+            float tnear[BVH_WIDTH];
+
+            BVHTraversalStack<PacketStackEntry, BVH_STACK_SIZE * BVH_WIDTH> stack;
+            stack.push({0, 0, (1 << n) - 1, 0.0f});
+
+            while (!stack.empty()) {
+                PacketStackEntry entry = stack.pop();
+                // hits shorten the rays, which culls farther entries
+                if (entry.tnear > packet.tmax_hi) continue;
+                int mask = entry.mask;
+
+                if (entry.n_primitives > 0) {
+                    for (int k = 0; mask; k++, mask >>= 1) {
+                        if (!(mask & 1)) continue;
+                        if (intersect_leaf(rays[k], entry.child, entry.n_primitives, i + k)) {
+                            hit[k] = true;
+                            packet.tmax[k] = round_outward(rays[k].max_t, 1);
+                        }
+                    }
+                    packet.update_tmax();
+                    continue;
+                }
+
+                const Node &node = tree[entry.child];
+                const WideBVHNode &bounds = decode_node(node, box);
+                stats.nodes_visited += bitset<BVH_PACKET_SIZE>(mask).count();
+                if (Profile) node_visits[entry.child] += bitset<BVH_PACKET_SIZE>(mask).count();
+
+                // push the hit children farthest first so the nearest is popped next
+                size_t base = stack.size();
+                int children = intersect_children_packet(bounds, packet, tnear);
+                for (int c = 0; children; c++, children >>= 1) {
+                    if (!(children & 1)) continue;
+                    int child_mask = intersect_child_packet(bounds, c, packet) & mask;
+                    if (!child_mask) continue;
+                    PacketStackEntry child = {node.child[c], node.n_primitives[c], child_mask, tnear[c]};
+                    stack.push(child);
+                    size_t k = stack.size() - 1;
+                    while (k > base && stack[k - 1].tnear < child.tnear) {
+                        stack[k] = stack[k - 1];
+                        k--;
+                    }
+                    stack[k] = child;
+                }
+            }
+        }
+
+    } // namespace SceneObjects
+} // namespace CGL
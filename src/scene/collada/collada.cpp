@@ -24,6 +24,7 @@ namespace CGL {
         Vector3D ColladaParser::up; // scene up direction
         Matrix4x4 ColladaParser::transform; // current transformation
         map<string, XMLElement *> ColladaParser::sources; // URI lookup table
+        map<pair<XMLElement *, string>, PolymeshInfo *> ColladaParser::polymeshes; // parsed meshes
 
 // Parser Helpers //
 
@@ -159,6 +160,7 @@ namespace CGL {
 
             // Set output scene pointer
             scene = sceneInfo;
+            polymeshes.clear();
 
             // Build uri table
             uri_load(root);
@@ -402,30 +404,39 @@ namespace CGL {
             else if (e_geometry) {
                 if (get_element(e_geometry, "mesh")) {
 
-                    // mesh geometry
-                    PolymeshInfo *polymesh = new PolymeshInfo();
-                    parse_polymesh(e_geometry, *polymesh);
-
-                    // mesh material
                     XMLElement *e_instance_material = get_element(xml,
                                                                   "instance_geometry/bind_material/technique_common/instance_material");
-                    if (e_instance_material) {
+                    string target = e_instance_material && e_instance_material->Attribute("target") ?
+                                    e_instance_material->Attribute("target") : "";
 
-                        if (!e_instance_material->Attribute("target")) {
-                            stat("Error: no target material in instance: " << e_instance_material);
-                            exit(EXIT_FAILURE);
-                        }
+                    // nodes placing a geometry already parsed with the same
+                    // material share its mesh, and become instances of it
+                    PolymeshInfo *&polymesh = polymeshes[make_pair(e_geometry, target)];
+                    if (!polymesh) {
 
-                        string material_id = e_instance_material->Attribute("target") + 1;
-                        XMLElement *e_material = uri_find(material_id);
-                        if (!e_material) {
-                            stat("Error: invalid target material id : " << material_id);
-                            exit(EXIT_FAILURE);
-                        }
+                        // mesh geometry
+                        polymesh = new PolymeshInfo();
+                        parse_polymesh(e_geometry, *polymesh);
 
-                        MaterialInfo *material = new MaterialInfo();
-                        parse_material(e_material, *material);
-                        polymesh->material = material;
+                        // mesh material
+                        if (e_instance_material) {
+
+                            if (!e_instance_material->Attribute("target")) {
+                                stat("Error: no target material in instance: " << e_instance_material);
+                                exit(EXIT_FAILURE);
+                            }
+
+                            string material_id = e_instance_material->Attribute("target") + 1;
+                            XMLElement *e_material = uri_find(material_id);
+                            if (!e_material) {
+                                stat("Error: invalid target material id : " << material_id);
+                                exit(EXIT_FAILURE);
+                            }
+
+                            MaterialInfo *material = new MaterialInfo();
+                            parse_material(e_material, *material);
+                            polymesh->material = material;
+                        }
                     }
 
                     node.instance = polymesh;
@@ -47,6 +47,10 @@ namespace CGL {
             // The lookup table is constructed when the file is loaded
             static std::map<std::string, XMLElement *> sources;
 
+            // Meshes already parsed, keyed by geometry and bound material, so
+            // that nodes instancing the same geometry share one PolymeshInfo
+            static std::map<std::pair<XMLElement *, std::string>, PolymeshInfo *> polymeshes;
+
             // Load Collada elements with UUID into lookup table
             static void uri_load(XMLElement *xml);
 
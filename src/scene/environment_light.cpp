@@ -169,7 +169,9 @@ namespace CGL {
                     conditional + marginal_index * w, conditional + (marginal_index + 1) * w, sample.x);
             uint32_t conditional_index = std::distance(conditional + marginal_index * w, conditional_it);
 
-            auto xy = Vector2D{static_cast<double>(conditional_index), static_cast<double>(marginal_index)};
+            // uniform within the pixel, so the pdf is a density over directions
+            auto xy = Vector2D{static_cast<double>(conditional_index), static_cast<double>(marginal_index)}
+                      + sampler_uniform2d.get_sample();
 
             auto theta_phi = xy_to_theta_phi(xy);
             *wi = theta_phi_to_dir(theta_phi);
@@ -181,6 +183,19 @@ namespace CGL {
             return sample_dir(Ray(p, *wi));
         }
 
+        double EnvironmentLight::pdf(const Vector3D p, const Vector3D wi, double *distToLight) const {
+            uint32_t w = envMap->w, h = envMap->h;
+            auto theta_phi = dir_to_theta_phi(wi);
+            auto xy = theta_phi_to_xy(theta_phi);
+            uint32_t x = std::min<uint32_t>(std::max(xy.x, 0.0), w - 1);
+            uint32_t y = std::min<uint32_t>(std::max(xy.y, 0.0), h - 1);
+            double sinTheta = sin(theta_phi.x);
+            if (sinTheta <= 0) return 0;
+
+            *distToLight = INF_D;
+            return pdf_envmap[y * w + x] * ((w * h) / (2 * pow(PI, 2.0) * sinTheta));
+        }
+
         Vector3D EnvironmentLight::sample_dir(const Ray &r) const {
             // TODO: Assignment 7 Part 3 Task 1
             // Use the helper functions to convert r.d into (x,y)
@@ -37,6 +37,12 @@ namespace CGL {
 
             bool is_delta_light() const { return false; }
 
+            /**
+             * Density of sample_L for the direction wi, which rays leaving the
+             * scene see the environment along.
+             */
+            double pdf(const Vector3D p, const Vector3D wi, double *distToLight) const;
+
             /**
               * Returns the color found on the environment map by travelling in a specific
               * direction. This entails:
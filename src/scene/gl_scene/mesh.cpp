@@ -36,6 +36,8 @@ namespace CGL {
             vector<Vector2D> texcoords = polyMesh.texcoords; // DELIBERATE COPY.
 
             mesh.build(polygons, vertices, texcoords);
+            static_mesh = NULL;
+            modification = static_modification = 0;
             if (polyMesh.material) {
                 bsdf = polyMesh.material->bsdf;
             }
@@ -71,7 +73,7 @@ namespace CGL {
             if (ImGui::TreeNode(this, "Mesh 0x%x", this)) {
                 if (ImGui::TreeNode(this, "Vertices")) {
                     for (VertexIter v = mesh.verticesBegin(); v != mesh.verticesEnd(); v++) {
-                        DragDouble3("Vertex", &v->position.x, 0.005);
+                        if (DragDouble3("Vertex", &v->position.x, 0.005)) modification++;
                     }
                     ImGui::TreePop();
                 }
@@ -385,6 +387,7 @@ namespace CGL {
             pos = worldTo3DH.inv() * pos;
 
             v->position = pos.to3D();
+            modification++;
         }
 
         void Mesh::collapse_selected_edge() {
@@ -393,6 +396,7 @@ namespace CGL {
             Edge *edge = element->getEdge();
             if (edge == nullptr) return;
             mesh.collapseEdge(edge->halfedge()->edge());
+            modification++;
             invalidate_selection();
         }
 
@@ -402,6 +406,7 @@ namespace CGL {
             Edge *edge = element->getEdge();
             if (edge == nullptr) return;
             mesh.flipEdge(edge->halfedge()->edge());
+            modification++;
             invalidate_selection();
         }
 
@@ -411,21 +416,25 @@ namespace CGL {
             Edge *edge = element->getEdge();
             if (edge == nullptr) return;
             mesh.splitEdge(edge->halfedge()->edge());
+            modification++;
             invalidate_selection();
         }
 
         void Mesh::upsample() {
             resampler.upsample(mesh);
+            modification++;
             invalidate_selection();
         }
 
         void Mesh::downsample() {
             resampler.downsample(mesh);
+            modification++;
             invalidate_selection();
         }
 
         void Mesh::resample() {
             resampler.resample(mesh);
+            modification++;
             invalidate_selection();
         }
 
@@ -540,7 +549,19 @@ namespace CGL {
         }
 
         SceneObjects::SceneObject *Mesh::get_static_object() {
-            return new SceneObjects::Mesh(mesh, bsdf);
+            // the static mesh holds the BSDF, replacing the material also recreates it
+            if (!static_mesh || static_modification != modification || static_mesh->get_bsdf() != bsdf) {
+                if (static_mesh)
+                    retired_static_meshes.push_back(static_mesh);
+                static_mesh = new SceneObjects::Mesh(mesh, bsdf);
+                static_modification = modification;
+            }
+            return static_mesh;
+        }
+
+        void Mesh::take_retired_static_objects(std::vector<SceneObjects::SceneObject *> &retired) {
+            retired.insert(retired.end(), retired_static_meshes.begin(), retired_static_meshes.end());
+            retired_static_meshes.clear();
         }
 
 
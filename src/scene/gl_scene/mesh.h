@@ -3,6 +3,7 @@
 
 #include "scene.h"
 
+#include "scene/object.h"
 #include "scene/collada/polymesh_info.h"
 #include "util/halfEdgeMesh.h"
 #include "application/meshEdit.h"
@@ -71,8 +72,17 @@ namespace CGL {
 
             BSDF *get_bsdf();
 
+            /**
+             * The static mesh is only recreated after the mesh or its material was
+             * replaced or edited, so that it keeps its BVH across static scenes.
+             */
             SceneObjects::SceneObject *get_static_object();
 
+            void take_retired_static_objects(std::vector<SceneObjects::SceneObject *> &retired);
+
+            SceneObjects::Mesh *static_mesh; ///< last static mesh created, placed again by the instances
+            std::vector<SceneObjects::Mesh *> retired_static_meshes; ///< static meshes replaced since the last scene
+
             // MeshView methods
             void collapse_selected_edge();
 
@@ -132,6 +142,9 @@ namespace CGL {
 
             // material
             BSDF *bsdf;
+
+            unsigned long modification;         ///< bumped by every edit of the mesh
+            unsigned long static_modification;  ///< modification the static mesh was created at
         };
 
     } // namespace GLScene
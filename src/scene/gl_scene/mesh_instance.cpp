@@ -0,0 +1,42 @@
+#include "mesh_instance.h"
+
+#include "scene/object.h"
+
+namespace CGL {
+    namespace GLScene {
+
+        MeshInstance::MeshInstance(Mesh *mesh, const Matrix4x4 &transform)
+                : mesh(mesh), transform(transform) {}
+
+        void MeshInstance::render_in_opengl() const {
+            glPushMatrix();
+            glMultMatrixd(&transform(0, 0));
+            mesh->render_in_opengl();
+            glPopMatrix();
+        }
+
+        BBox MeshInstance::get_bbox() {
+            BBox local = mesh->get_bbox(), bbox;
+            if (local.empty()) return bbox;
+            for (int c = 0; c < 8; c++) {
+                Vector3D corner((c & 1) ? local.max.x : local.min.x,
+                                (c & 2) ? local.max.y : local.min.y,
+                                (c & 4) ? local.max.z : local.min.z);
+                bbox.expand((transform * Vector4D(corner, 1)).to3D());
+            }
+            return bbox;
+        }
+
+        BSDF *MeshInstance::get_bsdf() {
+            return mesh->get_bsdf();
+        }
+
+        SceneObjects::SceneObject *MeshInstance::get_static_object() {
+            // place the current static mesh even if the mesh comes later in the
+            // scene, the replaced one is deleted once the renderer drops it
+            mesh->get_static_object();
+            return new SceneObjects::MeshInstance(mesh->static_mesh, transform);
+        }
+
+    } // namespace GLScene
+} // namespace CGL
@@ -0,0 +1,64 @@
+#ifndef CGL_GLSCENE_MESH_INSTANCE_H
+#define CGL_GLSCENE_MESH_INSTANCE_H
+
+#include "scene.h"
+#include "mesh.h"
+
+namespace CGL {
+    namespace GLScene {
+
+/**
+ * Another placement of a mesh loaded earlier in the scene.
+ * COLLADA nodes that instance geometry already used by a previous node are
+ * loaded as a transform relative to that mesh. Edits made to the mesh show up
+ * in all its instances.
+ */
+        class MeshInstance : public SceneObject {
+        public:
+            MeshInstance(Mesh *mesh, const Matrix4x4 &transform);
+
+            void set_draw_styles(DrawStyle *defaultStyle, DrawStyle *hoveredStyle,
+                                 DrawStyle *selectedStyle) {}
+
+            void render_in_opengl() const;
+
+            BBox get_bbox();
+
+            // All functions that are unused, because instances are edited through their mesh.
+            double test_selection(const Vector2D &p, const Matrix4x4 &worldTo3DH,
+                                  double minW) {
+                return -1;
+            }
+
+            void confirm_hover() {}
+
+            void confirm_select() {}
+
+            void invalidate_hover() {}
+
+            void invalidate_selection() {}
+
+            void get_selection_info(SelectionInfo *selectionInfo) {}
+
+            void drag_selection(float dx, float dy, const Matrix4x4 &worldTo3DH) {}
+
+            MeshView *get_mesh_view() { return nullptr; }
+
+            BSDF *get_bsdf();
+
+            /**
+             * The static instance refers to the static mesh last created by the
+             * instanced mesh, so the mesh must come first in the scene objects.
+             */
+            SceneObjects::SceneObject *get_static_object();
+
+        private:
+            Mesh *mesh;           ///< the instanced mesh
+            Matrix4x4 transform;  ///< transform from the space of the mesh to world space
+
+        };
+
+    } // namespace GLScene
+} // namespace CGL
+
+#endif //CGL_GLSCENE_MESH_INSTANCE_H
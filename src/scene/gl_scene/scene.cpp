@@ -165,7 +165,11 @@ namespace CGL {
                 staticLights.push_back(light->get_static_light());
             }
 
-            return new SceneObjects::Scene(staticObjects, staticLights);
+            SceneObjects::Scene *scene = new SceneObjects::Scene(staticObjects, staticLights);
+            for (SceneObject *obj: objects) {
+                obj->take_retired_static_objects(scene->retired_objects);
+            }
+            return scene;
         }
 
 
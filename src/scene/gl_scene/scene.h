@@ -123,6 +123,12 @@ namespace CGL {
              * expects all the objects to be
              */
             virtual SceneObjects::SceneObject *get_static_object() = 0;
+
+            /**
+             * Hand over the static objects that get_static_object replaced since
+             * the last call. The caller deletes them once nothing references them.
+             */
+            virtual void take_retired_static_objects(std::vector<SceneObjects::SceneObject *> &retired) {}
         };
 
 
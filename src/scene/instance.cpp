@@ -0,0 +1,81 @@
+#include "instance.h"
+
+#include "CGL/CGL.h"
+#include "GL/glew.h"
+
+namespace CGL {
+    namespace SceneObjects {
+
+        static bool is_identity(const Matrix4x4 &m) {
+            for (int i = 0; i < 4; i++)
+                for (int j = 0; j < 4; j++)
+                    if (m(i, j) != (i == j ? 1 : 0)) return false;
+            return true;
+        }
+
+        Instance::Instance(BVHAccel *bvh, const Matrix4x4 &transform)
+                : bvh(bvh), transform(transform) {
+            inv_transform = transform.inv();
+            normal_transform = inv_transform.T();
+            identity = is_identity(transform);
+
+            BBox local = bvh->get_bbox();
+            if (local.empty()) return;
+            for (int c = 0; c < 8; c++) {
+                Vector3D corner((c & 1) ? local.max.x : local.min.x,
+                                (c & 2) ? local.max.y : local.min.y,
+                                (c & 4) ? local.max.z : local.min.z);
+                bbox.expand((transform * Vector4D(corner, 1)).to3D());
+            }
+        }
+
+        Ray Instance::to_object(const Ray &r) const {
+            Ray local((inv_transform * Vector4D(r.o, 1)).to3D(),
+                      (inv_transform * Vector4D(r.d, 0)).to3D(), r.max_t, r.depth);
+            local.min_t = r.min_t;
+            local.wavelength = r.wavelength;
+            local.wavelengths = r.wavelengths;
+            local.color = r.color;
+            return local;
+        }
+
+        bool Instance::has_intersection(const Ray &r) const {
+            if (identity) return bvh->has_intersection(r);
+            return bvh->has_intersection(to_object(r));
+        }
+
+        bool Instance::intersect(const Ray &r, Intersection *i) const {
+            if (identity) {
+                if (!bvh->intersect(r, i))
+                    return false;
+            }
+            else {
+                Ray local = to_object(r);
+                if (!bvh->intersect(local, i))
+                    return false;
+
+                r.max_t = local.max_t;
+                i->n = (normal_transform * Vector4D(i->n, 0)).to3D().unit();
+            }
+
+            // the shared BVH already finished the hit, there is nothing left to defer
+            i->primitive = this;
+            return true;
+        }
+
+        void Instance::draw(const Color &c, float alpha) const {
+            glPushMatrix();
+            glMultMatrixd(&transform(0, 0));
+            bvh->draw(bvh->get_root(), c, alpha);
+            glPopMatrix();
+        }
+
+        void Instance::drawOutline(const Color &c, float alpha) const {
+            glPushMatrix();
+            glMultMatrixd(&transform(0, 0));
+            bvh->drawOutline(bvh->get_root(), c, alpha);
+            glPopMatrix();
+        }
+
+    } // namespace SceneObjects
+} // namespace CGL
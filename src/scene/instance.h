@@ -0,0 +1,92 @@
+#ifndef CGL_STATICSCENE_INSTANCE_H
+#define CGL_STATICSCENE_INSTANCE_H
+
+#include "primitive.h"
+#include "bvh.h"
+
+#include "CGL/matrix4x4.h"
+
+namespace CGL {
+    namespace SceneObjects {
+
+/**
+ * A placement of a shared BVH in the scene.
+ * The instance is a primitive of the top level BVH. It holds a transform and
+ * a pointer to the bottom level BVH of the instanced geometry, which is built
+ * once in object space and shared by all the instances of that geometry. Rays
+ * are transformed into object space to traverse the shared BVH.
+ */
+        class Instance : public Primitive {
+        public:
+
+            /**
+             * Constructor.
+             * \param bvh bottom level BVH of the instanced geometry, not owned
+             * \param transform object to world transform of the instance
+             */
+            Instance(BVHAccel *bvh, const Matrix4x4 &transform);
+
+            /**
+             * Get the world space bounding box of the instance.
+             * \return world space bounding box of the instance
+             */
+            BBox get_bbox() const { return bbox; }
+
+            /**
+             * Ray - Instance intersection.
+             * Transform the ray into object space and test it against the shared BVH.
+             * \param r ray to test intersection with
+             * \return true if the given ray intersects with the instance,
+                       false otherwise
+             */
+            bool has_intersection(const Ray &r) const;
+
+            /**
+             * Ray - Instance intersection 2.
+             * Transform the ray into object space and intersect the shared BVH. The
+             * parametric distance is the same in both spaces since the direction is
+             * not renormalized, only the normal is transformed back to world space.
+             * The hit is finished by the shared BVH, and recorded as a hit on the
+             * instance.
+             * \param r ray to test intersection with
+             * \param i address to store intersection info
+             * \return true if the given ray intersects with the instance,
+                       false otherwise
+             */
+            bool intersect(const Ray &r, Intersection *i) const;
+
+            /**
+             * Get BSDF.
+             * The BSDF is reported by the instanced primitives.
+             */
+            BSDF *get_bsdf() const { return NULL; }
+
+            /**
+             * Draw with OpenGL (for visualizer)
+             */
+            void draw(const Color &c, float alpha) const;
+
+            /**
+             * Draw outline with OpenGL (for visualizer)
+             */
+            void drawOutline(const Color &c, float alpha) const;
+
+        private:
+
+            /**
+             * Copy of r in object space.
+             */
+            Ray to_object(const Ray &r) const;
+
+            BVHAccel *bvh;                ///< shared bottom level BVH
+            Matrix4x4 transform;          ///< object to world
+            Matrix4x4 inv_transform;      ///< world to object
+            Matrix4x4 normal_transform;   ///< object to world for normals
+            BBox bbox;                    ///< world space bounds
+            bool identity;                ///< object space is world space, rays are not transformed
+        };
+
+    } // namespace SceneObjects
+} // namespace CGL
+
+#endif // CGL_STATICSCENE_INSTANCE_H
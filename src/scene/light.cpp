@@ -89,10 +89,29 @@ namespace CGL {
             double dist = sqrt(sqDist);
             *wi = d / dist;
             *distToLight = dist;
-            *pdf = sqDist / (area * fabs(cosTheta));
+            *pdf = sqDist / (area * fabs(cosTheta / dist));
             return cosTheta < 0 ? radiance : Vector3D();
         };
 
+/**
+ * The area light is found by rays through its emissive geometry, which is
+ * taken to match its rectangle. Like sample_L, it only emits towards its
+ * front, so the rays reaching its back have no density.
+ */
+        double AreaLight::pdf(const Vector3D p, const Vector3D wi, double *distToLight) const {
+            double cosTheta = dot(wi, direction);
+            if (cosTheta >= 0) return 0;
+            double t = dot(position - p, direction) / cosTheta;
+            if (t <= 0) return 0;
+
+            Vector3D q = p + t * wi - position;
+            if (fabs(dot(q, dim_x)) > 0.5 * dim_x.norm2() || fabs(dot(q, dim_y)) > 0.5 * dim_y.norm2())
+                return 0;
+
+            *distToLight = t;
+            return t * t / (area * fabs(cosTheta));
+        }
+
 
 // Sphere Light //
 
@@ -95,6 +95,8 @@ namespace CGL {
 
             bool is_delta_light() const { return false; }
 
+            double pdf(const Vector3D p, const Vector3D wi, double *distToLight) const;
+
             Vector3D radiance;
             Vector3D position;
             Vector3D direction;
@@ -1,6 +1,7 @@
 #include "object.h"
 #include "sphere.h"
 #include "triangle.h"
+#include "instance.h"
 
 #include <vector>
 #include <iostream>
@@ -43,9 +44,41 @@ namespace CGL {
 
             this->bsdf = bsdf;
 
+            instanced = false;
+            bvh = NULL;
+
+        }
+
+        Mesh::~Mesh() {
+            delete bvh;
+            for (Primitive *p: bvh_triangles)
+                delete p;
+            delete[] positions;
+            delete[] normals;
         }
 
         vector<Primitive *> Mesh::get_primitives() const {
+            if (instanced)
+                return vector<Primitive *>(1, new Instance(get_bvh(), Matrix4x4::identity()));
+            return get_triangles();
+        }
+
+        BVHAccel *Mesh::get_bvh(const BVHBuildOptions &options) const {
+            if (!has_bvh(options)) {
+                delete bvh;
+                for (Primitive *p: bvh_triangles)
+                    delete p;
+                bvh_triangles = get_triangles();
+                bvh = new BVHAccel(bvh_triangles, options.max_leaf_size, options.method, options.layout,
+                                   options.num_threads, options.split_budget);
+            }
+            bvh_options = options;
+            bvh->set_precision(options.precision);
+            bvh->set_node_order(options.node_order);
+            return bvh;
+        }
+
+        vector<Primitive *> Mesh::get_triangles() const {
 
             vector<Primitive *> primitives;
             size_t num_triangles = indices.size() / 3;
@@ -62,6 +95,21 @@ namespace CGL {
             return bsdf;
         }
 
+// Mesh instance //
+
+        MeshInstance::MeshInstance(Mesh *mesh, const Matrix4x4 &transform)
+                : mesh(mesh), transform(transform) {
+            mesh->instanced = true;
+        }
+
+        vector<Primitive *> MeshInstance::get_primitives() const {
+            return vector<Primitive *>(1, new Instance(mesh->get_bvh(), transform));
+        }
+
+        BSDF *MeshInstance::get_bsdf() const {
+            return mesh->get_bsdf();
+        }
+
 // Sphere object //
 
         SphereObject::SphereObject(const Vector3D o, double r, BSDF *bsdf) {
@@ -3,6 +3,7 @@
 
 #include "util/halfEdgeMesh.h"
 #include "scene.h"
+#include "bvh.h"
 
 namespace CGL {
     namespace SceneObjects {
@@ -21,13 +22,40 @@ namespace CGL {
              */
             Mesh(const HalfedgeMesh &mesh, BSDF *bsdf);
 
+            ~Mesh();
+
             /**
              * Get all the primitives (Triangle) in the mesh.
              * Note that Triangle reference the mesh for the actual data.
+             * If the mesh is instanced, this is a single identity Instance of the
+             * BVH of the mesh instead, so that the triangles are not stored twice.
+             * That BVH is built with the options last passed to get_bvh.
              * \return all the primitives in the mesh
              */
             vector<Primitive *> get_primitives() const;
 
+            /**
+             * Get the BVH over the triangles of the mesh.
+             * It is built with the given options on first use and shared by all the
+             * instances of the mesh. The editor keeps a static mesh until the mesh
+             * is edited, so its BVH is also reused across static scenes, unless
+             * the options change the tree, in which case it is rebuilt.
+             */
+            BVHAccel *get_bvh(const BVHBuildOptions &options) const;
+
+            /**
+             * Get the BVH over the triangles of the mesh, built with the options
+             * of the last call to get_bvh(options), or the defaults.
+             */
+            BVHAccel *get_bvh() const { return get_bvh(bvh_options); }
+
+            /**
+             * Whether get_bvh would reuse the BVH of the mesh for these options.
+             */
+            bool has_bvh(const BVHBuildOptions &options) const {
+                return bvh != NULL && bvh_options.same_tree(options);
+            }
+
             /**
              * Get the BSDF of the surface material of the mesh.
              * \return BSDF of the surface material of the mesh
@@ -37,12 +65,55 @@ namespace CGL {
             Vector3D *positions;  ///< position array
             Vector3D *normals;    ///< normal array
 
+            bool instanced;       ///< the mesh is also placed by MeshInstance objects
+
         private:
 
+            /**
+             * Create a Triangle for every face of the mesh.
+             */
+            vector<Primitive *> get_triangles() const;
+
             BSDF *bsdf; ///< BSDF of surface material
 
             vector<size_t> indices;  ///< triangles defined by indices
 
+            mutable BVHAccel *bvh;                ///< BVH shared by the instances, built on demand
+            mutable vector<Primitive *> bvh_triangles; ///< triangles bvh was built over, owned by the mesh
+            mutable BVHBuildOptions bvh_options;  ///< options bvh was built with
+
+        };
+
+/**
+ * Another placement of a triangle mesh object.
+ * The instance only stores a transform relative to the mesh, all placements
+ * of the mesh share its triangles and BVH.
+ */
+        class MeshInstance : public SceneObject {
+        public:
+
+            /**
+             * Constructor.
+             * \param mesh the instanced mesh, which is marked as instanced
+             * \param transform transform from the space of the mesh to world space
+             */
+            MeshInstance(Mesh *mesh, const Matrix4x4 &transform);
+
+            /**
+             * Get the single Instance primitive placing the BVH of the mesh, built
+             * with the options last passed to Mesh::get_bvh.
+             * \return the primitive of the instance
+             */
+            vector<Primitive *> get_primitives() const;
+
+            /**
+             * Get the BSDF of the surface material of the instanced mesh.
+             */
+            BSDF *get_bsdf() const;
+
+            const Mesh *mesh;     ///< the instanced mesh
+            Matrix4x4 transform;  ///< mesh to world transform
+
         };
 
 /**
@@ -4,6 +4,8 @@
 #include "pathtracer/intersection.h"
 #include "scene/bbox.h"
 
+#include <algorithm>
+
 namespace CGL {
     namespace SceneObjects {
 
@@ -15,12 +17,36 @@ namespace CGL {
         class Primitive {
         public:
 
+            /**
+             * Destructor. Primitives, aggregates included, are deleted through
+             * base class pointers.
+             */
+            virtual ~Primitive() {}
+
             /**
              * Get the world space bounding box of the primitive.
              * \return world space bounding box of the primitive
              */
             virtual BBox get_bbox() const = 0;
 
+            /**
+             * Get the bounding box of the part of the primitive inside a box.
+             * Used by the spatial splits of the BVH builder. By default this is
+             * the overlap of the bounding box of the primitive with the box,
+             * which is conservative.
+             * \param box the box to clip the primitive to
+             * \return bounding box of the clipped primitive, empty if outside
+             */
+            virtual BBox get_clipped_bbox(const BBox &box) const {
+                BBox bb = get_bbox();
+                Vector3D min(std::max(bb.min.x, box.min.x), std::max(bb.min.y, box.min.y),
+                             std::max(bb.min.z, box.min.z));
+                Vector3D max(std::min(bb.max.x, box.max.x), std::min(bb.max.y, box.max.y),
+                             std::min(bb.max.z, box.max.z));
+                if (min.x > max.x || min.y > max.y || min.z > max.z) return BBox();
+                return BBox(min, max);
+            }
+
             /**
              * Ray - Primitive intersection.
              * Check if the given ray intersects with the primitive, no intersection
@@ -43,6 +69,16 @@ namespace CGL {
              */
             virtual bool intersect(const Ray &r, Intersection *i) const = 0;
 
+            /**
+             * Fill in the shading data of a hit recorded by intersect.
+             * intersect only stores what the traversal needs to find the closest
+             * hit, the normal and the BSDF are computed once for that hit. By
+             * default intersect is expected to have filled in everything.
+             * \param r the ray that hit the primitive
+             * \param i intersection info stored by intersect
+             */
+            virtual void finish_intersection(const Ray &r, Intersection *i) const {}
+
             /**
              * Get BSDF.
              * Return the BSDF of the surface material of the primitive.
@@ -15,6 +15,8 @@ namespace CGL {
         class SceneObject {
         public:
 
+            virtual ~SceneObject() {}
+
             /**
              * Get all the primitives in the scene object.
              * \return a vector of all the primitives in the scene object
@@ -40,6 +42,18 @@ namespace CGL {
 
             virtual bool is_delta_light() const = 0;
 
+            /**
+             * Density with which sample_L picks the direction wi from p, for the
+             * lights that a ray along wi also finds, as the emission at its hit or
+             * as the environment once it leaves the scene. The other lights return
+             * zero, and their samples keep their full weight, as do the directions
+             * along which the light does not emit towards p.
+             * \param distToLight address to store the distance to the light along wi
+             */
+            virtual double pdf(const Vector3D p, const Vector3D wi, double *distToLight) const {
+                return 0;
+            }
+
         };
 
 
@@ -59,6 +73,10 @@ namespace CGL {
             // for sake of consistency of the scene object Interface
             std::vector<SceneLight *> lights;
 
+            // objects of earlier scenes replaced by edits, which the BVH of the
+            //  renderer may reference until it is built for this scene.
+            std::vector<SceneObject *> retired_objects;
+
             // TODO (sky) :
             // Adding object with emission BSDFs as mesh lights and sphere lights so
             // that light sampling configurations also applies to mesh lights.
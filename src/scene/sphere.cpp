@@ -64,15 +64,18 @@ namespace CGL {
                 return false;
 
             i->t = t1;
-            i->n = (r.o + t1 * r.d - this->o).unit();
             i->primitive = this;
-            i->bsdf = get_bsdf();
 
             r.max_t = t1;
 
             return true;
         }
 
+        void Sphere::finish_intersection(const Ray &r, Intersection *i) const {
+            i->n = (r.o + i->t * r.d - this->o).unit();
+            i->bsdf = get_bsdf();
+        }
+
         void Sphere::draw(const Color &c, float alpha) const {
             Misc::draw_sphere_opengl(o, r, c);
         }
@@ -56,6 +56,13 @@ namespace CGL {
              */
             bool intersect(const Ray &r, Intersection *i) const;
 
+            /**
+             * Compute the normal at the recorded hit and look up the BSDF.
+             * \param r the ray that hit the sphere
+             * \param i intersection info stored by intersect
+             */
+            void finish_intersection(const Ray &r, Intersection *i) const;
+
             /**
              * Get BSDF.
              * In the case of a sphere, the surface material BSDF is stored in
@@ -24,6 +24,46 @@ namespace CGL {
             return bbox;
         }
 
+        BBox Triangle::get_clipped_bbox(const BBox &box) const {
+            // Sutherland-Hodgman, the clipped polygon has at most 9 vertices
+            Vector3D poly[9] = {p1, p2, p3}, clipped[9];
+            int n = 3;
+            for (int plane = 0; plane < 6 && n > 0; plane++) {
+                int axis = plane % 3;
+                bool upper = plane >= 3;
+                double bound = upper ? box.max[axis] : box.min[axis];
+                auto inside = [&](const Vector3D &p) { return upper ? p[axis] <= bound : p[axis] >= bound; };
+
+                int m = 0;
+                for (int i = 0; i < n; i++) {
+                    const Vector3D &a = poly[i], &b = poly[(i + 1) % n];
+                    if (inside(a))
+                        clipped[m++] = a;
+                    if (inside(a) != inside(b)) {
+                        Vector3D p = a + (b - a) * ((bound - a[axis]) / (b[axis] - a[axis]));
+                        p[axis] = bound;
+                        clipped[m++] = p;
+                    }
+                }
+                n = m;
+                for (int i = 0; i < n; i++)
+                    poly[i] = clipped[i];
+            }
+
+            BBox clipped_bbox;
+            for (int i = 0; i < n; i++)
+                clipped_bbox.expand(poly[i]);
+            if (clipped_bbox.empty()) return clipped_bbox;
+
+            // the intersection points carry rounding errors, keep the result inside the box
+            Vector3D min = clipped_bbox.min, max = clipped_bbox.max;
+            for (int a = 0; a < 3; a++) {
+                min[a] = std::min(std::max(min[a], box.min[a]), box.max[a]);
+                max[a] = std::max(std::min(max[a], box.max[a]), box.min[a]);
+            }
+            return BBox(min, max);
+        }
+
         bool Triangle::has_intersection(const Ray &r) const {
             // TODO: Part 1, Task 3: implement ray-triangle intersection
             // The difference between this function and the next function is that the next
@@ -80,9 +120,9 @@ namespace CGL {
             if (b2 < 0 || b1 + b2 > 1) return false;
 
             isect->t = t;
-            isect->n = (1 - b1 - b2) * n1 + b1 * n2 + b2 * n3;
             isect->primitive = this;
-            isect->bsdf = get_bsdf();
+            isect->u = b1;
+            isect->v = b2;
 
             r.max_t = t;
 
@@ -90,6 +130,11 @@ namespace CGL {
 
         }
 
+        void Triangle::finish_intersection(const Ray &r, Intersection *isect) const {
+            isect->n = (1 - isect->u - isect->v) * n1 + isect->u * n2 + isect->v * n3;
+            isect->bsdf = get_bsdf();
+        }
+
         void Triangle::draw(const Color &c, float alpha) const {
             glColor4f(c.r, c.g, c.b, alpha);
             glBegin(GL_TRIANGLES);
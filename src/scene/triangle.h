@@ -35,6 +35,14 @@ namespace CGL {
              */
             BBox get_bbox() const;
 
+            /**
+             * Get the bounding box of the part of the triangle inside a box.
+             * The triangle is clipped against the six planes of the box.
+             * \param box the box to clip the triangle to
+             * \return bounding box of the clipped triangle, empty if outside
+             */
+            BBox get_clipped_bbox(const BBox &box) const;
+
             /**
              * Ray - Triangle intersection.
              * Check if the given ray intersects with the triangle, no intersection
@@ -57,6 +65,13 @@ namespace CGL {
              */
             bool intersect(const Ray &r, Intersection *i) const;
 
+            /**
+             * Compute the normal at the recorded hit and look up the BSDF.
+             * \param r the ray that hit the triangle
+             * \param i intersection info stored by intersect
+             */
+            void finish_intersection(const Ray &r, Intersection *i) const;
+
             /**
              * Get BSDF.
              * In the case of a triangle, the surface material BSDF is stored in
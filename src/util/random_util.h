@@ -1,24 +1,36 @@
 #ifndef CGL_RANDOMUTIL_H
 #define CGL_RANDOMUTIL_H
 
+#include <atomic>
 #include <random>
 
 // #define XORSHIFT_RAND
 
 namespace CGL {
 
-    static std::mersenne_twister_engine<std::uint_fast32_t, 32, 624, 397, 31, 0x9908b0df,
+    typedef std::mersenne_twister_engine<std::uint_fast32_t, 32, 624, 397, 31, 0x9908b0df,
             11, 0xffffffff, 7, 0x9d2c5680, 15, 0xefc60000, 18,
-            1812433253> minstd_engine;
+            1812433253> minstd_engine_t;
 
-    static double rmax = 1.0 / (minstd_engine.max() - minstd_engine.min());
+    static const double rmax = 1.0 / (minstd_engine_t::max() - minstd_engine_t::min());
 
+/**
+ * Returns the engine of the calling thread. The render threads draw at the
+ * same time, each from its own engine, and each thread gets the next seed
+ * so that they do not repeat one sequence.
+ */
+    inline minstd_engine_t &minstd_engine() {
+        static std::atomic<std::uint_fast32_t> next_seed(minstd_engine_t::default_seed);
+        thread_local minstd_engine_t engine(next_seed++);
+        return engine;
+    }
 
 /**
  * Returns a number distributed uniformly over [0, 1].
  */
     inline double random_uniform() {
-        return clamp(double(minstd_engine() - minstd_engine.min()) * rmax, 0.0000001, 0.99999999);
+        minstd_engine_t &engine = minstd_engine();
+        return clamp(double(engine() - minstd_engine_t::min()) * rmax, 0.0000001, 0.99999999);
     }
 
 /**